@@ -38,7 +38,12 @@ extern "C"
 #ifdef MBEDTLS_SSL_OUT_CONTENT_LEN
 #undef MBEDTLS_SSL_OUT_CONTENT_LEN
 #endif
-#define MBEDTLS_SSL_OUT_CONTENT_LEN 4096
+#define MBEDTLS_SSL_OUT_CONTENT_LEN CONFIG_APP_TLS_OUT_CONTENT_LEN
+
+/* The input content length is CONFIG_MBEDTLS_SSL_MAX_CONTENT_LEN, set by the
+   TLS profile. Zephyr's TLS sockets request a max_fragment_len matching it when
+   it is below 16 KiB, which the low RAM profile does: the server has to honor
+   the extension, the input buffer cannot hold larger records. */
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,189 @@
+# @file      compress_image.py
+# @author    Theodore Bardy
+#
+# @note      This file is part of Witekio's Zephyr Demo project
+# @brief     Compress a signed MCUboot image for the 'zephyr-image-hs' module
+
+"""Compress a signed MCUboot image with heatshrink (LZSS).
+
+The output stream starts with an 8 bytes header ('H', 'S', window bits,
+lookahead bits, decompressed size as little endian 32 bits) followed by a
+standard heatshrink bit stream. The stream is decoded again after compression
+to check it round-trips, and the compression ratio and the RAM needed by the
+device decoder are reported.
+
+Optionally a Mender artifact of type 'zephyr-image-hs' is written using the
+mender-artifact utility.
+"""
+
+import argparse
+import struct
+import subprocess
+import sys
+import time
+
+# Must match OTA_DECOMPRESS_OUT_SIZE in src/ota/src/ota_decompress.h
+DECODER_OUT_SIZE = 256
+# Approximate size of the decoder context fields other than the buffers
+DECODER_CTX_OVERHEAD = 48
+# Keep the candidate lists short, the window is small anyway
+MAX_CANDIDATES = 64
+
+
+class BitWriter:
+    def __init__(self):
+        self.out = bytearray()
+        self.bits = 0
+        self.count = 0
+
+    def write(self, value, count):
+        self.bits = (self.bits << count) | value
+        self.count += count
+        while self.count >= 8:
+            self.count -= 8
+            self.out.append((self.bits >> self.count) & 0xFF)
+        self.bits &= (1 << self.count) - 1
+
+    def flush(self):
+        if self.count > 0:
+            self.out.append((self.bits << (8 - self.count)) & 0xFF)
+            self.bits = 0
+            self.count = 0
+        return bytes(self.out)
+
+
+def compress(data, window_bits, lookahead_bits):
+    window = 1 << window_bits
+    max_len = 1 << lookahead_bits
+    # A back-reference costs 1 + W + L bits, a literal 9 bits
+    min_len = (1 + window_bits + lookahead_bits) // 9 + 1
+    writer = BitWriter()
+    candidates = {}
+    pos = 0
+    size = len(data)
+
+    while pos < size:
+        best_len = 0
+        best_off = 0
+        key = data[pos:pos + min_len]
+        if len(key) == min_len:
+            for cand in reversed(candidates.get(key, [])):
+                off = pos - cand
+                if off > window:
+                    break
+                length = min_len
+                limit = min(max_len, size - pos)
+                while length < limit and data[cand + length] == data[pos + length]:
+                    length += 1
+                if length > best_len:
+                    best_len = length
+                    best_off = off
+                    if length == limit:
+                        break
+
+        step = best_len if best_len >= min_len else 1
+        if best_len >= min_len:
+            writer.write(0, 1)
+            writer.write(best_off - 1, window_bits)
+            writer.write(best_len - 1, lookahead_bits)
+        else:
+            writer.write(1, 1)
+            writer.write(data[pos], 8)
+
+        for i in range(pos, pos + step):
+            k = data[i:i + min_len]
+            lst = candidates.setdefault(k, [])
+            lst.append(i)
+            if len(lst) > MAX_CANDIDATES:
+                del lst[0]
+        pos += step
+
+    return writer.flush()
+
+
+def decompress(stream, window_bits, lookahead_bits, size):
+    out = bytearray()
+    bits = 0
+    count = 0
+    idx = 0
+
+    def get(n):
+        nonlocal bits, count, idx
+        while count < n:
+            if idx >= len(stream):
+                return None
+            bits = (bits << 8) | stream[idx]
+            idx += 1
+            count += 8
+        count -= n
+        return (bits >> count) & ((1 << n) - 1)
+
+    while len(out) < size:
+        tag = get(1)
+        if tag is None:
+            break
+        if tag:
+            out.append(get(8))
+        else:
+            off = get(window_bits) + 1
+            length = get(lookahead_bits) + 1
+            for _ in range(length):
+                out.append(out[-off] if off <= len(out) else 0)
+    return bytes(out)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("input", help="signed image (zephyr.signed.bin)")
+    parser.add_argument("output", help="compressed image")
+    parser.add_argument("-w", "--window-bits", type=int, default=10,
+                        help="log2 of the window size, must not exceed "
+                             "CONFIG_OTA_IMAGE_COMPRESSION_WINDOW_BITS")
+    parser.add_argument("-l", "--lookahead-bits", type=int, default=4,
+                        help="log2 of the longest back-reference")
+    parser.add_argument("--artifact-name",
+                        help="also write <output>.mender with this name")
+    parser.add_argument("--device-type", default="esp32s3_devkitc",
+                        help="device type of the Mender artifact")
+    args = parser.parse_args()
+
+    if not 4 <= args.window_bits <= 15 or not 1 <= args.lookahead_bits < args.window_bits:
+        parser.error("invalid window/lookahead bits")
+
+    with open(args.input, "rb") as f:
+        data = f.read()
+
+    start = time.monotonic()
+    stream = compress(data, args.window_bits, args.lookahead_bits)
+    elapsed = time.monotonic() - start
+
+    if decompress(stream, args.window_bits, args.lookahead_bits, len(data)) != data:
+        sys.exit("error: compressed stream does not round-trip")
+
+    header = struct.pack("<ccBBI", b"H", b"S", args.window_bits,
+                         args.lookahead_bits, len(data))
+    with open(args.output, "wb") as f:
+        f.write(header + stream)
+
+    total = len(header) + len(stream)
+    ram = (1 << args.window_bits) + DECODER_OUT_SIZE + DECODER_CTX_OVERHEAD
+    print(f"input:       {len(data)} bytes")
+    print(f"output:      {total} bytes")
+    print(f"ratio:       {len(data) / total:.2f} ({100 * total / len(data):.1f}%)")
+    print(f"saved:       {len(data) - total} bytes")
+    print(f"decoder RAM: ~{ram} bytes (w={args.window_bits}, l={args.lookahead_bits})")
+    print(f"encode time: {elapsed:.1f} s")
+
+    if args.artifact_name:
+        subprocess.run(["mender-artifact", "write", "module-image",
+                        "--type", "zephyr-image-hs",
+                        "--file", args.output,
+                        "--artifact-name", args.artifact_name,
+                        "--device-type", args.device_type,
+                        "--compression", "none",
+                        "--output-path", args.output + ".mender"],
+                       check=True)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,145 @@
+# @file      corrupt_artifact_test.py
+# @author    Theodore Bardy
+#
+# @note      This file is part of Witekio's Zephyr Demo project
+# @brief     Corrupted artifact test on native_sim
+
+"""Corrupted artifact test on native_sim.
+
+The native_sim executable is offered an artifact corrupted by the mock Mender
+server (see --corrupt in mock_mender_server.py), once with a byte of the
+MCUboot image header flipped and once with a byte of the image body flipped.
+The payload checksum of the manifest is updated by the server, so only the
+verification of the streamed image (CONFIG_OTA_IMAGE_UPDATE_MODULE) can
+reject it.
+
+The test passes when, for each corruption, the Update Module aborted the
+download ("Download aborted after N of M bytes"), the device reported the
+failure of the deployment without installing the image, and a corrupted
+header was rejected within the first chunk received. A corrupted body can
+only be detected once the SHA256 TLV following it is received.
+
+Build the executable with an uncompressed artifact, the default:
+
+    west build -b native_sim --no-sysbuild .
+    python3 scripts/corrupt_artifact_test.py \\
+        --exe build/zephyr/zephyr.exe --artifact build/zephyr/zephyr.mender
+"""
+
+import argparse
+import os
+import re
+import subprocess
+import sys
+import tempfile
+import threading
+import time
+
+from mock_mender_server import ARTIFACTS, CORRUPTIONS, MockMenderServer
+
+ABORT_LINE = re.compile(r"Download aborted after (\d+) of (\d+) bytes")
+# Error logged by the Update Module for each corruption
+ERRORS = {
+    "header": "Invalid image magic",
+    "body": "Image hash mismatch",
+}
+# Statuses reported once the image is accepted
+INSTALL_STATUSES = ("installing", "rebooting", "success")
+
+
+def run_once(args, corrupt):
+    """Runs the executable until the deployment is over, returns the result
+    of the run."""
+    server = MockMenderServer(("127.0.0.1", args.port), args.artifact,
+                              args.device_type, corrupt=corrupt)
+    server.start()
+
+    with tempfile.TemporaryDirectory() as workdir:
+        command = [os.path.abspath(args.exe), "--wake-after-ms=0",
+                   "--flash=" + os.path.join(workdir, "flash.bin")]
+        if args.rt:
+            command.append("--rt")
+        process = subprocess.Popen(command, cwd=workdir, text=True,
+                                   stdout=subprocess.PIPE,
+                                   stderr=subprocess.STDOUT)
+
+        def stop_when_done():
+            deadline = time.monotonic() + args.timeout
+            while (process.poll() is None and not server.finished
+                   and time.monotonic() < deadline):
+                time.sleep(0.2)
+            process.terminate()
+        threading.Thread(target=stop_when_done, daemon=True).start()
+
+        output = []
+        for line in process.stdout:
+            output.append(line)
+            if args.verbose:
+                print(line, end="")
+        process.wait()
+    server.stop()
+
+    abort = None
+    for line in output:
+        match = ABORT_LINE.search(line)
+        if match:
+            abort = (int(match.group(1)), int(match.group(2)))
+    statuses = [s for device in server.statuses.values() for s in device]
+    sent = sum(r["bytes_out"] for r in server.records
+               if r["path"].startswith(ARTIFACTS))
+    return {
+        "abort": abort,
+        "error": any(ERRORS[corrupt] in line for line in output),
+        "statuses": statuses,
+        "sent": sent,
+    }
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("--exe", default="build/zephyr/zephyr.exe",
+                        help="native_sim executable")
+    parser.add_argument("--artifact", default="build/zephyr/zephyr.mender",
+                        help="valid artifact, corrupted by the server")
+    parser.add_argument("--device-type", default="native_sim")
+    parser.add_argument("--port", type=int, default=8080,
+                        help="must match CONFIG_MENDER_SERVER_HOST")
+    parser.add_argument("--timeout", type=float, default=120.0,
+                        help="seconds before a run is aborted")
+    parser.add_argument("--rt", action="store_true",
+                        help="run the simulation in real time")
+    parser.add_argument("-v", "--verbose", action="store_true",
+                        help="print the device logs")
+    args = parser.parse_args()
+
+    failed = False
+    for corrupt in CORRUPTIONS:
+        result = run_once(args, corrupt)
+        abort = result["abort"]
+        print("{:<7} aborted after {} bytes, {} bytes sent, statuses {}".format(
+            corrupt, "{} of {}".format(*abort) if abort else "-",
+            result["sent"], ", ".join(result["statuses"]) or "-"))
+
+        problems = []
+        if not abort:
+            problems.append("the download was not aborted")
+        elif corrupt == "header" and abort[0] >= abort[1] // 2:
+            problems.append("the header was not rejected early")
+        if not result["error"]:
+            problems.append("'{}' not logged".format(ERRORS[corrupt]))
+        if "failure" not in result["statuses"]:
+            problems.append("no failure reported")
+        if any(s in INSTALL_STATUSES for s in result["statuses"]):
+            problems.append("the image was installed")
+        for problem in problems:
+            print("  FAIL: " + problem)
+        failed = failed or bool(problems)
+
+    if failed:
+        return 1
+    print("PASS: corrupted artifacts are rejected before the install")
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
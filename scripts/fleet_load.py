@@ -0,0 +1,263 @@
+# @file      fleet_load.py
+# @author    Theodore Bardy
+#
+# @note      This file is part of Witekio's Zephyr Demo project
+# @brief     Run a fleet of native_sim instances against the mock Mender server
+
+"""Reproduce fleet behaviour with many native_sim instances.
+
+N instances of the native_sim executable are run against one mock Mender
+server. Every instance gets its own identity (--device-id, a locally
+administered MAC address derived from its index) and its own flash file.
+
+The wake schedule decides when instances boot:
+
+  sync       all instances wake at the same time, as after a power outage
+  uniform    wake times are spread randomly over --window seconds
+  staggered  wake times are spread evenly over --window seconds
+
+An instance stays awake --awake seconds, goes to deep sleep (the process
+exits) and wakes again --sleep seconds later, optionally with --jitter, for
+--cycles cycles.
+
+The server records are then analysed: request rate (mean and peak per
+second), latency percentiles per endpoint, response statuses, and retries. A
+request is a retry when the same device sent the same request after an error
+response; seconds in which retries exceed --storm-ratio of the requests are
+reported as retry storms. Use this to tune the poll interval, the retry
+backoff and the wake jitter before a rollout.
+
+Build the executable with:
+
+    west build -b native_sim --no-sysbuild .
+"""
+
+import argparse
+import collections
+import heapq
+import json
+import os
+import random
+import re
+import subprocess
+import sys
+import tempfile
+import time
+
+from mock_mender_server import MockMenderServer
+
+# Deployment ids are replaced so that requests group per endpoint
+DEPLOYMENT_ID = re.compile(r"/deployments/[0-9a-f-]{36}/")
+
+
+def device_id(index):
+    """Returns a locally administered unicast MAC address for an instance."""
+    return "02:00:{:02x}:{:02x}:{:02x}:{:02x}".format(
+        (index >> 24) & 0xFF, (index >> 16) & 0xFF, (index >> 8) & 0xFF,
+        index & 0xFF)
+
+
+def wake_times(args):
+    """Returns the first wake-up time of every instance, in seconds."""
+    if args.schedule == "sync":
+        return [0.0] * args.instances
+    if args.schedule == "uniform":
+        return sorted(random.uniform(0, args.window)
+                      for _ in range(args.instances))
+    step = args.window / args.instances
+    return [index * step for index in range(args.instances)]
+
+
+def percentile(values, fraction):
+    if not values:
+        return None
+    values = sorted(values)
+    index = min(len(values) - 1, int(round(fraction * (len(values) - 1))))
+    return values[index]
+
+
+def run_fleet(args, workdir):
+    """Runs the whole schedule, returns when every instance is done."""
+    command = [os.path.abspath(args.exe), "--wake-after-ms=0",
+               "--sleep-after-ms={}".format(int(args.awake * 1000)), "--rt"]
+
+    # (time, index, cycle) of the next instance launches
+    pending = [(wake, index, 0)
+               for index, wake in enumerate(wake_times(args))]
+    heapq.heapify(pending)
+    running = {}
+    start = time.monotonic()
+
+    while pending or running:
+        now = time.monotonic() - start
+        while pending and pending[0][0] <= now:
+            _, index, cycle = heapq.heappop(pending)
+            log = open(os.path.join(workdir, "{}.log".format(index)), "a")
+            flash = os.path.join(workdir, "{}.bin".format(index))
+            process = subprocess.Popen(
+                command + ["--device-id=" + device_id(index),
+                           "--flash=" + flash],
+                cwd=workdir, stdout=log, stderr=subprocess.STDOUT)
+            running[index] = (process, cycle, log, now)
+
+        for index, (process, cycle, log, launched) in list(running.items()):
+            timed_out = now - launched > args.awake + args.timeout
+            if process.poll() is None and not timed_out:
+                continue
+            if timed_out:
+                process.kill()
+                process.wait()
+                print("instance {} timed out".format(index), file=sys.stderr)
+            log.close()
+            del running[index]
+            if cycle + 1 < args.cycles:
+                wake = now + args.sleep + random.uniform(0, args.jitter)
+                heapq.heappush(pending, (wake, index, cycle + 1))
+
+        time.sleep(0.01)
+
+    return time.monotonic() - start
+
+
+def analyse(records, storm_ratio):
+    """Computes the load statistics from the server records."""
+    if not records:
+        return {}
+    first = min(r["time"] for r in records)
+    per_second = collections.Counter()
+    retries_per_second = collections.Counter()
+    latencies = collections.defaultdict(list)
+    statuses = collections.Counter()
+    # (device, method, endpoint) -> status of the previous request
+    previous = {}
+    retries = 0
+
+    for record in sorted(records, key=lambda r: r["time"]):
+        second = int(record["time"] - first)
+        endpoint = DEPLOYMENT_ID.sub("/deployments/{id}/", record["path"])
+        key = (record["device"], record["method"], endpoint)
+        per_second[second] += 1
+        latencies[endpoint].append(record["latency_ms"])
+        statuses[record["status"]] += 1
+        if record["device"] is not None:
+            if previous.get(key, 200) >= 400:
+                retries += 1
+                retries_per_second[second] += 1
+            previous[key] = record["status"]
+
+    duration = max(per_second) + 1
+    storms = [s for s in sorted(retries_per_second)
+              if retries_per_second[s] > storm_ratio * per_second[s]]
+    all_latencies = [l for values in latencies.values() for l in values]
+
+    def summary(values):
+        return {"count": len(values),
+                "p50_ms": percentile(values, 0.50),
+                "p90_ms": percentile(values, 0.90),
+                "p99_ms": percentile(values, 0.99)}
+
+    return {
+        "requests": len(records),
+        "duration_s": duration,
+        "rate_mean_rps": round(len(records) / duration, 2),
+        "rate_peak_rps": max(per_second.values()),
+        "latency": summary(all_latencies),
+        "endpoints": {e: summary(v) for e, v in sorted(latencies.items())},
+        "statuses": {str(s): c for s, c in sorted(statuses.items())},
+        "retries": retries,
+        "retry_peak_rps": max(retries_per_second.values(), default=0),
+        "storm_seconds": storms,
+    }
+
+
+def print_report(stats):
+    if not stats:
+        print("No request received")
+        return
+    print("Requests:     {} in {} s, mean {} req/s, peak {} req/s".format(
+        stats["requests"], stats["duration_s"], stats["rate_mean_rps"],
+        stats["rate_peak_rps"]))
+    latency = stats["latency"]
+    print("Latency:      p50 {} ms, p90 {} ms, p99 {} ms".format(
+        latency["p50_ms"], latency["p90_ms"], latency["p99_ms"]))
+    print("Statuses:     " + ", ".join(
+        "{}: {}".format(s, c) for s, c in stats["statuses"].items()))
+    print("Retries:      {}, peak {} /s, storms at {}".format(
+        stats["retries"], stats["retry_peak_rps"],
+        stats["storm_seconds"] or "none"))
+    print()
+    print("{:<64} {:>7} {:>9} {:>9} {:>9}".format(
+        "endpoint", "count", "p50 (ms)", "p90 (ms)", "p99 (ms)"))
+    for endpoint, summary in stats["endpoints"].items():
+        print("{:<64} {:>7} {:>9} {:>9} {:>9}".format(
+            endpoint, summary["count"], summary["p50_ms"],
+            summary["p90_ms"], summary["p99_ms"]))
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("--exe", default="build/zephyr/zephyr.exe",
+                        help="native_sim executable")
+    parser.add_argument("-n", "--instances", type=int, default=10)
+    parser.add_argument("--schedule", default="sync",
+                        choices=("sync", "uniform", "staggered"))
+    parser.add_argument("--window", type=float, default=60.0,
+                        help="seconds over which the first wake-ups spread")
+    parser.add_argument("--awake", type=float, default=60.0,
+                        help="seconds an instance stays awake")
+    parser.add_argument("--sleep", type=float, default=60.0,
+                        help="seconds an instance sleeps between cycles")
+    parser.add_argument("--jitter", type=float, default=0.0,
+                        help="random seconds added to every sleep")
+    parser.add_argument("--cycles", type=int, default=1)
+    parser.add_argument("--timeout", type=float, default=60.0,
+                        help="seconds after --awake before a run is killed")
+    parser.add_argument("--seed", type=int, help="random seed")
+    parser.add_argument("--port", type=int, default=8080,
+                        help="must match CONFIG_MENDER_SERVER_HOST")
+    parser.add_argument("--artifact", help="Mender artifact to deploy")
+    parser.add_argument("--device-type", default="native_sim")
+    parser.add_argument("--service-time", type=float, default=0.0,
+                        help="server: minimum seconds spent on every request")
+    parser.add_argument("--capacity", type=int, default=0,
+                        help="server: requests served at once, 503 above")
+    parser.add_argument("--storm-ratio", type=float, default=0.5,
+                        help="retry share of a second flagged as a storm")
+    parser.add_argument("--records", help="write the server records (JSONL)")
+    parser.add_argument("-o", "--output", help="write the statistics (JSON)")
+    parser.add_argument("--keep-logs", metavar="DIR",
+                        help="keep the instance logs and flash files in DIR")
+    args = parser.parse_args()
+
+    random.seed(args.seed)
+    records = open(args.records, "w") if args.records else None
+    server = MockMenderServer(("127.0.0.1", args.port), args.artifact,
+                              args.device_type, output=records,
+                              service_time=args.service_time,
+                              capacity=args.capacity)
+    server.start()
+
+    try:
+        if args.keep_logs:
+            os.makedirs(args.keep_logs, exist_ok=True)
+            elapsed = run_fleet(args, args.keep_logs)
+        else:
+            with tempfile.TemporaryDirectory() as workdir:
+                elapsed = run_fleet(args, workdir)
+    finally:
+        server.stop()
+        if records:
+            records.close()
+
+    print("{} instances, {} schedule, {} cycles, ran {:.1f} s".format(
+        args.instances, args.schedule, args.cycles, elapsed))
+    stats = analyse(server.records, args.storm_ratio)
+    print_report(stats)
+
+    if args.output:
+        with open(args.output, "w") as output:
+            json.dump(stats, output, indent=2)
+
+
+if __name__ == "__main__":
+    main()
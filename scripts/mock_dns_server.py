@@ -0,0 +1,130 @@
+# @file      mock_dns_server.py
+# @author    Theodore Bardy
+#
+# @note      This file is part of Witekio's Zephyr Demo project
+# @brief     Minimal DNS server used to benchmark name resolution on a host
+
+"""Minimal DNS server for native_sim benchmarks.
+
+Answers every A query with the same address (127.0.0.1 by default, where the
+mock Mender server listens) after a configurable delay emulating the round
+trip to a real resolver. Other query types get an empty answer. The native_sim
+build sends its queries to 127.0.0.1:5353 (CONFIG_DNS_SERVER1).
+
+Each query is recorded with its time and name. The server can also be used
+from another script:
+
+    server = MockDnsServer(("127.0.0.1", 5353), delay=0.05)
+    server.start()
+    ...
+    server.stop()
+    print(server.records)
+"""
+
+import argparse
+import socket
+import struct
+import sys
+import threading
+import time
+
+TYPE_A = 1
+CLASS_IN = 1
+
+
+def parse_question(data):
+    """Returns the name, type and end offset of the first question."""
+    labels = []
+    offset = 12
+    while data[offset]:
+        length = data[offset]
+        labels.append(data[offset + 1:offset + 1 + length].decode())
+        offset += 1 + length
+    qtype, _ = struct.unpack("!HH", data[offset + 1:offset + 5])
+    return ".".join(labels), qtype, offset + 5
+
+
+class MockDnsServer:
+    """Threaded UDP DNS server answering every name with one address."""
+
+    def __init__(self, address, answer="127.0.0.1", delay=0.0, ttl=300):
+        self.socket = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+        self.socket.bind(address)
+        # Closing the socket does not wake recvfrom() up, poll instead
+        self.socket.settimeout(0.2)
+        self.running = False
+        self.answer = socket.inet_aton(answer)
+        self.delay = delay
+        self.ttl = ttl
+        self.records = []
+        self.thread = None
+
+    def start(self):
+        self.running = True
+        self.thread = threading.Thread(target=self.serve, daemon=True)
+        self.thread.start()
+
+    def stop(self):
+        self.running = False
+        self.thread.join()
+        self.socket.close()
+
+    def serve(self):
+        while self.running:
+            try:
+                data, peer = self.socket.recvfrom(512)
+            except socket.timeout:
+                continue
+            except OSError:
+                return
+            if len(data) < 12:
+                continue
+            # Delayed replies must not hold the following queries back
+            threading.Thread(target=self.reply, args=(data, peer),
+                             daemon=True).start()
+
+    def reply(self, data, peer):
+        name, qtype, end = parse_question(data)
+        self.records.append({"time": time.time(), "name": name,
+                             "type": qtype})
+        time.sleep(self.delay)
+
+        answers = b""
+        if qtype == TYPE_A:
+            # Compressed pointer to the name of the question
+            answers = struct.pack("!HHHIH", 0xC00C, TYPE_A, CLASS_IN,
+                                  self.ttl, 4) + self.answer
+        header = struct.pack("!HHHHHH", struct.unpack("!H", data[:2])[0],
+                             0x8180, 1, 1 if answers else 0, 0, 0)
+        try:
+            self.socket.sendto(header + data[12:end] + answers, peer)
+        except OSError:
+            pass
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("--host", default="127.0.0.1")
+    parser.add_argument("--port", type=int, default=5353,
+                        help="must match CONFIG_DNS_SERVER1")
+    parser.add_argument("--answer", default="127.0.0.1",
+                        help="address returned for every name")
+    parser.add_argument("--delay-ms", type=int, default=50,
+                        help="emulated round trip to the resolver")
+    args = parser.parse_args()
+
+    server = MockDnsServer((args.host, args.port), args.answer,
+                           args.delay_ms / 1000)
+    server.start()
+    print("Answering {}:{} with {} after {} ms".format(
+        args.host, args.port, args.answer, args.delay_ms), file=sys.stderr)
+    try:
+        while True:
+            time.sleep(1)
+    except KeyboardInterrupt:
+        pass
+    server.stop()
+
+
+if __name__ == "__main__":
+    main()
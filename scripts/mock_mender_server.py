@@ -0,0 +1,477 @@
+# @file      mock_mender_server.py
+# @author    Theodore Bardy
+#
+# @note      This file is part of Witekio's Zephyr Demo project
+# @brief     Minimal Mender server used to benchmark the OTA flow on a host
+
+"""Minimal Mender server for native_sim benchmarks.
+
+Implements the device API used by the mender-mcu client: authentication,
+deployment polling (v2 and v1), deployment status and logs, inventory and the
+artifact download. Every device is accepted. When an artifact is given it is
+offered once to every device, until the device reports a final status.
+
+To reproduce server side spikes, every request can take a minimum service
+time and the number of requests served at once can be capped: requests above
+the capacity are answered with 503, as an overloaded server would.
+
+Each request is recorded with its time, device, method, path, status, bytes
+received and sent, and latency. The records are printed as JSON lines to the
+output file (or stdout) so that they can be correlated with the device logs.
+
+To check the verification of the image by the device, the payload of the
+artifact can be corrupted with --corrupt: a byte of the MCUboot image header
+("header") or of the middle of the image ("body") is flipped, and the payload
+checksum of the manifest is updated so that only the device verification of
+the image can catch it. The deployment statuses reported by each device are
+kept in the "statuses" attribute.
+
+Coredumps posted by the device (to <server>/coredump, the default of an empty
+CONFIG_APP_COREDUMP_UPLOAD_URL) are decoded and, with --coredump-dir, written as
+<identity>-<n>.bin files readable by Zephyr's scripts/coredump tools.
+
+With --cert and --key the server speaks HTTPS, limited to TLS 1.2 as the
+device. OpenSSL honors the max_fragment_length extension, so a device built
+with the low RAM TLS profile (CONFIG_APP_TLS_PROFILE_LOW_RAM) receives 4 KiB
+records and one built with the high throughput profile 16 KiB records, which
+compares the download throughput and the mbedTLS heap of both profiles.
+
+The server can also be used from another script:
+
+    server = MockMenderServer(("127.0.0.1", 8080), artifact="x.mender")
+    server.start()
+    ...
+    server.stop()
+    print(server.records)
+"""
+
+import argparse
+import base64
+import hashlib
+import io
+import json
+import os
+import re
+import ssl
+import struct
+import sys
+import tarfile
+import threading
+import time
+import uuid
+from http.server import BaseHTTPRequestHandler, ThreadingHTTPServer
+from urllib.parse import urlparse
+
+API_AUTH = "/api/devices/v1/authentication/auth_requests"
+API_COREDUMP = "/coredump"
+API_NEXT_V2 = "/api/devices/v2/deployments/device/deployments/next"
+API_NEXT_V1 = "/api/devices/v1/deployments/device/deployments/next"
+API_DEPLOYMENT = re.compile(
+    r"^/api/devices/v1/deployments/device/deployments/([^/]+)/(status|log)$")
+API_INVENTORY = "/api/devices/v1/inventory/device/attributes"
+ARTIFACTS = "/artifacts/"
+
+# Deployment statuses after which the artifact is not offered again
+FINAL_STATUSES = ("success", "failure", "already-installed")
+# Parts of the image a byte can be flipped in with --corrupt
+CORRUPTIONS = ("header", "body")
+# Artifacts are sent by chunks so that an aborted download can be measured
+SEND_CHUNK_SIZE = 4096
+
+
+def make_token(device):
+    """Returns a JWT looking token, the client does not decode it."""
+    def b64(value):
+        data = json.dumps(value).encode()
+        return base64.urlsafe_b64encode(data).decode().rstrip("=")
+    return "{}.{}.{}".format(b64({"alg": "none"}),
+                             b64({"sub": device, "jti": str(uuid.uuid4())}),
+                             "mock")
+
+
+def corrupt_artifact(artifact, where):
+    """Returns a copy of an uncompressed Mender artifact with a byte of its
+    payload flipped, in the image header or in the middle of the image, and
+    the payload checksum of the manifest updated to match."""
+    data = bytearray(artifact)
+    outer = tarfile.open(fileobj=io.BytesIO(artifact))
+    members = {member.name: member for member in outer.getmembers()}
+    if "data/0000.tar" not in members:
+        raise ValueError("only artifacts written with --compression none "
+                         "are supported")
+    if "manifest.sig" in members:
+        print("warning: the artifact signature no longer matches",
+              file=sys.stderr)
+
+    start = members["data/0000.tar"].offset_data
+    inner = tarfile.open(fileobj=io.BytesIO(
+        artifact[start:start + members["data/0000.tar"].size]))
+    payload = next(member for member in inner.getmembers()
+                   if member.isfile())
+    offset = 0 if where == "header" else payload.size // 2
+    data[start + payload.offset_data + offset] ^= 0xFF
+
+    # Same length, the tar headers stay valid
+    begin = start + payload.offset_data
+    digest = hashlib.sha256(data[begin:begin + payload.size]).hexdigest()
+    manifest = members["manifest"]
+    content = data[manifest.offset_data:
+                   manifest.offset_data + manifest.size].decode()
+    content = re.sub(r"^[0-9a-f]{64}(\s+data/0000/"
+                     + re.escape(payload.name) + r")$",
+                     lambda match: digest + match.group(1), content,
+                     flags=re.M)
+    data[manifest.offset_data:manifest.offset_data + manifest.size] = \
+        content.encode()
+    print("Flipped byte {} of the {} bytes of '{}'".format(
+        offset, payload.size, payload.name), file=sys.stderr)
+    return bytes(data)
+
+
+def rle_decode(data):
+    """Decodes a dump run-length encoded by src/debug/src/coredump_rle.c."""
+    out = bytearray()
+    i = 0
+    while i < len(data):
+        ctrl = data[i]
+        if ctrl < 0x80:
+            literal = data[i + 1:i + 2 + ctrl]
+            if len(literal) != ctrl + 1:
+                raise ValueError("truncated literal")
+            out += literal
+            i += 2 + ctrl
+        else:
+            if i + 1 >= len(data):
+                raise ValueError("truncated run")
+            out += bytes([data[i + 1]]) * (ctrl - 0x80 + 3)
+            i += 2
+    return bytes(out)
+
+
+def parse_coredumps(body):
+    """Splits an upload in dumps, each preceded by its raw and encoded sizes
+    (LE32), and decodes them."""
+    dumps = []
+    offset = 0
+    while offset < len(body):
+        if offset + 8 > len(body):
+            raise ValueError("truncated header")
+        raw_size, stored_size = struct.unpack_from("<II", body, offset)
+        offset += 8
+        stored = body[offset:offset + stored_size]
+        if len(stored) != stored_size:
+            raise ValueError("truncated dump")
+        dump = rle_decode(stored)
+        if len(dump) != raw_size:
+            raise ValueError("size mismatch")
+        # Header of the Zephyr coredump format
+        if not dump.startswith(b"ZE"):
+            raise ValueError("not a Zephyr coredump")
+        dumps.append(dump)
+        offset += stored_size
+    return dumps
+
+
+class MockMenderServer(ThreadingHTTPServer):
+    daemon_threads = True
+    # Whole fleets connect at once, do not refuse connections
+    request_queue_size = 1024
+
+    def __init__(self, address, artifact=None, device_type=None,
+                 auth_delay=0.0, auth_fail=0, output=None,
+                 service_time=0.0, capacity=0, coredump_dir=None,
+                 corrupt=None, cert=None, key=None):
+        super().__init__(address, RequestHandler)
+        self.tls = bool(cert)
+        if cert:
+            context = ssl.SSLContext(ssl.PROTOCOL_TLS_SERVER)
+            context.maximum_version = ssl.TLSVersion.TLSv1_2
+            context.load_cert_chain(cert, key)
+            self.socket = context.wrap_socket(self.socket, server_side=True)
+        self.artifact = artifact
+        self.artifact_data = None
+        self.artifact_name = None
+        self.device_type = device_type
+        self.auth_delay = auth_delay
+        self.auth_fail = auth_fail
+        self.output = output
+        self.service_time = service_time
+        self.capacity = capacity
+        self.coredump_dir = coredump_dir
+        # device identity -> number of coredumps received
+        self.coredumps = {}
+        self.active = 0
+        self.records = []
+        self.lock = threading.Lock()
+        # token -> device identity, device -> number of refused auth requests
+        self.tokens = {}
+        self.refused = {}
+        # device -> final deployment status, device -> statuses reported
+        self.finished = {}
+        self.statuses = {}
+        self.thread = None
+        if artifact:
+            name = os.path.basename(artifact)
+            self.artifact_name = os.path.splitext(name)[0]
+            with open(artifact, "rb") as data:
+                self.artifact_data = data.read()
+            if corrupt:
+                self.artifact_data = corrupt_artifact(self.artifact_data,
+                                                      corrupt)
+
+    @property
+    def url(self):
+        scheme = "https" if self.tls else "http"
+        return "{}://{}:{}".format(scheme, *self.server_address[:2])
+
+    def start(self):
+        self.thread = threading.Thread(target=self.serve_forever, daemon=True)
+        self.thread.start()
+
+    def stop(self):
+        self.shutdown()
+        self.server_close()
+
+    def record(self, entry):
+        with self.lock:
+            self.records.append(entry)
+            if self.output:
+                self.output.write(json.dumps(entry) + "\n")
+                self.output.flush()
+
+
+class RequestHandler(BaseHTTPRequestHandler):
+    protocol_version = "HTTP/1.1"
+
+    def log_message(self, format, *args):
+        # Requests are recorded as JSON lines instead
+        pass
+
+    def device(self):
+        auth = self.headers.get("Authorization", "")
+        token = auth[len("Bearer "):] if auth.startswith("Bearer ") else None
+        return self.server.tokens.get(token)
+
+    def read_body(self):
+        length = int(self.headers.get("Content-Length", 0))
+        return self.rfile.read(length) if length else b""
+
+    def reply(self, status, body=b"", content_type="application/json"):
+        self.send_response(status)
+        self.send_header("Content-Type", content_type)
+        self.send_header("Content-Length", str(len(body)))
+        self.end_headers()
+        if body and self.command != "HEAD":
+            self.wfile.write(body)
+        return status, len(body)
+
+    def handle_request(self, body):
+        path = urlparse(self.path).path
+        server = self.server
+
+        if path == API_AUTH and self.command == "POST":
+            return self.authenticate(body)
+
+        # Posted outside of the Mender client, without its token
+        if path == API_COREDUMP and self.command == "POST":
+            return self.coredump(body)
+
+        # Artifact links are presigned, downloaded without the token
+        if path.startswith(ARTIFACTS) and self.command in ("GET", "HEAD"):
+            if not server.artifact or os.path.basename(
+                    server.artifact) != path[len(ARTIFACTS):]:
+                return self.reply(404)
+            return self.send_artifact()
+
+        device = self.device()
+        if device is None:
+            return self.reply(401, b'{"error":"unauthorized"}')
+
+        if path in (API_NEXT_V2, API_NEXT_V1):
+            if not server.artifact or device in server.finished:
+                return self.reply(204)
+            deployment = {
+                "id": str(uuid.uuid5(uuid.NAMESPACE_URL, device)),
+                "artifact": {
+                    "artifact_name": server.artifact_name,
+                    "source": {
+                        "uri": server.url + ARTIFACTS
+                        + os.path.basename(server.artifact),
+                        "expire": "2099-01-01T00:00:00Z",
+                    },
+                    "device_types_compatible":
+                        [server.device_type] if server.device_type else [],
+                },
+            }
+            return self.reply(200, json.dumps(deployment).encode())
+
+        match = API_DEPLOYMENT.match(path)
+        if match and self.command == "PUT":
+            if match.group(2) == "status":
+                status = json.loads(body or b"{}").get("status")
+                with server.lock:
+                    server.statuses.setdefault(device, []).append(status)
+                    if status in FINAL_STATUSES:
+                        server.finished[device] = status
+            return self.reply(204)
+
+        if path == API_INVENTORY and self.command in ("PUT", "PATCH"):
+            return self.reply(200)
+
+        return self.reply(404)
+
+    def send_artifact(self):
+        """Sends the artifact, stops when the device closes the connection."""
+        data = self.server.artifact_data
+        self.send_response(200)
+        self.send_header("Content-Type", "application/octet-stream")
+        self.send_header("Content-Length", str(len(data)))
+        self.end_headers()
+        if self.command == "HEAD":
+            return 200, 0
+        sent = 0
+        try:
+            while sent < len(data):
+                self.wfile.write(data[sent:sent + SEND_CHUNK_SIZE])
+                sent = min(sent + SEND_CHUNK_SIZE, len(data))
+        except (BrokenPipeError, ConnectionResetError):
+            self.close_connection = True
+        return 200, sent
+
+    def identity(self, body):
+        """Returns the identity of an auth request, None if malformed."""
+        try:
+            device = json.loads(json.loads(body)["id_data"])
+            return ",".join("{}={}".format(k, v)
+                            for k, v in sorted(device.items()))
+        except (ValueError, KeyError, AttributeError, TypeError):
+            return None
+
+    def authenticate(self, body):
+        server = self.server
+        device = self.auth_device
+        if device is None:
+            return self.reply(400, b'{"error":"malformed id_data"}')
+
+        if server.auth_delay:
+            time.sleep(server.auth_delay)
+        with server.lock:
+            refused = server.refused.get(device, 0)
+            if refused < server.auth_fail:
+                server.refused[device] = refused + 1
+                return self.reply(401, b'{"error":"dev auth: unauthorized"}')
+            token = make_token(device)
+            server.tokens[token] = device
+        return self.reply(200, token.encode(), "application/jwt")
+
+    def coredump(self, body):
+        server = self.server
+        device = self.headers.get("X-Device-Identity", "unknown")
+        try:
+            dumps = parse_coredumps(body)
+        except ValueError as error:
+            return self.reply(400, json.dumps(
+                {"error": str(error)}).encode())
+        with server.lock:
+            first = server.coredumps.get(device, 0)
+            server.coredumps[device] = first + len(dumps)
+        if server.coredump_dir:
+            os.makedirs(server.coredump_dir, exist_ok=True)
+            name = re.sub(r"[^A-Za-z0-9_.-]", "_", device)
+            for index, dump in enumerate(dumps, first):
+                path = os.path.join(server.coredump_dir,
+                                    "{}-{}.bin".format(name, index))
+                with open(path, "wb") as output:
+                    output.write(dump)
+        print("{} coredumps received from {}".format(len(dumps), device),
+              file=sys.stderr)
+        return self.reply(201)
+
+    def serve(self, body):
+        server = self.server
+        if urlparse(self.path).path == API_AUTH:
+            self.auth_device = self.identity(body)
+        with server.lock:
+            overloaded = server.capacity and server.active >= server.capacity
+            if not overloaded:
+                server.active += 1
+        if overloaded:
+            return self.reply(503, b'{"error":"overloaded"}')
+        try:
+            if server.service_time:
+                time.sleep(server.service_time)
+            return self.handle_request(body)
+        finally:
+            with server.lock:
+                server.active -= 1
+
+    def dispatch(self):
+        start = time.monotonic()
+        self.auth_device = None
+        body = self.read_body()
+        status, sent = self.serve(body)
+        self.server.record({
+            "time": time.time(),
+            "device": self.auth_device or self.device(),
+            "method": self.command,
+            "path": urlparse(self.path).path,
+            "status": status,
+            "bytes_in": len(body),
+            "bytes_out": sent,
+            "latency_ms": round((time.monotonic() - start) * 1000, 3),
+        })
+
+    do_GET = dispatch
+    do_HEAD = dispatch
+    do_POST = dispatch
+    do_PUT = dispatch
+    do_PATCH = dispatch
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("--host", default="127.0.0.1")
+    parser.add_argument("--port", type=int, default=8080)
+    parser.add_argument("--artifact",
+                        help="Mender artifact offered once to every device")
+    parser.add_argument("--device-type",
+                        help="device type the artifact is compatible with")
+    parser.add_argument("--auth-delay", type=float, default=0.0,
+                        help="seconds to wait before answering auth requests")
+    parser.add_argument("--auth-fail", type=int, default=0,
+                        help="refuse the first N auth requests of each device")
+    parser.add_argument("--service-time", type=float, default=0.0,
+                        help="minimum seconds spent on every request")
+    parser.add_argument("--capacity", type=int, default=0,
+                        help="requests served at once, 503 above (0: no cap)")
+    parser.add_argument("--corrupt", choices=CORRUPTIONS,
+                        help="flip a byte of the image header or body")
+    parser.add_argument("--coredump-dir",
+                        help="directory the received coredumps are saved to")
+    parser.add_argument("--cert", help="PEM certificate, serve over HTTPS")
+    parser.add_argument("--key", help="PEM private key of the certificate")
+    parser.add_argument("-o", "--output",
+                        help="JSON lines request log (default: stdout)")
+    args = parser.parse_args()
+    if bool(args.cert) != bool(args.key):
+        parser.error("--cert and --key go together")
+
+    output = open(args.output, "w") if args.output else sys.stdout
+    server = MockMenderServer((args.host, args.port), args.artifact,
+                              args.device_type, args.auth_delay,
+                              args.auth_fail, output, args.service_time,
+                              args.capacity, args.coredump_dir, args.corrupt,
+                              args.cert, args.key)
+    print("Mock Mender server listening on " + server.url, file=sys.stderr)
+    try:
+        server.serve_forever()
+    except KeyboardInterrupt:
+        pass
+    finally:
+        server.server_close()
+        if args.output:
+            output.close()
+
+
+if __name__ == "__main__":
+    main()
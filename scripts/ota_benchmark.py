@@ -0,0 +1,217 @@
+# @file      ota_benchmark.py
+# @author    Theodore Bardy
+#
+# @note      This file is part of Witekio's Zephyr Demo project
+# @brief     Run the OTA flow on native_sim against the mock Mender server
+
+"""Benchmark the wake-up and OTA flow on native_sim.
+
+Each run starts the mock Mender server, launches the native_sim executable
+with an emulated button press right after boot (and optionally a second one
+to go back to sleep), and waits for the process to exit: either the device
+went to deep sleep, or it rebooted to install the update.
+
+The BENCH lines logged by the application (CONFIG_APP_BENCHMARK), the
+throughput line of the Update Module and the server request records are
+combined into, per run: time to IP, time to authentication, download
+throughput, bytes on the wire, peak heap, RAM reserved for thread stacks,
+the latency between the debounced button press and its handling and the time
+to resolve the server name. The mean over all runs is printed last, and all
+results can be written as JSON for comparisons.
+
+For compressed artifacts ('zephyr-image-hs', CONFIG_OTA_IMAGE_COMPRESSION) the
+compression ratio, the decoder throughput and the decoder RAM, counted in the
+peak RAM, are added. The simulated CPU runs the code in zero time, so on
+native_sim compare the download time (host time to serve the artifact) of
+raw and compressed artifacts with --no-rt instead: the host CPU is then the
+bottleneck. The decoder throughput is measured on the board.
+
+Build the executable with:
+
+    west build -b native_sim --no-sysbuild .
+
+To measure name resolution, give the server a name (for example
+-DCONFIG_MENDER_SERVER_HOST=\"http://mender.local:8080\") and use
+--dns-delay-ms to answer it from the DNS stand-in. With --retained the
+retained memory is kept from one run to the next as across deep sleep, so
+the first run is a cold boot and the following ones wake-ups.
+"""
+
+import argparse
+import json
+import os
+import re
+import statistics
+import subprocess
+import sys
+import tempfile
+import time
+
+from mock_dns_server import MockDnsServer
+from mock_mender_server import API_AUTH, ARTIFACTS, MockMenderServer
+
+BENCH_LINE = re.compile(r"BENCH (\w+) (\d+)")
+WROTE_LINE = re.compile(r"Wrote (\d+) bytes in (\d+) ms: (\d+) KiB/s")
+DECOMPRESSED_LINE = re.compile(r"Decompressed (\d+) bytes into (\d+) bytes, "
+                               r"decoder (\d+) us, (\d+) bytes of RAM")
+
+METRICS = ("time_to_ip_ms", "time_to_auth_ms", "throughput_kibps",
+           "download_ms", "bytes_on_wire", "peak_ram_bytes", "stacks_bytes",
+           "wake_latency_us", "dns_us", "ratio_pct", "decoder_kibps")
+ROW = ("{:>4} {:>10} {:>12} {:>10} {:>10} {:>12} {:>10} {:>10} {:>10} {:>10}"
+       " {:>10} {:>10}")
+
+
+def run_once(args, index):
+    """Runs the executable once, returns the metrics of the run."""
+    server = MockMenderServer(("127.0.0.1", args.port), args.artifact,
+                              args.device_type)
+    server.start()
+    dns = None
+    if args.dns_delay_ms is not None:
+        dns = MockDnsServer(("127.0.0.1", args.dns_port),
+                            delay=args.dns_delay_ms / 1000)
+        dns.start()
+
+    with tempfile.TemporaryDirectory() as workdir:
+        command = [os.path.abspath(args.exe),
+                   "--wake-after-ms=0",
+                   "--flash=" + os.path.join(workdir, "flash.bin")]
+        if args.retained:
+            command.append("--retained=" + os.path.abspath(args.retained))
+        if args.sleep_after_ms is not None:
+            command.append("--sleep-after-ms={}".format(args.sleep_after_ms))
+        if not args.no_rt:
+            command.append("--rt")
+
+        launched = time.time()
+        try:
+            process = subprocess.run(command, cwd=workdir, timeout=args.timeout,
+                                     stdout=subprocess.PIPE,
+                                     stderr=subprocess.STDOUT, text=True)
+            output = process.stdout
+        except subprocess.TimeoutExpired as error:
+            output = error.stdout.decode() if error.stdout else ""
+            print("run {}: timed out".format(index), file=sys.stderr)
+        finally:
+            server.stop()
+            if dns:
+                dns.stop()
+
+    if args.verbose:
+        print(output)
+
+    marks = {}
+    ram = 0
+    throughput = None
+    decompressed = None
+    for line in output.splitlines():
+        match = BENCH_LINE.search(line)
+        if match:
+            name, value = match.group(1), int(match.group(2))
+            if name in ("heap_peak", "malloc_peak"):
+                ram += value
+            else:
+                marks[name] = value
+        match = WROTE_LINE.search(line)
+        if match:
+            throughput = int(match.group(3))
+        match = DECOMPRESSED_LINE.search(line)
+        if match:
+            decompressed = [int(v) for v in match.groups()]
+
+    ratio = None
+    decoder = None
+    if decompressed:
+        ratio = round(decompressed[0] * 100 / decompressed[1])
+        if decompressed[2]:
+            decoder = round(decompressed[1] * 1000000 / 1024
+                            / decompressed[2])
+        ram += decompressed[3]
+    downloads = [r["latency_ms"] for r in server.records
+                 if r["path"].startswith(ARTIFACTS)]
+
+    wake = marks.get("wake", 0)
+    auth = [r for r in server.records
+            if r["path"] == API_AUTH and r["status"] == 200]
+    # Server time is host time, the device uptime starts at the launch
+    time_to_auth = None
+    if auth:
+        time_to_auth = round((auth[0]["time"] - launched) * 1000) - wake
+
+    return {
+        "time_to_ip_ms": marks["ip_acquired"] - wake
+        if "ip_acquired" in marks else None,
+        "time_to_auth_ms": time_to_auth,
+        "throughput_kibps": throughput,
+        "download_ms": round(sum(downloads)) if downloads else None,
+        "bytes_on_wire": sum(r["bytes_in"] + r["bytes_out"]
+                             for r in server.records),
+        "peak_ram_bytes": ram or None,
+        "stacks_bytes": marks.get("stacks"),
+        "wake_latency_us": marks.get("wake_latency_us"),
+        "dns_us": marks.get("dns_us"),
+        "ratio_pct": ratio,
+        "decoder_kibps": decoder,
+        "marks": marks,
+        "requests": len(server.records),
+        "dns_queries": len(dns.records) if dns else None,
+    }
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("--exe", default="build/zephyr/zephyr.exe",
+                        help="native_sim executable")
+    parser.add_argument("--artifact", help="Mender artifact to deploy")
+    parser.add_argument("--device-type", default="native_sim")
+    parser.add_argument("--port", type=int, default=8080,
+                        help="must match CONFIG_MENDER_SERVER_HOST")
+    parser.add_argument("-n", "--runs", type=int, default=5)
+    parser.add_argument("--sleep-after-ms", type=int,
+                        help="go back to sleep this long after the wake-up")
+    parser.add_argument("--timeout", type=float, default=120.0,
+                        help="seconds before a run is aborted")
+    parser.add_argument("--no-rt", action="store_true",
+                        help="do not slow the simulation down to real time")
+    parser.add_argument("--dns-delay-ms", type=int,
+                        help="answer names from the DNS stand-in after this "
+                             "delay")
+    parser.add_argument("--dns-port", type=int, default=5353,
+                        help="must match CONFIG_DNS_SERVER1")
+    parser.add_argument("--retained",
+                        help="keep the retained memory in this file across "
+                             "runs")
+    parser.add_argument("-o", "--output", help="write the results as JSON")
+    parser.add_argument("-v", "--verbose", action="store_true",
+                        help="print the device logs")
+    args = parser.parse_args()
+
+    if args.sleep_after_ms is None and not args.artifact:
+        parser.error("without --artifact, --sleep-after-ms is required")
+    if args.retained:
+        # Start from a power loss, the file must exist to be written
+        open(args.retained, "wb").close()
+
+    results = []
+    print(ROW.format("run", "ip (ms)", "auth (ms)", "KiB/s", "dl (ms)",
+                     "wire (B)", "heap (B)", "stack (B)", "wake (us)",
+                     "dns (us)", "ratio (%)", "dec KiB/s"))
+    for index in range(args.runs):
+        result = run_once(args, index)
+        results.append(result)
+        print(ROW.format(index, *(str(result[m]) for m in METRICS)))
+
+    mean = {}
+    for metric in METRICS:
+        values = [r[metric] for r in results if r[metric] is not None]
+        mean[metric] = round(statistics.mean(values)) if values else None
+    print(ROW.format("mean", *(str(mean[m]) for m in METRICS)))
+
+    if args.output:
+        with open(args.output, "w") as output:
+            json.dump({"runs": results, "mean": mean}, output, indent=2)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,129 @@
+# @file      soak_test.py
+# @author    Theodore Bardy
+#
+# @note      This file is part of Witekio's Zephyr Demo project
+# @brief     Long-run heap fragmentation test on native_sim
+
+"""Long-run heap fragmentation test on native_sim.
+
+The native_sim executable is run against the mock Mender server, without
+deployment, until the client polled the server the requested number of
+times. Without --rt the simulated time runs as fast as the host allows, so
+build with a short poll interval, for example:
+
+    west build -b native_sim --no-sysbuild . -- \\
+        -DCONFIG_MENDER_CLIENT_UPDATE_POLL_INTERVAL=1 \\
+        -DCONFIG_OTA_CLIENT_HEAP_STATS_INTERVAL=1000
+
+The "Client heap:" and "Heap:" lines logged by the client heap allocator
+(CONFIG_OTA_CLIENT_HEAP) give the bytes allocated in the client heap, its
+allocations falling back to the system heap because they did not fit, and the
+bytes allocated in the system heap. The test passes when, from the first
+sample to the last, the client heap had no new fallback, i.e. its
+fragmentation never kept an allocation from fitting, and the bytes allocated
+in both heaps did not grow by more than --tolerance, i.e. nothing leaked.
+"""
+
+import argparse
+import os
+import re
+import subprocess
+import sys
+import tempfile
+import threading
+import time
+
+from mock_mender_server import API_NEXT_V1, API_NEXT_V2, MockMenderServer
+
+CLIENT_LINE = re.compile(r"Client heap: sessions (\d+), used (\d+), "
+                         r"peak (\d+)/(\d+), allocs (\d+), "
+                         r"oversized (\d+), fallbacks (\d+)")
+HEAP_LINE = re.compile(r"Heap: free (\d+), allocated (\d+), peak (\d+)")
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("--exe", default="build/zephyr/zephyr.exe",
+                        help="native_sim executable")
+    parser.add_argument("--polls", type=int, default=100000,
+                        help="deployment polls before stopping")
+    parser.add_argument("--port", type=int, default=8080,
+                        help="must match CONFIG_MENDER_SERVER_HOST")
+    parser.add_argument("--tolerance", type=float, default=0.05,
+                        help="accepted growth of the allocated bytes")
+    parser.add_argument("--rt", action="store_true",
+                        help="run the simulation in real time")
+    args = parser.parse_args()
+
+    server = MockMenderServer(("127.0.0.1", args.port))
+    server.start()
+
+    samples = []
+    client = None
+    with tempfile.TemporaryDirectory() as workdir:
+        command = [os.path.abspath(args.exe), "--wake-after-ms=0",
+                   "--flash=" + os.path.join(workdir, "flash.bin")]
+        if args.rt:
+            command.append("--rt")
+        process = subprocess.Popen(command, cwd=workdir, text=True,
+                                   stdout=subprocess.PIPE,
+                                   stderr=subprocess.STDOUT)
+
+        def count_polls():
+            return sum(1 for r in list(server.records)
+                       if r["path"] in (API_NEXT_V1, API_NEXT_V2))
+
+        def stop_when_done():
+            while process.poll() is None and count_polls() < args.polls:
+                time.sleep(1)
+            process.terminate()
+        threading.Thread(target=stop_when_done, daemon=True).start()
+
+        start = time.monotonic()
+        for line in process.stdout:
+            match = CLIENT_LINE.search(line)
+            if match:
+                client = [int(v) for v in match.groups()]
+            match = HEAP_LINE.search(line)
+            if match and client:
+                # The system heap line follows the one of the client heap
+                sample = (count_polls(), client[1], client[6],
+                          int(match.group(2)))
+                samples.append(sample)
+                print("polls {:>7}  client used {:>6}  fallbacks {:>6}  "
+                      "heap allocated {:>7}".format(*sample))
+        process.wait()
+    server.stop()
+
+    polls = count_polls()
+    print("{} polls in {:.0f} s".format(polls, time.monotonic() - start))
+    if client:
+        print("Client heap: {} sessions, peak {}/{} bytes, {} allocations, {} "
+              "oversized, {} fallbacks".format(
+                  client[0], client[2], client[3], client[4], client[5], client[6]))
+    if len(samples) < 2:
+        print("Not enough heap samples, is CONFIG_OTA_CLIENT_HEAP enabled?")
+        return 1
+
+    first, last = samples[0], samples[-1]
+    problems = []
+    if last[2] > first[2]:
+        problems.append("{} allocations did not fit in the client heap".format(
+            last[2] - first[2]))
+    for index, name in ((1, "client heap"), (3, "system heap")):
+        growth = (last[index] - first[index]) / first[index] if first[index] \
+            else float(last[index] > 0)
+        print("Allocated in the {}: {} -> {} bytes ({:+.1%})".format(
+            name, first[index], last[index], growth))
+        if growth > args.tolerance:
+            problems.append("the {} allocations grew".format(name))
+    for problem in problems:
+        print("FAIL: " + problem)
+    if problems:
+        return 1
+    print("PASS: no fragmentation fallback and no leak")
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
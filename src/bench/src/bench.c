@@ -0,0 +1,120 @@
+/**
+ * @file      bench.c
+ * @author    Theodore Bardy
+ *
+ * @note      This file is part of Witekio's Zephyr Demo project
+ * @brief     Benchmark instrumentation parsed by scripts/ota_benchmark.py
+ */
+
+#include <zephyr/logging/log.h>
+LOG_MODULE_REGISTER(bench);
+
+#include "bench.h"
+
+#ifdef CONFIG_APP_BENCHMARK
+
+#include <zephyr/kernel.h>
+#include <zephyr/sys/atomic.h>
+#include <zephyr/sys/sys_heap.h>
+#include <zephyr/sys/libc-hooks.h>
+#include <zephyr/debug/thread_analyzer.h>
+#ifdef CONFIG_MBEDTLS_MEMORY_DEBUG
+#include <mbedtls/memory_buffer_alloc.h>
+#endif
+
+// Names printed in the log, keep in sync with bench_event_t
+static const char *const event_names[BENCH_EVENT_COUNT] = {
+    "wake",
+    "link_up",
+    "ip_acquired",
+    "client_started",
+    "download_start",
+    "download_done",
+    "sleep",
+};
+
+static ATOMIC_DEFINE(marked, BENCH_EVENT_COUNT);
+
+#if K_HEAP_MEM_POOL_SIZE > 0
+extern struct k_heap _system_heap;
+#endif
+
+void
+bench_mark (bench_event_t event)
+{
+    if (event >= BENCH_EVENT_COUNT || atomic_test_and_set_bit(marked, event))
+    {
+        return;
+    }
+
+    // Fixed format, parsed by the benchmark runner
+    LOG_INF("BENCH %s %lld", event_names[event], k_uptime_get());
+
+#ifdef CONFIG_MBEDTLS_MEMORY_DEBUG
+    // The download connection is still established, and the only one open
+    if (BENCH_EVENT_DOWNLOAD_DONE == event)
+    {
+        size_t used;
+        size_t blocks;
+
+        mbedtls_memory_buffer_alloc_cur_get(&used, &blocks);
+        LOG_INF("BENCH tls_heap_used %zu", used);
+    }
+#endif
+}
+
+void
+bench_latency (const char *name, uint32_t start_cycles)
+{
+    uint32_t cycles = k_cycle_get_32() - start_cycles;
+
+    LOG_INF("BENCH %s_us %u", name, k_cyc_to_us_floor32(cycles));
+}
+
+static void
+prvAddStackSize (const struct k_thread *thread, void *user_data)
+{
+    *(size_t *)user_data += thread->stack_info.size;
+}
+
+void
+bench_report (void)
+{
+    size_t stacks = 0;
+
+    // RAM reserved for thread stacks, whether used or not
+    k_thread_foreach(prvAddStackSize, &stacks);
+    LOG_INF("BENCH stacks %zu", stacks);
+
+#ifdef CONFIG_SYS_HEAP_RUNTIME_STATS
+    struct sys_memory_stats stats;
+
+#if K_HEAP_MEM_POOL_SIZE > 0
+    if (0 == sys_heap_runtime_stats_get(&_system_heap.heap, &stats))
+    {
+        LOG_INF("BENCH heap_peak %zu", stats.max_allocated_bytes);
+    }
+#endif
+
+#ifdef CONFIG_COMMON_LIBC_MALLOC
+    if (0 == malloc_runtime_stats_get(&stats))
+    {
+        LOG_INF("BENCH malloc_peak %zu", stats.max_allocated_bytes);
+    }
+#endif
+#endif // CONFIG_SYS_HEAP_RUNTIME_STATS
+
+#ifdef CONFIG_MBEDTLS_MEMORY_DEBUG
+    size_t tls_peak;
+    size_t tls_blocks;
+
+    // Reached during a handshake, with the full size buffers allocated
+    mbedtls_memory_buffer_alloc_max_get(&tls_peak, &tls_blocks);
+    LOG_INF("BENCH tls_heap_peak %zu", tls_peak);
+#endif
+
+    // Stack high water marks of every thread
+    thread_analyzer_print(0);
+}
+
+#endif // CONFIG_APP_BENCHMARK
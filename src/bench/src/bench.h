@@ -0,0 +1,73 @@
+/**
+ * @file      bench.h
+ * @author    Theodore Bardy
+ *
+ * @note      This file is part of Witekio's Zephyr Demo project
+ * @brief     Benchmark instrumentation parsed by scripts/ota_benchmark.py
+ */
+
+#ifndef BENCH_H
+#define BENCH_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif // __cplusplus
+
+    typedef enum
+    {
+        BENCH_EVENT_WAKE,
+        BENCH_EVENT_LINK_UP,
+        BENCH_EVENT_IP_ACQUIRED,
+        BENCH_EVENT_CLIENT_STARTED,
+        BENCH_EVENT_DOWNLOAD_START,
+        BENCH_EVENT_DOWNLOAD_DONE,
+        BENCH_EVENT_SLEEP,
+        BENCH_EVENT_COUNT
+    } bench_event_t;
+
+#ifdef CONFIG_APP_BENCHMARK
+    /**
+     * @brief Logs the uptime at which an event happened, first occurrence only
+     * @param event The event
+     */
+    void bench_mark(bench_event_t event);
+
+    /**
+     * @brief Logs the time elapsed since a cycle counter value
+     * @param name Name of the measure, logged with a "_us" suffix
+     * @param start_cycles Value of k_cycle_get_32() at the start
+     */
+    void bench_latency(const char *name, uint32_t start_cycles);
+
+    /**
+     * @brief Logs the memory usage peaks and the stacks reserved by threads
+     */
+    void bench_report(void);
+#else
+static inline void
+bench_mark (bench_event_t event)
+{
+    (void)event;
+}
+
+static inline void
+bench_latency (const char *name, uint32_t start_cycles)
+{
+    (void)name;
+    (void)start_cycles;
+}
+
+static inline void
+bench_report (void)
+{
+}
+#endif // CONFIG_APP_BENCHMARK
+
+#ifdef __cplusplus
+}
+#endif // __cplusplus
+
+#endif // BENCH_H
@@ -0,0 +1,442 @@
+/**
+ * @file      prof.c
+ * @author    Theodore Bardy
+ *
+ * @note      This file is part of Witekio's Zephyr Demo project
+ * @brief     CPU time and scheduling latency of the threads, agents and ISRs
+ */
+
+#include <zephyr/logging/log.h>
+LOG_MODULE_REGISTER(prof);
+
+#include "prof.h"
+
+#ifdef CONFIG_APP_PROFILING
+
+#include <stdio.h>
+#include <string.h>
+#include <zephyr/kernel.h>
+#include <zephyr/sys/util.h>
+#include <zephyr/tracing/tracing.h>
+
+#define PROF_LINE_SIZE (96)
+
+// Names printed in the report, keep in sync with prof_phase and prof_probe
+static const char *const phase_names[PROF_PHASE_COUNT] = {
+    "idle",
+    "connect",
+    "exchange",
+    "download",
+};
+static const char *const probe_names[PROF_PROBE_COUNT] = {
+    "button_callback",
+    "button_response",
+};
+
+/*
+ * The tracing hooks run with the interrupts locked, from the scheduler and the
+ * ISRs: they only look up the slot of the thread and add to its counters, the
+ * readers lock the interrupts to copy them.
+ */
+struct prof_slot
+{
+    const void       *key; // Thread or agent, NULL if free
+    uint32_t          ready_cycles;
+    bool              ready;
+    uint32_t          in_cycles;
+    uint64_t          in_isr_cycles; // isr_cycles when switched in
+    bool              in;
+    struct prof_entry entry;
+};
+
+static struct prof_slot slots[CONFIG_APP_PROFILING_MAX_ENTRIES];
+static size_t           slot_count;
+static uint32_t         dropped; // Threads or agents without a slot
+
+static volatile enum prof_phase phase = PROF_PHASE_IDLE;
+static int64_t                  phase_since_ms;
+static uint32_t                 phase_ms[PROF_PHASE_COUNT];
+
+static uint32_t           isr_depth;
+static uint32_t           isr_start_cycles;
+static uint64_t           isr_cycles; // Since boot, excluded from the threads
+static struct prof_timing isrs[PROF_PHASE_COUNT];
+
+static struct prof_timing probes[PROF_PROBE_COUNT][PROF_PHASE_COUNT];
+
+static struct prof_slot *
+prvSlot (const void *key)
+{
+    for (size_t i = 0; i < slot_count; i++)
+    {
+        if (key == slots[i].key)
+        {
+            return &slots[i];
+        }
+    }
+    if (slot_count >= ARRAY_SIZE(slots))
+    {
+        dropped++;
+        return NULL;
+    }
+    slots[slot_count].key = key;
+    return &slots[slot_count++];
+}
+
+static uint32_t
+prvBucket (uint32_t latency_us)
+{
+    uint32_t bucket = 0;
+
+    while ((bucket < PROF_HIST_BUCKETS - 1)
+           && (latency_us > ((uint32_t)PROF_HIST_FIRST_US << bucket)))
+    {
+        bucket++;
+    }
+    return bucket;
+}
+
+static void
+prvLatency (struct prof_stats *stats, uint32_t latency_cycles)
+{
+    uint32_t latency_us = k_cyc_to_us_floor32(latency_cycles);
+    uint32_t bucket     = prvBucket(latency_us);
+
+    stats->max_latency_us = MAX(stats->max_latency_us, latency_us);
+    if (stats->hist[bucket] < UINT16_MAX)
+    {
+        stats->hist[bucket]++;
+    }
+}
+
+static void
+prvTiming (struct prof_timing *timing, uint32_t cycles)
+{
+    timing->count++;
+    timing->cycles += cycles;
+    timing->max_cycles = MAX(timing->max_cycles, cycles);
+}
+
+void
+sys_trace_thread_sched_ready_user (struct k_thread *thread)
+{
+    struct prof_slot *slot = prvSlot(thread);
+
+    if ((NULL != slot) && !slot->ready)
+    {
+        slot->ready_cycles = k_cycle_get_32();
+        slot->ready        = true;
+    }
+}
+
+void
+sys_trace_thread_switched_in_user (void)
+{
+    uint32_t          now  = k_cycle_get_32();
+    struct k_thread  *self = k_current_get();
+    struct prof_slot *slot = prvSlot(self);
+
+    if (NULL == slot)
+    {
+        return;
+    }
+    // Threads that were never made ready (e.g. main) have no latency
+    struct prof_stats *stats = &slot->entry.phases[phase];
+    if (slot->ready)
+    {
+        prvLatency(stats, now - slot->ready_cycles);
+        slot->ready = false;
+    }
+    stats->runs++;
+    if ('\0' == slot->entry.name[0])
+    {
+        const char *name = k_thread_name_get(self);
+        if (NULL != name)
+        {
+            strncpy(slot->entry.name, name, PROF_NAME_LEN - 1);
+        }
+    }
+    slot->in_cycles     = now;
+    slot->in_isr_cycles = isr_cycles;
+    slot->in            = true;
+}
+
+void
+sys_trace_thread_switched_out_user (void)
+{
+    uint32_t          now  = k_cycle_get_32();
+    struct prof_slot *slot = prvSlot(k_current_get());
+
+    if ((NULL == slot) || !slot->in)
+    {
+        return;
+    }
+    uint64_t ran  = now - slot->in_cycles;
+    uint64_t isrs = isr_cycles - slot->in_isr_cycles;
+    slot->entry.phases[phase].cpu_cycles += (ran > isrs) ? (ran - isrs) : 0;
+    slot->in = false;
+}
+
+void
+sys_trace_isr_enter_user (int nested_interrupts)
+{
+    ARG_UNUSED(nested_interrupts);
+
+    // Count the nesting here, the kernel increments it before or after
+    // calling the hook depending on the architecture
+    if (0 == isr_depth++)
+    {
+        isr_start_cycles = k_cycle_get_32();
+    }
+}
+
+void
+sys_trace_isr_exit_user (int nested_interrupts)
+{
+    ARG_UNUSED(nested_interrupts);
+
+    if ((0 == isr_depth) || (0 != --isr_depth))
+    {
+        return;
+    }
+    uint32_t cycles = k_cycle_get_32() - isr_start_cycles;
+    isr_cycles += cycles;
+    prvTiming(&isrs[phase], cycles);
+}
+
+enum prof_phase
+prof_phase_set (enum prof_phase next)
+{
+    int64_t      now = k_uptime_get();
+    unsigned int key = irq_lock();
+
+    enum prof_phase previous = phase;
+    phase_ms[previous] += (uint32_t)(now - phase_since_ms);
+    phase_since_ms = now;
+    phase          = next;
+    irq_unlock(key);
+    return previous;
+}
+
+void
+prof_agent_ran (const void *agent,
+                const char *name,
+                uint32_t    posted_cycles,
+                uint32_t    start_cycles)
+{
+    uint32_t     now = k_cycle_get_32();
+    unsigned int key = irq_lock();
+
+    struct prof_slot *slot = prvSlot(agent);
+    if (NULL != slot)
+    {
+        struct prof_stats *stats = &slot->entry.phases[phase];
+        slot->entry.agent        = true;
+        if ('\0' == slot->entry.name[0])
+        {
+            strncpy(slot->entry.name, name, PROF_NAME_LEN - 1);
+        }
+        prvLatency(stats, start_cycles - posted_cycles);
+        // Interrupts in the handler are not excluded, it can be preempted
+        stats->cpu_cycles += now - start_cycles;
+        stats->runs++;
+    }
+    irq_unlock(key);
+}
+
+void
+prof_probe (enum prof_probe probe, uint32_t start_cycles)
+{
+    uint32_t     now = k_cycle_get_32();
+    unsigned int key = irq_lock();
+
+    prvTiming(&probes[probe][phase], now - start_cycles);
+    irq_unlock(key);
+}
+
+bool
+prof_get (size_t index, struct prof_entry *entry)
+{
+    bool         ret = false;
+    unsigned int key = irq_lock();
+
+    if (index < slot_count)
+    {
+        *entry = slots[index].entry;
+        ret    = true;
+    }
+    irq_unlock(key);
+    return ret;
+}
+
+void
+prof_get_isr (enum prof_phase which, struct prof_timing *timing)
+{
+    unsigned int key = irq_lock();
+
+    *timing = isrs[which];
+    irq_unlock(key);
+}
+
+void
+prof_get_probe (enum prof_probe     probe,
+                enum prof_phase     which,
+                struct prof_timing *timing)
+{
+    unsigned int key = irq_lock();
+
+    *timing = probes[probe][which];
+    irq_unlock(key);
+}
+
+uint32_t
+prof_phase_time_ms (enum prof_phase which)
+{
+    int64_t      now = k_uptime_get();
+    unsigned int key = irq_lock();
+
+    uint32_t ret = phase_ms[which];
+    if (which == phase)
+    {
+        ret += (uint32_t)(now - phase_since_ms);
+    }
+    irq_unlock(key);
+    return ret;
+}
+
+const char *
+prof_phase_name (enum prof_phase which)
+{
+    return (which < PROF_PHASE_COUNT) ? phase_names[which] : "unknown";
+}
+
+static void
+prvDumpTiming (prof_print_t              print,
+               void                     *ctx,
+               const char               *name,
+               const struct prof_timing *timing)
+{
+    char line[PROF_LINE_SIZE];
+
+    if (0 == timing->count)
+    {
+        return;
+    }
+    snprintf(line,
+             sizeof(line),
+             "  %-15s %8u runs %10u us max %8u us",
+             name,
+             timing->count,
+             (uint32_t)k_cyc_to_us_floor64(timing->cycles),
+             k_cyc_to_us_floor32(timing->max_cycles));
+    print(ctx, line);
+}
+
+static void
+prvDumpPhase (prof_print_t print, void *ctx, enum prof_phase which)
+{
+    char               line[PROF_LINE_SIZE];
+    struct prof_entry  entry;
+    struct prof_timing timing;
+    uint32_t           time_ms = prof_phase_time_ms(which);
+
+    snprintf(line,
+             sizeof(line),
+             "Phase %s: %u ms",
+             phase_names[which],
+             time_ms);
+    print(ctx, line);
+    print(ctx,
+          "  name            cpu %  runs max us  <32  <64 <128 <256 <512  <1m"
+          "  <2m  >2m");
+    for (size_t i = 0; prof_get(i, &entry); i++)
+    {
+        const struct prof_stats *stats = &entry.phases[which];
+        if (0 == stats->runs)
+        {
+            continue;
+        }
+        // Per mille of the phase, the time of the agents is also counted in
+        // the thread of the event loop
+        uint32_t cpu_us   = (uint32_t)k_cyc_to_us_floor64(stats->cpu_cycles);
+        uint32_t permille = (0 != time_ms) ? (cpu_us / time_ms) : 0;
+        int      len      = snprintf(line,
+                               sizeof(line),
+                               "  %c%-14s %3u.%u %5u %6u",
+                               entry.agent ? '@' : ' ',
+                               ('\0' != entry.name[0]) ? entry.name : "?",
+                               permille / 10,
+                               permille % 10,
+                               stats->runs,
+                               stats->max_latency_us);
+        for (size_t b = 0; b < PROF_HIST_BUCKETS; b++)
+        {
+            len += snprintf(&line[len],
+                            sizeof(line) - len,
+                            " %4u",
+                            stats->hist[b]);
+        }
+        print(ctx, line);
+    }
+
+    prof_get_isr(which, &timing);
+    prvDumpTiming(print, ctx, "isr", &timing);
+    for (size_t i = 0; i < PROF_PROBE_COUNT; i++)
+    {
+        prof_get_probe(i, which, &timing);
+        prvDumpTiming(print, ctx, probe_names[i], &timing);
+    }
+}
+
+void
+prof_dump (prof_print_t print, void *ctx)
+{
+    char line[PROF_LINE_SIZE];
+
+    for (size_t i = 0; i < PROF_PHASE_COUNT; i++)
+    {
+        prvDumpPhase(print, ctx, i);
+    }
+    if (0 != dropped)
+    {
+        snprintf(line,
+                 sizeof(line),
+                 "%u threads or agents not tracked",
+                 dropped);
+        print(ctx, line);
+    }
+}
+
+void
+prof_reset (void)
+{
+    int64_t      now = k_uptime_get();
+    unsigned int key = irq_lock();
+
+    for (size_t i = 0; i < slot_count; i++)
+    {
+        memset(slots[i].entry.phases, 0, sizeof(slots[i].entry.phases));
+    }
+    memset(isrs, 0, sizeof(isrs));
+    memset(probes, 0, sizeof(probes));
+    memset(phase_ms, 0, sizeof(phase_ms));
+    phase_since_ms = now;
+    dropped        = 0;
+    irq_unlock(key);
+}
+
+static void
+prvLogLine (void *ctx, const char *line)
+{
+    ARG_UNUSED(ctx);
+
+    LOG_INF("%s", line);
+}
+
+void
+prof_report (void)
+{
+    prof_dump(prvLogLine, NULL);
+}
+
+#endif // CONFIG_APP_PROFILING
@@ -0,0 +1,207 @@
+/**
+ * @file      prof.h
+ * @author    Theodore Bardy
+ *
+ * @note      This file is part of Witekio's Zephyr Demo project
+ * @brief     CPU time and scheduling latency of the threads, agents and ISRs
+ */
+
+#ifndef PROF_H
+#define PROF_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Latency buckets, bucket i counts up to PROF_HIST_FIRST_US << i, the last
+// one everything above
+#define PROF_HIST_BUCKETS  (8)
+#define PROF_HIST_FIRST_US (32)
+// Name of a thread or an agent, truncated
+#define PROF_NAME_LEN (16)
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif // __cplusplus
+
+    /**
+     * @brief Phase of the application the measures are aggregated by
+     */
+    enum prof_phase
+    {
+        PROF_PHASE_IDLE,     // Waiting for the button or the next poll
+        PROF_PHASE_CONNECT,  // Joining the Wi-Fi network
+        PROF_PHASE_EXCHANGE, // Talking to the server
+        PROF_PHASE_DOWNLOAD, // Downloading an artifact
+        PROF_PHASE_COUNT
+    };
+
+    /**
+     * @brief Code sections timed explicitly
+     */
+    enum prof_probe
+    {
+        PROF_PROBE_BUTTON_CALLBACK, // bt0 GPIO callback
+        PROF_PROBE_BUTTON_RESPONSE, // Debounced press to the app handling it
+        PROF_PROBE_COUNT
+    };
+
+    /**
+     * @brief Statistics of a phase
+     */
+    struct prof_stats
+    {
+        uint64_t cpu_cycles;              // Run time, ISRs excluded
+        uint32_t runs;                    // Scheduled or dispatched
+        uint32_t max_latency_us;          // Ready or posted to running
+        uint16_t hist[PROF_HIST_BUCKETS]; // Latencies, saturated
+    };
+
+    /**
+     * @brief Thread, or agent of the event loop, and its statistics
+     */
+    struct prof_entry
+    {
+        char              name[PROF_NAME_LEN];
+        bool              agent; // Agent of the event loop
+        struct prof_stats phases[PROF_PHASE_COUNT];
+    };
+
+    /**
+     * @brief Statistics of the ISRs, or of a probe, in a phase
+     */
+    struct prof_timing
+    {
+        uint32_t count;
+        uint64_t cycles;
+        uint32_t max_cycles;
+    };
+
+    /**
+     * @brief Callback printing a line of the report
+     * @param ctx Context of the caller
+     * @param line Line, without new line
+     */
+    typedef void (*prof_print_t)(void *ctx, const char *line);
+
+#ifdef CONFIG_APP_PROFILING
+    /**
+     * @brief Sets the phase the next measures are aggregated in
+     * @param phase The phase
+     * @return Previous phase, to restore at the end of a nested one
+     */
+    enum prof_phase prof_phase_set(enum prof_phase phase);
+
+    /**
+     * @brief Records an agent of the event loop that ran
+     * @param agent The agent, identifies the entry
+     * @param name Name of the agent, must be static
+     * @param posted_cycles Value of k_cycle_get_32() when posted
+     * @param start_cycles Value of k_cycle_get_32() when the handler started
+     */
+    void prof_agent_ran(const void *agent,
+                        const char *name,
+                        uint32_t    posted_cycles,
+                        uint32_t    start_cycles);
+
+    /**
+     * @brief Records a probe, can be called from an ISR
+     * @param probe The probe
+     * @param start_cycles Value of k_cycle_get_32() at the start
+     */
+    void prof_probe(enum prof_probe probe, uint32_t start_cycles);
+
+    /**
+     * @brief Gets an entry
+     * @param index Index of the entry
+     * @param entry Copy of the entry
+     * @return true if the entry exists, false past the last one
+     */
+    bool prof_get(size_t index, struct prof_entry *entry);
+
+    /**
+     * @brief Gets the ISR statistics of a phase
+     * @param phase The phase
+     * @param timing Copy of the statistics
+     */
+    void prof_get_isr(enum prof_phase phase, struct prof_timing *timing);
+
+    /**
+     * @brief Gets the statistics of a probe in a phase
+     * @param probe The probe
+     * @param phase The phase
+     * @param timing Copy of the statistics
+     */
+    void prof_get_probe(enum prof_probe     probe,
+                        enum prof_phase     phase,
+                        struct prof_timing *timing);
+
+    /**
+     * @brief Gets the time spent in a phase
+     * @param phase The phase
+     * @return Time in milliseconds
+     */
+    uint32_t prof_phase_time_ms(enum prof_phase phase);
+
+    /**
+     * @brief Gets the name of a phase
+     * @param phase The phase
+     * @return Name of the phase
+     */
+    const char *prof_phase_name(enum prof_phase phase);
+
+    /**
+     * @brief Prints the statistics, one phase after the other
+     * @param print Callback printing each line
+     * @param ctx Context passed to the callback
+     */
+    void prof_dump(prof_print_t print, void *ctx);
+
+    /**
+     * @brief Clears the statistics, the threads stay known
+     */
+    void prof_reset(void);
+
+    /**
+     * @brief Logs the statistics
+     */
+    void prof_report(void);
+#else
+static inline enum prof_phase
+prof_phase_set (enum prof_phase phase)
+{
+    (void)phase;
+    return PROF_PHASE_IDLE;
+}
+
+static inline void
+prof_agent_ran (const void *agent,
+                const char *name,
+                uint32_t    posted_cycles,
+                uint32_t    start_cycles)
+{
+    (void)agent;
+    (void)name;
+    (void)posted_cycles;
+    (void)start_cycles;
+}
+
+static inline void
+prof_probe (enum prof_probe probe, uint32_t start_cycles)
+{
+    (void)probe;
+    (void)start_cycles;
+}
+
+static inline void
+prof_report (void)
+{
+}
+#endif // CONFIG_APP_PROFILING
+
+#ifdef __cplusplus
+}
+#endif // __cplusplus
+
+#endif // PROF_H
@@ -0,0 +1,52 @@
+/**
+ * @file      prof_shell.c
+ * @author    Theodore Bardy
+ *
+ * @note      This file is part of Witekio's Zephyr Demo project
+ * @brief     Shell command printing the profiling statistics
+ */
+
+#include "prof.h"
+
+#ifdef CONFIG_APP_PROFILING_SHELL
+
+#include <zephyr/shell/shell.h>
+
+static void
+prvPrint (void *ctx, const char *line)
+{
+    shell_print((const struct shell *)ctx, "%s", line);
+}
+
+static int
+prvCmdShow (const struct shell *sh, size_t argc, char **argv)
+{
+    ARG_UNUSED(argc);
+    ARG_UNUSED(argv);
+
+    prof_dump(prvPrint, (void *)sh);
+    return 0;
+}
+
+static int
+prvCmdReset (const struct shell *sh, size_t argc, char **argv)
+{
+    ARG_UNUSED(argc);
+    ARG_UNUSED(argv);
+
+    prof_reset();
+    shell_print(sh, "Profiling statistics cleared");
+    return 0;
+}
+
+SHELL_STATIC_SUBCMD_SET_CREATE(
+    prof_cmds,
+    SHELL_CMD(show,
+              NULL,
+              "Print the CPU time and latencies of each phase",
+              prvCmdShow),
+    SHELL_CMD(reset, NULL, "Clear the statistics", prvCmdReset),
+    SHELL_SUBCMD_SET_END);
+SHELL_CMD_REGISTER(prof, &prof_cmds, "Runtime profiling", prvCmdShow);
+
+#endif // CONFIG_APP_PROFILING_SHELL
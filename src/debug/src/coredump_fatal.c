@@ -0,0 +1,67 @@
+/**
+ * @file      coredump_fatal.c
+ * @author    Theodore Bardy
+ *
+ * @note      This file is part of Witekio's Zephyr Demo project
+ * @brief     Fatal error handler rebooting once the coredump is stored
+ */
+
+#include <zephyr/logging/log.h>
+LOG_MODULE_REGISTER(coredump_fatal);
+
+#ifdef CONFIG_APP_COREDUMP
+
+#include <zephyr/fatal.h>
+#include <zephyr/init.h>
+#include <zephyr/kernel.h>
+#include <zephyr/sys/reboot.h>
+
+#include "coredump_store.h"
+
+/*
+ * The coredump is written by z_fatal_error() before this handler is called,
+ * the device then reboots at once instead of halting: the dump is uploaded on
+ * the next OTA session.
+ */
+void
+k_sys_fatal_error_handler (unsigned int reason, const struct arch_esf *esf)
+{
+    ARG_UNUSED(esf);
+
+    LOG_PANIC();
+    LOG_ERR("Fatal error %u, rebooting", reason);
+    sys_reboot(SYS_REBOOT_COLD);
+    CODE_UNREACHABLE;
+}
+
+#if CONFIG_APP_COREDUMP_CRASH_AFTER_MS > 0
+static void
+prvCrashWork (struct k_work *work)
+{
+    ARG_UNUSED(work);
+
+    LOG_WRN("Inducing a fatal error");
+    k_oops();
+}
+static K_WORK_DELAYABLE_DEFINE(crash_work, prvCrashWork);
+
+/**
+ * @brief Schedules the fault unless a dump is already stored, so that the
+ * next boot lives long enough to upload it
+ */
+static int
+prvCrashInit (void)
+{
+    struct coredump_record record;
+
+    if (coredump_store_get(0, &record))
+    {
+        return 0;
+    }
+    k_work_schedule(&crash_work, K_MSEC(CONFIG_APP_COREDUMP_CRASH_AFTER_MS));
+    return 0;
+}
+SYS_INIT(prvCrashInit, APPLICATION, CONFIG_APPLICATION_INIT_PRIORITY);
+#endif // CONFIG_APP_COREDUMP_CRASH_AFTER_MS > 0
+
+#endif // CONFIG_APP_COREDUMP
@@ -0,0 +1,98 @@
+/**
+ * @file      coredump_rle.c
+ * @author    Theodore Bardy
+ *
+ * @note      This file is part of Witekio's Zephyr Demo project
+ * @brief     Run-length encoder of the coredumps
+ */
+
+#include "coredump_rle.h"
+
+#ifdef CONFIG_APP_COREDUMP
+
+#include <string.h>
+
+static void
+prvFlushLiteral (struct coredump_rle *rle)
+{
+    uint8_t ctrl;
+
+    if (0 == rle->literal_len)
+    {
+        return;
+    }
+    ctrl = (uint8_t)(rle->literal_len - 1);
+    rle->out(rle->ctx, &ctrl, sizeof(ctrl));
+    rle->out(rle->ctx, rle->literal, rle->literal_len);
+    rle->literal_len = 0;
+}
+
+static void
+prvLiteral (struct coredump_rle *rle, uint8_t byte)
+{
+    rle->literal[rle->literal_len++] = byte;
+    if (COREDUMP_RLE_LITERAL_MAX == rle->literal_len)
+    {
+        prvFlushLiteral(rle);
+    }
+}
+
+/**
+ * @brief Outputs the pending run, as a run if long enough and as literals
+ * otherwise
+ */
+static void
+prvFlushRun (struct coredump_rle *rle)
+{
+    if (rle->run_len >= COREDUMP_RLE_RUN_MIN)
+    {
+        uint8_t block[2] = {
+            (uint8_t)(0x80 + rle->run_len - COREDUMP_RLE_RUN_MIN),
+            rle->run_byte,
+        };
+        prvFlushLiteral(rle);
+        rle->out(rle->ctx, block, sizeof(block));
+    }
+    else
+    {
+        for (size_t i = 0; i < rle->run_len; i++)
+        {
+            prvLiteral(rle, rle->run_byte);
+        }
+    }
+    rle->run_len = 0;
+}
+
+void
+coredump_rle_init (struct coredump_rle *rle, coredump_rle_out_t out, void *ctx)
+{
+    memset(rle, 0, sizeof(*rle));
+    rle->out = out;
+    rle->ctx = ctx;
+}
+
+void
+coredump_rle_write (struct coredump_rle *rle, const uint8_t *data, size_t len)
+{
+    for (size_t i = 0; i < len; i++)
+    {
+        if ((rle->run_len > 0) && (data[i] == rle->run_byte)
+            && (rle->run_len < COREDUMP_RLE_RUN_MAX))
+        {
+            rle->run_len++;
+            continue;
+        }
+        prvFlushRun(rle);
+        rle->run_byte = data[i];
+        rle->run_len  = 1;
+    }
+}
+
+void
+coredump_rle_flush (struct coredump_rle *rle)
+{
+    prvFlushRun(rle);
+    prvFlushLiteral(rle);
+}
+
+#endif // CONFIG_APP_COREDUMP
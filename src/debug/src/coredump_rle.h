@@ -0,0 +1,82 @@
+/**
+ * @file      coredump_rle.h
+ * @author    Theodore Bardy
+ *
+ * @note      This file is part of Witekio's Zephyr Demo project
+ * @brief     Run-length encoder of the coredumps
+ */
+
+#ifndef COREDUMP_RLE_H
+#define COREDUMP_RLE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Each block starts with a control byte: below 0x80, the next ctrl + 1 bytes
+ * are copied as is; from 0x80, the next byte is repeated ctrl - 0x80 + 3
+ * times. Stacks filled with 0xaa and zeroed memory shrink a lot.
+ */
+#define COREDUMP_RLE_LITERAL_MAX (128)
+#define COREDUMP_RLE_RUN_MIN     (3)
+#define COREDUMP_RLE_RUN_MAX     (0x7f + COREDUMP_RLE_RUN_MIN)
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif // __cplusplus
+
+    /**
+     * @brief Callback receiving the encoded bytes
+     * @param ctx Context given to coredump_rle_init
+     * @param data Encoded bytes
+     * @param len Number of bytes
+     */
+    typedef void (*coredump_rle_out_t)(void          *ctx,
+                                       const uint8_t *data,
+                                       size_t         len);
+
+    /**
+     * @brief Encoder state, no allocation so that it runs in a fatal error
+     */
+    struct coredump_rle
+    {
+        coredump_rle_out_t out;
+        void              *ctx;
+        uint8_t            literal[COREDUMP_RLE_LITERAL_MAX];
+        size_t             literal_len;
+        uint8_t            run_byte;
+        size_t             run_len;
+    };
+
+    /**
+     * @brief Starts an encoding
+     * @param rle Encoder
+     * @param out Callback receiving the encoded bytes
+     * @param ctx Context passed to the callback
+     */
+    void coredump_rle_init(struct coredump_rle *rle,
+                           coredump_rle_out_t   out,
+                           void                *ctx);
+
+    /**
+     * @brief Encodes bytes
+     * @param rle Encoder
+     * @param data Bytes to encode
+     * @param len Number of bytes
+     */
+    void coredump_rle_write(struct coredump_rle *rle,
+                            const uint8_t       *data,
+                            size_t               len);
+
+    /**
+     * @brief Outputs the bytes still pending, ends the encoding
+     * @param rle Encoder
+     */
+    void coredump_rle_flush(struct coredump_rle *rle);
+
+#ifdef __cplusplus
+}
+#endif // __cplusplus
+
+#endif // COREDUMP_RLE_H
@@ -0,0 +1,427 @@
+/**
+ * @file      coredump_store.c
+ * @author    Theodore Bardy
+ *
+ * @note      This file is part of Witekio's Zephyr Demo project
+ * @brief     Coredump backend storing compressed dumps in flash
+ */
+
+#include <zephyr/logging/log.h>
+LOG_MODULE_REGISTER(coredump_store);
+
+#include "coredump_store.h"
+
+#ifdef CONFIG_APP_COREDUMP
+
+#include <errno.h>
+#include <string.h>
+#include <zephyr/debug/coredump.h>
+#include <zephyr/kernel.h>
+#include <zephyr/storage/flash_map.h>
+#include <zephyr/sys/byteorder.h>
+#include <zephyr/sys/crc.h>
+#include <zephyr/sys/util.h>
+
+#include "coredump_rle.h"
+
+/*
+ * Dumps are appended to the partition, which is only erased once they are
+ * uploaded so that a crash never waits for an erase:
+ *
+ *   | open block | commit block | run-length encoded dump | pad |
+ *
+ * The open block (magic) is written first and claims the space, the commit
+ * block (raw size, stored size, crc32 of the encoded dump, commit magic) is
+ * written last. A dump without commit block was interrupted: the space after
+ * it is unknown and nothing more is appended until the partition is erased.
+ */
+#define COREDUMP_PARTITION_ID FIXED_PARTITION_ID(coredump_partition)
+#define COREDUMP_OPEN_MAGIC   (0x504D4443U) // "CDMP"
+#define COREDUMP_COMMIT_MAGIC (0x4B4F4443U) // "CDOK"
+// Largest write block size supported, each header block is padded to it
+#define COREDUMP_BLOCK_SIZE  (32)
+#define COREDUMP_HEADER_SIZE (2 * COREDUMP_BLOCK_SIZE)
+// Encoded bytes buffered before a write, a multiple of COREDUMP_BLOCK_SIZE
+#define COREDUMP_PAGE_SIZE (128)
+
+/**
+ * @brief State of the dump being written, kept static as the fatal error
+ * handler may run on a nearly full stack
+ */
+struct coredump_writer
+{
+    const struct flash_area *fa;
+    size_t                   offset;  // Of the record
+    size_t                   written; // Bytes written after the header
+    uint32_t                 raw_size;
+    uint32_t                 stored_size;
+    uint32_t                 crc;
+    uint8_t                  page[COREDUMP_PAGE_SIZE];
+    size_t                   page_len;
+    struct coredump_rle      rle;
+    int                      error;
+};
+
+static struct coredump_writer writer;
+
+/**
+ * @brief Walks the records of the partition
+ * @param fa Partition
+ * @param index Index of the record to find, SIZE_MAX to walk them all
+ * @param record Record found, can be NULL
+ * @param end Receives the offset past the last record, SIZE_MAX if a record
+ * was interrupted, can be NULL
+ * @return true if the record was found, false otherwise
+ */
+static bool
+prvWalk (const struct flash_area *fa,
+         size_t                   index,
+         struct coredump_record  *record,
+         size_t                  *end)
+{
+    uint8_t header[COREDUMP_HEADER_SIZE];
+    size_t  offset = 0;
+
+    for (size_t i = 0; offset + sizeof(header) <= fa->fa_size; i++)
+    {
+        if ((0 != flash_area_read(fa, offset, header, sizeof(header)))
+            || (COREDUMP_OPEN_MAGIC != sys_get_le32(header)))
+        {
+            break;
+        }
+        const uint8_t *commit = &header[COREDUMP_BLOCK_SIZE];
+        uint32_t       stored = sys_get_le32(&commit[4]);
+        if ((COREDUMP_COMMIT_MAGIC != sys_get_le32(&commit[12]))
+            || (stored > fa->fa_size - offset - sizeof(header)))
+        {
+            offset = SIZE_MAX;
+            break;
+        }
+        if (i == index)
+        {
+            record->offset      = offset + sizeof(header);
+            record->raw_size    = sys_get_le32(&commit[0]);
+            record->stored_size = stored;
+            record->valid       = true;
+            return true;
+        }
+        offset += sizeof(header) + ROUND_UP(stored, COREDUMP_BLOCK_SIZE);
+    }
+
+    if (NULL != end)
+    {
+        *end = offset;
+    }
+    return false;
+}
+
+static void
+prvWritePage (void)
+{
+    size_t len = ROUND_UP(writer.page_len, COREDUMP_BLOCK_SIZE);
+
+    if ((0 != writer.error) || (0 == writer.page_len))
+    {
+        return;
+    }
+    memset(&writer.page[writer.page_len],
+           flash_area_erased_val(writer.fa),
+           len - writer.page_len);
+    if (0
+        != flash_area_write(writer.fa,
+                            writer.offset + COREDUMP_HEADER_SIZE
+                                + writer.written,
+                            writer.page,
+                            len))
+    {
+        writer.error = -EIO;
+    }
+    writer.written += len;
+    writer.page_len = 0;
+}
+
+/**
+ * @brief Receives the encoded bytes, written by pages
+ */
+static void
+prvEncoded (void *ctx, const uint8_t *data, size_t len)
+{
+    ARG_UNUSED(ctx);
+
+    if (0 != writer.error)
+    {
+        return;
+    }
+    if (writer.offset + COREDUMP_HEADER_SIZE + writer.stored_size + len
+        > writer.fa->fa_size)
+    {
+        writer.error = -ENOSPC;
+        return;
+    }
+    writer.crc = crc32_ieee_update(writer.crc, data, len);
+    writer.stored_size += len;
+    while (len > 0)
+    {
+        size_t chunk = MIN(len, sizeof(writer.page) - writer.page_len);
+        memcpy(&writer.page[writer.page_len], data, chunk);
+        writer.page_len += chunk;
+        data += chunk;
+        len -= chunk;
+        if (sizeof(writer.page) == writer.page_len)
+        {
+            prvWritePage();
+        }
+    }
+}
+
+static void
+prvBackendStart (void)
+{
+    uint8_t block[COREDUMP_BLOCK_SIZE];
+
+    memset(&writer, 0, sizeof(writer));
+    if (0 != flash_area_open(COREDUMP_PARTITION_ID, &writer.fa))
+    {
+        writer.error = -ENODEV;
+        return;
+    }
+    if (flash_area_align(writer.fa) > COREDUMP_BLOCK_SIZE)
+    {
+        writer.error = -ENOTSUP;
+        return;
+    }
+    // Appended after the dumps not uploaded yet
+    prvWalk(writer.fa, SIZE_MAX, NULL, &writer.offset);
+    if ((SIZE_MAX == writer.offset)
+        || (writer.offset + COREDUMP_HEADER_SIZE >= writer.fa->fa_size))
+    {
+        writer.error = -ENOSPC;
+        return;
+    }
+
+    memset(block, flash_area_erased_val(writer.fa), sizeof(block));
+    sys_put_le32(COREDUMP_OPEN_MAGIC, block);
+    if (0 != flash_area_write(writer.fa, writer.offset, block, sizeof(block)))
+    {
+        writer.error = -EIO;
+        return;
+    }
+    coredump_rle_init(&writer.rle, prvEncoded, NULL);
+}
+
+static void
+prvBackendOutput (uint8_t *buf, size_t buflen)
+{
+    if (0 != writer.error)
+    {
+        return;
+    }
+    writer.raw_size += buflen;
+    coredump_rle_write(&writer.rle, buf, buflen);
+}
+
+static void
+prvBackendEnd (void)
+{
+    uint8_t block[COREDUMP_BLOCK_SIZE];
+
+    if (0 != writer.error)
+    {
+        return;
+    }
+    coredump_rle_flush(&writer.rle);
+    prvWritePage();
+    if (0 != writer.error)
+    {
+        return;
+    }
+
+    memset(block, flash_area_erased_val(writer.fa), sizeof(block));
+    sys_put_le32(writer.raw_size, &block[0]);
+    sys_put_le32(writer.stored_size, &block[4]);
+    sys_put_le32(writer.crc, &block[8]);
+    sys_put_le32(COREDUMP_COMMIT_MAGIC, &block[12]);
+    if (0
+        != flash_area_write(writer.fa,
+                            writer.offset + COREDUMP_BLOCK_SIZE,
+                            block,
+                            sizeof(block)))
+    {
+        writer.error = -EIO;
+    }
+}
+
+static int
+prvBackendQuery (enum coredump_query_id query_id, void *arg)
+{
+    ARG_UNUSED(arg);
+    struct coredump_record record;
+
+    switch (query_id)
+    {
+        case COREDUMP_QUERY_GET_ERROR:
+            return writer.error;
+
+        case COREDUMP_QUERY_HAS_STORED_DUMP:
+            return coredump_store_get(0, &record) ? 1 : 0;
+
+        default:
+            return -ENOTSUP;
+    }
+}
+
+static int
+prvBackendCmd (enum coredump_cmd_id cmd_id, void *arg)
+{
+    ARG_UNUSED(arg);
+
+    switch (cmd_id)
+    {
+        case COREDUMP_CMD_CLEAR_ERROR:
+            writer.error = 0;
+            return 0;
+
+        case COREDUMP_CMD_ERASE_STORED_DUMP:
+            return coredump_store_erase() ? 0 : -EIO;
+
+        default:
+            return -ENOTSUP;
+    }
+}
+
+// Used by the coredump subsystem with CONFIG_DEBUG_COREDUMP_BACKEND_OTHER
+struct coredump_backend_api coredump_backend_other = {
+    .start         = prvBackendStart,
+    .end           = prvBackendEnd,
+    .buffer_output = prvBackendOutput,
+    .query         = prvBackendQuery,
+    .cmd           = prvBackendCmd,
+};
+
+static bool
+prvOpen (const struct flash_area **fa)
+{
+    if (0 != flash_area_open(COREDUMP_PARTITION_ID, fa))
+    {
+        LOG_ERR("Failed to open the coredump partition");
+        return false;
+    }
+    return true;
+}
+
+/**
+ * @brief Checks the crc32 of an encoded dump
+ */
+static bool
+prvVerify (const struct flash_area *fa, const struct coredump_record *record)
+{
+    uint8_t  chunk[64];
+    uint32_t crc = 0;
+
+    for (size_t offset = 0; offset < record->stored_size;
+         offset += sizeof(chunk))
+    {
+        size_t len = MIN(sizeof(chunk), record->stored_size - offset);
+        if (0 != flash_area_read(fa, record->offset + offset, chunk, len))
+        {
+            return false;
+        }
+        crc = crc32_ieee_update(crc, chunk, len);
+    }
+
+    uint8_t commit[16];
+    return (0
+            == flash_area_read(fa,
+                               record->offset - COREDUMP_BLOCK_SIZE,
+                               commit,
+                               sizeof(commit)))
+           && (crc == sys_get_le32(&commit[8]));
+}
+
+bool
+coredump_store_init (void)
+{
+    const struct flash_area *fa;
+    struct coredump_record   record;
+    size_t                   count = 0;
+    size_t                   end;
+
+    if (!prvOpen(&fa))
+    {
+        return false;
+    }
+    while (prvWalk(fa, count, &record, NULL))
+    {
+        LOG_WRN("Coredump #%zu stored: %u bytes, %u encoded",
+                count,
+                record.raw_size,
+                record.stored_size);
+        count++;
+    }
+    bool ret = true;
+    prvWalk(fa, SIZE_MAX, NULL, &end);
+    if ((SIZE_MAX == end) && (0 == count))
+    {
+        // Nothing to upload, make room for the next crash
+        LOG_WRN("Interrupted coredump, erasing");
+        ret = (0 == flash_area_erase(fa, 0, fa->fa_size));
+    }
+    flash_area_close(fa);
+    return ret;
+}
+
+bool
+coredump_store_get (size_t index, struct coredump_record *record)
+{
+    const struct flash_area *fa;
+
+    if (!prvOpen(&fa))
+    {
+        return false;
+    }
+    bool ret = prvWalk(fa, index, record, NULL);
+    if (ret)
+    {
+        record->valid = prvVerify(fa, record);
+    }
+    flash_area_close(fa);
+    return ret;
+}
+
+bool
+coredump_store_read (const struct coredump_record *record,
+                     size_t                        offset,
+                     void                         *buf,
+                     size_t                        len)
+{
+    const struct flash_area *fa;
+
+    if ((offset > record->stored_size) || (len > record->stored_size - offset)
+        || !prvOpen(&fa))
+    {
+        return false;
+    }
+    bool ret = (0 == flash_area_read(fa, record->offset + offset, buf, len));
+    flash_area_close(fa);
+    return ret;
+}
+
+bool
+coredump_store_erase (void)
+{
+    const struct flash_area *fa;
+
+    if (!prvOpen(&fa))
+    {
+        return false;
+    }
+    bool ret = (0 == flash_area_erase(fa, 0, fa->fa_size));
+    if (!ret)
+    {
+        LOG_ERR("Failed to erase the coredump partition");
+    }
+    flash_area_close(fa);
+    return ret;
+}
+
+#endif // CONFIG_APP_COREDUMP
@@ -0,0 +1,77 @@
+/**
+ * @file      coredump_store.h
+ * @author    Theodore Bardy
+ *
+ * @note      This file is part of Witekio's Zephyr Demo project
+ * @brief     Coredump backend storing compressed dumps in flash
+ */
+
+#ifndef COREDUMP_STORE_H
+#define COREDUMP_STORE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif // __cplusplus
+
+    /**
+     * @brief Dump stored in the coredump partition
+     */
+    struct coredump_record
+    {
+        size_t   offset;      // Of the run-length encoded dump
+        uint32_t raw_size;    // Size of the dump as output by Zephyr
+        uint32_t stored_size; // Size of the encoded dump
+        bool     valid;       // Checksum matching
+    };
+
+#ifdef CONFIG_APP_COREDUMP
+    /**
+     * @brief Logs the dumps stored by the previous crashes
+     * @return true if the partition can be read, false otherwise
+     */
+    bool coredump_store_init(void);
+
+    /**
+     * @brief Gets a stored dump, oldest first
+     * @param index Index of the dump
+     * @param record Dump
+     * @return true if the dump exists, false past the last one
+     */
+    bool coredump_store_get(size_t index, struct coredump_record *record);
+
+    /**
+     * @brief Reads an encoded dump
+     * @param record Dump
+     * @param offset Offset in the encoded dump
+     * @param buf Buffer receiving the bytes
+     * @param len Number of bytes to read
+     * @return true if the bytes were read, false otherwise
+     */
+    bool coredump_store_read(const struct coredump_record *record,
+                             size_t                        offset,
+                             void                         *buf,
+                             size_t                        len);
+
+    /**
+     * @brief Erases the stored dumps
+     * @return true if the partition was erased, false otherwise
+     */
+    bool coredump_store_erase(void);
+#else
+static inline bool
+coredump_store_init (void)
+{
+    return true;
+}
+#endif // CONFIG_APP_COREDUMP
+
+#ifdef __cplusplus
+}
+#endif // __cplusplus
+
+#endif // COREDUMP_STORE_H
@@ -0,0 +1,289 @@
+/**
+ * @file      coredump_upload.c
+ * @author    Theodore Bardy
+ *
+ * @note      This file is part of Witekio's Zephyr Demo project
+ * @brief     Upload of the stored coredumps
+ */
+
+#include <zephyr/logging/log.h>
+LOG_MODULE_REGISTER(coredump_upload);
+
+#include "coredump_upload.h"
+
+#ifdef CONFIG_APP_COREDUMP
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <zephyr/kernel.h>
+#include <zephyr/net/http/client.h>
+#include <zephyr/net/socket.h>
+#include <zephyr/sys/byteorder.h>
+
+#include "coredump_store.h"
+
+/*
+ * The body is the stored dumps with a valid checksum, oldest first, each
+ * preceded by its raw and encoded sizes (LE32), see scripts/
+ * mock_mender_server.py for the decoder.
+ */
+#define COREDUMP_DUMP_HEADER_SIZE (8)
+#define COREDUMP_HOST_MAX_LENGTH  (64)
+#define COREDUMP_PORT_MAX_LENGTH  (6)
+#define COREDUMP_TIMEOUT_MS       (10000)
+// Path on the Mender server host when no upload URL is configured, only an
+// on-premise server, e.g. the mock one, can serve it
+#ifdef CONFIG_MENDER_SERVER_HOST_ON_PREM
+#define COREDUMP_UPLOAD_PATH "/coredump"
+#define COREDUMP_UPLOAD_URL                      \
+    (('\0' != CONFIG_APP_COREDUMP_UPLOAD_URL[0]) \
+         ? CONFIG_APP_COREDUMP_UPLOAD_URL        \
+         : CONFIG_MENDER_SERVER_HOST COREDUMP_UPLOAD_PATH)
+#else
+#define COREDUMP_UPLOAD_URL (CONFIG_APP_COREDUMP_UPLOAD_URL)
+#endif // CONFIG_MENDER_SERVER_HOST_ON_PREM
+
+struct coredump_upload_ctx
+{
+    size_t   count;
+    uint16_t status; // HTTP status code, 0 until the response is received
+};
+
+/**
+ * @brief Splits the upload URL
+ * @param host Buffer receiving the host name
+ * @param port Buffer receiving the port
+ * @param tls Set if the server uses TLS
+ * @return Path of the URL
+ */
+static const char *
+prvParseUrl (char *host, char *port, bool *tls)
+{
+    const char *url   = COREDUMP_UPLOAD_URL;
+    const char *start = strstr(url, "://");
+
+    *tls  = (0 == strncmp(url, "https", 5));
+    start = (NULL != start) ? start + 3 : url;
+    size_t len = strcspn(start, ":/");
+    memcpy(host, start, MIN(len, COREDUMP_HOST_MAX_LENGTH - 1));
+    host[MIN(len, COREDUMP_HOST_MAX_LENGTH - 1)] = '\0';
+    start += len;
+
+    if (':' == *start)
+    {
+        start++;
+        len = strcspn(start, "/");
+        memcpy(port, start, MIN(len, COREDUMP_PORT_MAX_LENGTH - 1));
+        port[MIN(len, COREDUMP_PORT_MAX_LENGTH - 1)] = '\0';
+        start += len;
+    }
+    else
+    {
+        strcpy(port, *tls ? "443" : "80");
+    }
+
+    return ('\0' != *start) ? start : "/";
+}
+
+static int
+prvConnect (const char *host, const char *port, bool tls)
+{
+    struct zsock_addrinfo  hints = { .ai_family   = AF_INET,
+                                     .ai_socktype = SOCK_STREAM };
+    struct zsock_addrinfo *res   = NULL;
+    if (0 != zsock_getaddrinfo(host, port, &hints, &res))
+    {
+        LOG_ERR("Unable to resolve %s", host);
+        return -EHOSTUNREACH;
+    }
+
+    int sock = zsock_socket(
+        res->ai_family, SOCK_STREAM, tls ? IPPROTO_TLS_1_2 : IPPROTO_TCP);
+    if (sock < 0)
+    {
+        goto END;
+    }
+
+#if defined(CONFIG_NET_SOCKETS_SOCKOPT_TLS)
+    if (tls)
+    {
+        sec_tag_t sec_tags[] = {
+            CONFIG_MENDER_NET_CA_CERTIFICATE_TAG_PRIMARY,
+#ifdef CONFIG_MENDER_NET_CA_CERTIFICATE_TAG_SECONDARY_ENABLED
+            CONFIG_MENDER_NET_CA_CERTIFICATE_TAG_SECONDARY,
+#endif
+        };
+        if ((0
+             != zsock_setsockopt(
+                 sock, SOL_TLS, TLS_SEC_TAG_LIST, sec_tags, sizeof(sec_tags)))
+            || (0
+                != zsock_setsockopt(
+                    sock, SOL_TLS, TLS_HOSTNAME, host, strlen(host) + 1)))
+        {
+            goto CLOSE;
+        }
+    }
+#endif
+
+    if (0 == zsock_connect(sock, res->ai_addr, res->ai_addrlen))
+    {
+        goto END;
+    }
+    LOG_ERR("Unable to reach %s: %d", host, errno);
+
+CLOSE:
+    zsock_close(sock);
+    sock = -ENOTCONN;
+END:
+    zsock_freeaddrinfo(res);
+    return sock;
+}
+
+static bool
+prvSend (int sock, const void *data, size_t len)
+{
+    const uint8_t *bytes = data;
+
+    while (len > 0)
+    {
+        ssize_t sent = zsock_send(sock, bytes, len, 0);
+        if (sent <= 0)
+        {
+            return false;
+        }
+        bytes += sent;
+        len -= sent;
+    }
+    return true;
+}
+
+/**
+ * @brief Streams the dumps from the flash after the request headers
+ */
+static int
+prvPayload (int sock, struct http_request *req, void *user_data)
+{
+    ARG_UNUSED(user_data);
+    struct coredump_record record;
+    uint8_t                chunk[256];
+    int                    total = 0;
+
+    for (size_t i = 0; coredump_store_get(i, &record); i++)
+    {
+        if (!record.valid)
+        {
+            continue;
+        }
+        sys_put_le32(record.raw_size, &chunk[0]);
+        sys_put_le32(record.stored_size, &chunk[4]);
+        if (!prvSend(sock, chunk, COREDUMP_DUMP_HEADER_SIZE))
+        {
+            return -EIO;
+        }
+        for (size_t offset = 0; offset < record.stored_size;
+             offset += sizeof(chunk))
+        {
+            size_t len = MIN(sizeof(chunk), record.stored_size - offset);
+            if (!coredump_store_read(&record, offset, chunk, len)
+                || !prvSend(sock, chunk, len))
+            {
+                return -EIO;
+            }
+        }
+        total += COREDUMP_DUMP_HEADER_SIZE + record.stored_size;
+    }
+    return (total == (int)req->payload_len) ? total : -EIO;
+}
+
+static int
+prvResponse (struct http_response *rsp,
+             enum http_final_call  final_data,
+             void                 *user_data)
+{
+    struct coredump_upload_ctx *ctx = user_data;
+
+    if (HTTP_DATA_FINAL == final_data)
+    {
+        ctx->status = rsp->http_status_code;
+    }
+    return 0;
+}
+
+bool
+coredump_upload_is_configured (void)
+{
+    return ('\0' != COREDUMP_UPLOAD_URL[0]);
+}
+
+bool
+coredump_upload (const char *identity)
+{
+    struct coredump_upload_ctx ctx     = { 0 };
+    struct coredump_record     record;
+    size_t                     payload = 0;
+
+    for (size_t i = 0; coredump_store_get(i, &record); i++)
+    {
+        if (record.valid)
+        {
+            payload += COREDUMP_DUMP_HEADER_SIZE + record.stored_size;
+            ctx.count++;
+        }
+        else
+        {
+            LOG_WRN("Coredump #%zu is corrupted, dropped", i);
+        }
+    }
+    if (0 == ctx.count)
+    {
+        // Erase the corrupted ones, if any, to make room for the next crash
+        return !coredump_store_get(0, &record) || coredump_store_erase();
+    }
+    char        host[COREDUMP_HOST_MAX_LENGTH];
+    char        port[COREDUMP_PORT_MAX_LENGTH];
+    bool        tls;
+    const char *path = prvParseUrl(host, port, &tls);
+    int         sock = prvConnect(host, port, tls);
+    if (sock < 0)
+    {
+        return false;
+    }
+
+    char        identity_header[80];
+    const char *headers[] = { identity_header, NULL };
+    uint8_t     recv_buf[256];
+    snprintf(identity_header,
+             sizeof(identity_header),
+             "X-Device-Identity: %s\r\n",
+             identity);
+
+    struct http_request req = {
+        .method             = HTTP_POST,
+        .url                = path,
+        .host               = host,
+        .protocol           = "HTTP/1.1",
+        .header_fields      = headers,
+        .content_type_value = "application/octet-stream",
+        .payload_cb         = prvPayload,
+        .payload_len        = payload,
+        .response           = prvResponse,
+        .recv_buf           = recv_buf,
+        .recv_buf_len       = sizeof(recv_buf),
+    };
+    int  ret = http_client_req(sock, &req, COREDUMP_TIMEOUT_MS, &ctx);
+    bool ok  = (ret >= 0) && (ctx.status >= 200) && (ctx.status < 300);
+    zsock_close(sock);
+
+    if (!ok)
+    {
+        LOG_ERR("Failed to upload the coredumps (%d, HTTP %u)",
+                ret,
+                ctx.status);
+        return false;
+    }
+    LOG_INF("%zu coredumps uploaded (%zu bytes)", ctx.count, payload);
+    return coredump_store_erase();
+}
+
+#endif // CONFIG_APP_COREDUMP
@@ -0,0 +1,57 @@
+/**
+ * @file      coredump_upload.h
+ * @author    Theodore Bardy
+ *
+ * @note      This file is part of Witekio's Zephyr Demo project
+ * @brief     Upload of the stored coredumps
+ */
+
+#ifndef COREDUMP_UPLOAD_H
+#define COREDUMP_UPLOAD_H
+
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif // __cplusplus
+
+#ifdef CONFIG_APP_COREDUMP
+    /**
+     * @brief Tells whether the stored dumps can be sent: the hosted Mender
+     * servers do not accept them, CONFIG_APP_COREDUMP_UPLOAD_URL is required
+     * @return true if an upload URL is configured or the Mender server is an
+     * on-premise one, false otherwise
+     */
+    bool coredump_upload_is_configured(void);
+
+    /**
+     * @brief Sends the stored dumps to CONFIG_APP_COREDUMP_UPLOAD_URL, or to
+     * /coredump on an on-premise Mender server, in a single POST request
+     * and erases them once the server accepted them. Blocks for the name
+     * resolution, the connection, the request and the erase
+     * @param identity Identity of the device, e.g. "mac=00:11:22:33:44:55"
+     * @return true if there was nothing to send or the dumps were sent, false
+     * otherwise
+     */
+    bool coredump_upload(const char *identity);
+#else
+static inline bool
+coredump_upload_is_configured (void)
+{
+    return false;
+}
+
+static inline bool
+coredump_upload (const char *identity)
+{
+    (void)identity;
+    return true;
+}
+#endif // CONFIG_APP_COREDUMP
+
+#ifdef __cplusplus
+}
+#endif // __cplusplus
+
+#endif // COREDUMP_UPLOAD_H
@@ -0,0 +1,543 @@
+/**
+ * @file      health_check.c
+ * @author    Theodore Bardy
+ *
+ * @note      This file is part of Witekio's Zephyr Demo project
+ * @brief     Post-update health check confirming or reverting the image
+ */
+
+#include <zephyr/logging/log.h>
+LOG_MODULE_REGISTER(health_check);
+
+#include "health_check.h"
+
+#ifdef CONFIG_APP_HEALTH_CHECK
+
+#include <string.h>
+#include <zephyr/kernel.h>
+#include <zephyr/dfu/mcuboot.h>
+#include <zephyr/net/socket.h>
+#include <zephyr/net/tls_credentials.h>
+#include <zephyr/settings/settings.h>
+#include <zephyr/sys/reboot.h>
+
+#include "dns_cache.h"
+#include "led.h"
+#include "runtime.h"
+#include "wifi_agent.h"
+
+#define HEALTH_SETTINGS_KEY    "health/report"
+#define HEALTH_HOST_MAX_LENGTH (64)
+#define HEALTH_PORT_MAX_LENGTH (6)
+
+// Delay before the first new attempt to reach the server, doubled after each
+// failure up to the maximum
+#define HEALTH_SERVER_RETRY_MS     (500)
+#define HEALTH_SERVER_RETRY_MAX_MS (4000)
+
+static const health_check_step_t steps[] = {
+    HEALTH_CHECK_STEP_LED,
+    HEALTH_CHECK_STEP_WIFI,
+    HEALTH_CHECK_STEP_SERVER,
+    HEALTH_CHECK_STEP_CONFIRM,
+};
+
+static health_check_report_t report;
+static bool                  confirmed_this_boot = false;
+static int64_t               start_ms;
+static int64_t               deadline_ms;
+
+#ifdef CONFIG_APP_RUNTIME_EVENT_LOOP
+// Health check events
+#define HEALTH_EVENT_STEP   BIT(0)
+#define HEALTH_EVENT_SERVER BIT(1)
+
+// Period at which the Wi-Fi connection is checked
+#define HEALTH_POLL_PERIOD_MS (100)
+
+static void prvHealthCheckHandler(struct runtime_agent *agent,
+                                  uint32_t              events);
+static RUNTIME_AGENT_DEFINE(health_agent, prvHealthCheckHandler);
+static size_t current_step   = 0;
+static bool   wifi_requested = false;
+static void (*passed_callback)(void);
+
+// The name resolution and the TLS handshake block, the server is checked on
+// its own thread instead of the event loop. Its stack is taken from the heap
+// for the check only, a static one would cost more than the agent threads
+// the event loop saves
+static k_thread_stack_t *server_stack = NULL;
+static struct k_thread   server_thread;
+static bool              server_started   = false;
+static bool              server_reachable = false;
+#endif // CONFIG_APP_RUNTIME_EVENT_LOOP
+
+static int
+prvSettingsSet (const char     *name,
+                size_t          len,
+                settings_read_cb read_cb,
+                void           *cb_arg)
+{
+    if (0 != strcmp(name, "report"))
+    {
+        return -ENOENT;
+    }
+    if (sizeof(report) != len)
+    {
+        return -EINVAL;
+    }
+
+    return (read_cb(cb_arg, &report, sizeof(report)) < 0) ? -EIO : 0;
+}
+SETTINGS_STATIC_HANDLER_DEFINE(
+    health, "health", NULL, prvSettingsSet, NULL, NULL);
+
+/**
+ * @brief Extracts the host name and port from CONFIG_MENDER_SERVER_HOST
+ * @param host Buffer receiving the host name
+ * @param port Buffer receiving the port
+ * @return true if the server uses TLS, false otherwise
+ */
+static bool
+prvServerHost (char *host, char *port)
+{
+    const char *start = strstr(CONFIG_MENDER_SERVER_HOST, "://");
+    bool        tls   = (0 == strncmp(CONFIG_MENDER_SERVER_HOST, "https", 5));
+
+    start = (NULL != start) ? start + 3 : CONFIG_MENDER_SERVER_HOST;
+    size_t len = strcspn(start, ":/");
+    memcpy(host, start, MIN(len, HEALTH_HOST_MAX_LENGTH - 1));
+    host[MIN(len, HEALTH_HOST_MAX_LENGTH - 1)] = '\0';
+
+    if (':' == start[len])
+    {
+        start += len + 1;
+        len = MIN(strcspn(start, "/"), HEALTH_PORT_MAX_LENGTH - 1);
+        memcpy(port, start, len);
+        port[len] = '\0';
+    }
+    else
+    {
+        strcpy(port, tls ? "443" : "80");
+    }
+
+    return tls;
+}
+
+/**
+ * @brief Opens a connection to the Mender server, including the TLS handshake
+ * @return true if the server is reachable, false otherwise
+ */
+static bool
+prvCheckServer (void)
+{
+    char host[HEALTH_HOST_MAX_LENGTH];
+    char port[HEALTH_PORT_MAX_LENGTH];
+    bool tls = prvServerHost(host, port);
+
+    struct zsock_addrinfo  hints = { .ai_family   = AF_INET,
+                                     .ai_socktype = SOCK_STREAM };
+    struct zsock_addrinfo *res   = NULL;
+    if (0 != zsock_getaddrinfo(host, port, &hints, &res))
+    {
+        LOG_ERR("Unable to resolve %s", host);
+        return false;
+    }
+
+    bool ret  = false;
+    int  sock = zsock_socket(
+        res->ai_family, SOCK_STREAM, tls ? IPPROTO_TLS_1_2 : IPPROTO_TCP);
+    if (sock < 0)
+    {
+        goto END;
+    }
+
+#if defined(CONFIG_NET_SOCKETS_SOCKOPT_TLS)
+    if (tls)
+    {
+        sec_tag_t sec_tags[] = {
+            CONFIG_MENDER_NET_CA_CERTIFICATE_TAG_PRIMARY,
+#ifdef CONFIG_MENDER_NET_CA_CERTIFICATE_TAG_SECONDARY_ENABLED
+            CONFIG_MENDER_NET_CA_CERTIFICATE_TAG_SECONDARY,
+#endif
+        };
+        if ((0
+             != zsock_setsockopt(
+                 sock, SOL_TLS, TLS_SEC_TAG_LIST, sec_tags, sizeof(sec_tags)))
+            || (0
+                != zsock_setsockopt(
+                    sock, SOL_TLS, TLS_HOSTNAME, host, strlen(host) + 1)))
+        {
+            goto CLOSE;
+        }
+    }
+#endif
+
+    // The TLS handshake is part of connect()
+    ret = (0 == zsock_connect(sock, res->ai_addr, res->ai_addrlen));
+    if (!ret)
+    {
+        LOG_ERR("Unable to reach %s: %d", host, errno);
+        // The next attempt must not use a stale cached address
+        dns_cache_refresh(host);
+    }
+
+CLOSE:
+    zsock_close(sock);
+END:
+    zsock_freeaddrinfo(res);
+    return ret;
+}
+
+/**
+ * @brief Gets the delay before the next attempt to reach the server
+ * @param delay_ms Delay before the previous attempt, doubled
+ * @param deadline End of the time budget
+ * @return The delay, negative if no attempt fits in the time budget anymore
+ */
+static int32_t
+prvServerRetryDelay (int32_t *delay_ms, int64_t deadline)
+{
+    int32_t delay = *delay_ms;
+    *delay_ms     = MIN(2 * delay, HEALTH_SERVER_RETRY_MAX_MS);
+
+    if (k_uptime_get() + delay >= deadline)
+    {
+        LOG_ERR("Health check time budget exhausted");
+        return -1;
+    }
+    LOG_WRN("Server not reachable, retrying in %d ms", delay);
+    return delay;
+}
+
+/**
+ * @brief Tries to reach the server until it answers or the time budget is
+ * exhausted, the network may still be settling after the reboot
+ */
+static bool
+prvCheckServerUntil (int64_t deadline)
+{
+    int32_t delay_ms = HEALTH_SERVER_RETRY_MS;
+
+    while (!prvCheckServer())
+    {
+        int32_t delay = prvServerRetryDelay(&delay_ms, deadline);
+        if (delay < 0)
+        {
+            return false;
+        }
+        k_msleep(delay);
+    }
+    return true;
+}
+
+/**
+ * @brief Checks if the failure of a step is simulated to test the rollback,
+ * see CONFIG_APP_HEALTH_CHECK_FAIL_STEP
+ */
+static bool
+prvSimulatedFailure (health_check_step_t step)
+{
+    if (CONFIG_APP_HEALTH_CHECK_FAIL_STEP != step)
+    {
+        return false;
+    }
+    LOG_WRN("Simulating a failure of step %u", step);
+    return true;
+}
+
+/**
+ * @brief Runs a single check, unless the time budget is already exhausted
+ */
+static bool
+prvRunStep (health_check_step_t step, int64_t deadline)
+{
+    int64_t left = deadline - k_uptime_get();
+    if (left <= 0)
+    {
+        LOG_ERR("Health check time budget exhausted");
+        return false;
+    }
+
+    switch (step)
+    {
+        case HEALTH_CHECK_STEP_LED:
+#ifdef CONFIG_LED_STRIP
+        {
+            // Back to what the application displays once the LED answered
+            ui_led_tone_t previous = ui_led_get();
+            return ui_led_set(UI_LED_COLOR_ON) && ui_led_set(previous);
+        }
+#else
+            return true;
+#endif
+
+        case HEALTH_CHECK_STEP_WIFI:
+            // Connected is not enough, the server step needs an address
+            return wifi_agent_connect() && wifi_agent_has_address(left);
+
+        case HEALTH_CHECK_STEP_SERVER:
+            return prvCheckServerUntil(deadline);
+
+        case HEALTH_CHECK_STEP_CONFIRM:
+            return (0 == boot_write_img_confirmed());
+
+        default:
+            return false;
+    }
+}
+
+bool
+health_check_init (void)
+{
+    if (0 != settings_subsys_init())
+    {
+        LOG_ERR("Failed to initialize settings");
+        return false;
+    }
+    settings_load_subtree("health");
+
+    if (HEALTH_CHECK_RESULT_NONE != report.result)
+    {
+        LOG_INF("Last health check %s (step %u) in %u ms",
+                (HEALTH_CHECK_RESULT_PASSED == report.result) ? "passed"
+                                                              : "failed",
+                report.failed_step,
+                report.duration_ms);
+    }
+
+    return true;
+}
+
+bool
+health_check_is_pending (void)
+{
+    return !boot_is_img_confirmed();
+}
+
+/**
+ * @brief Starts timing a health check
+ */
+static void
+prvBegin (void)
+{
+    LOG_INF("Running post-update health check");
+    start_ms    = k_uptime_get();
+    deadline_ms = start_ms + CONFIG_APP_HEALTH_CHECK_TIMEOUT_MS;
+    memset(&report, 0, sizeof(report));
+}
+
+/**
+ * @brief Persists the outcome, reboots to roll back on failure
+ * @param failed_step The step which failed, HEALTH_CHECK_STEP_NONE if passed
+ */
+static void
+prvFinish (health_check_step_t failed_step)
+{
+    report.result      = (HEALTH_CHECK_STEP_NONE == failed_step)
+                             ? HEALTH_CHECK_RESULT_PASSED
+                             : HEALTH_CHECK_RESULT_FAILED;
+    report.failed_step = failed_step;
+    report.duration_ms = (uint32_t)(k_uptime_get() - start_ms);
+    settings_save_one(HEALTH_SETTINGS_KEY, &report, sizeof(report));
+
+    if (HEALTH_CHECK_RESULT_FAILED == report.result)
+    {
+        // MCUboot reverts the unconfirmed image on this reboot
+        LOG_ERR("Health check failed at step %u, rolling back",
+                report.failed_step);
+        k_msleep(100);
+        sys_reboot(SYS_REBOOT_COLD);
+    }
+
+    LOG_INF("Health check passed in %u ms, image confirmed",
+            report.duration_ms);
+    confirmed_this_boot = true;
+}
+
+#ifdef CONFIG_APP_RUNTIME_EVENT_LOOP
+/**
+ * @brief Checks the server with retries, then hands the result to the loop
+ */
+static void
+prvServerThread (void *arg1, void *arg2, void *arg3)
+{
+    server_reachable = prvCheckServerUntil(deadline_ms);
+
+#if defined(CONFIG_INIT_STACKS) && defined(CONFIG_THREAD_STACK_INFO)
+    // High water mark to size CONFIG_APP_HEALTH_CHECK_STACK_SIZE
+    size_t unused = 0;
+    if (0 == k_thread_stack_space_get(k_current_get(), &unused))
+    {
+        LOG_INF("Server check used %zu of %d bytes of stack",
+                (size_t)CONFIG_APP_HEALTH_CHECK_STACK_SIZE - unused,
+                CONFIG_APP_HEALTH_CHECK_STACK_SIZE);
+    }
+#endif // CONFIG_INIT_STACKS && CONFIG_THREAD_STACK_INFO
+
+    runtime_post(&health_agent, HEALTH_EVENT_SERVER);
+}
+
+/**
+ * @brief Starts the thread checking the server
+ * @return true if the thread started, false if its stack is not available
+ */
+static bool
+prvServerStart (void)
+{
+    server_stack = k_thread_stack_alloc(CONFIG_APP_HEALTH_CHECK_STACK_SIZE, 0);
+    if (NULL == server_stack)
+    {
+        LOG_ERR("Unable to allocate the server check stack");
+        return false;
+    }
+
+    k_thread_create(&server_thread,
+                    server_stack,
+                    CONFIG_APP_HEALTH_CHECK_STACK_SIZE,
+                    prvServerThread,
+                    NULL,
+                    NULL,
+                    NULL,
+                    CONFIG_APP_RUNTIME_PRIORITY,
+                    0,
+                    K_NO_WAIT);
+    k_thread_name_set(&server_thread, "health");
+    return true;
+}
+
+/**
+ * @brief Gives the stack of the server check back to the heap
+ */
+static void
+prvServerEnd (void)
+{
+    // The thread posted its result as its last action, it has exited or is
+    // about to
+    k_thread_join(&server_thread, K_FOREVER);
+    if (0 != k_thread_stack_free(server_stack))
+    {
+        LOG_ERR("Unable to free the server check stack");
+    }
+    server_stack = NULL;
+}
+
+static void
+prvHealthCheckHandler (struct runtime_agent *agent, uint32_t events)
+{
+    for (; current_step < ARRAY_SIZE(steps); current_step++)
+    {
+        health_check_step_t step = steps[current_step];
+
+        if (prvSimulatedFailure(step))
+        {
+            prvFinish(step);
+            return;
+        }
+
+        // The Wi-Fi agent runs on the same loop, poll instead of waiting
+        if (HEALTH_CHECK_STEP_WIFI == step)
+        {
+            if (!wifi_requested)
+            {
+                wifi_requested = true;
+                if (!wifi_agent_connect())
+                {
+                    prvFinish(step);
+                    return;
+                }
+            }
+            if (!wifi_agent_has_address(0))
+            {
+                if (k_uptime_get() >= deadline_ms)
+                {
+                    LOG_ERR("Health check time budget exhausted");
+                    prvFinish(step);
+                    return;
+                }
+                runtime_post_after(
+                    agent, HEALTH_EVENT_STEP, K_MSEC(HEALTH_POLL_PERIOD_MS));
+                return;
+            }
+        }
+        else if (HEALTH_CHECK_STEP_SERVER == step)
+        {
+            if (!server_started)
+            {
+                server_started = true;
+                if (!prvServerStart())
+                {
+                    prvFinish(step);
+                }
+                return;
+            }
+            if (0 == (events & HEALTH_EVENT_SERVER))
+            {
+                return;
+            }
+            prvServerEnd();
+            if (!server_reachable)
+            {
+                prvFinish(step);
+                return;
+            }
+        }
+        else if (!prvRunStep(step, deadline_ms))
+        {
+            prvFinish(step);
+            return;
+        }
+    }
+
+    prvFinish(HEALTH_CHECK_STEP_NONE);
+    passed_callback();
+}
+
+void
+health_check_start (void (*passed)(void))
+{
+    passed_callback = passed;
+    current_step    = 0;
+    wifi_requested  = false;
+    server_started  = false;
+    prvBegin();
+
+    runtime_agent_init(&health_agent);
+    runtime_post(&health_agent, HEALTH_EVENT_STEP);
+}
+#else
+bool
+health_check_run (void)
+{
+    health_check_step_t failed_step = HEALTH_CHECK_STEP_NONE;
+
+    prvBegin();
+    for (size_t i = 0; i < ARRAY_SIZE(steps); i++)
+    {
+        if (prvSimulatedFailure(steps[i])
+            || !prvRunStep(steps[i], deadline_ms))
+        {
+            failed_step = steps[i];
+            break;
+        }
+    }
+
+    // Does not return on failure
+    prvFinish(failed_step);
+    return true;
+}
+#endif // CONFIG_APP_RUNTIME_EVENT_LOOP
+
+bool
+health_check_confirmed_this_boot (void)
+{
+    return confirmed_this_boot;
+}
+
+const health_check_report_t *
+health_check_get_report (void)
+{
+    return &report;
+}
+
+#endif // CONFIG_APP_HEALTH_CHECK
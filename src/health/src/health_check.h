@@ -0,0 +1,92 @@
+/**
+ * @file      health_check.h
+ * @author    Theodore Bardy
+ *
+ * @note      This file is part of Witekio's Zephyr Demo project
+ * @brief     Post-update health check confirming or reverting the image
+ */
+
+#ifndef HEALTH_CHECK_H
+#define HEALTH_CHECK_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif // __cplusplus
+
+    typedef enum
+    {
+        HEALTH_CHECK_RESULT_NONE,
+        HEALTH_CHECK_RESULT_PASSED,
+        HEALTH_CHECK_RESULT_FAILED,
+    } health_check_result_t;
+
+    typedef enum
+    {
+        HEALTH_CHECK_STEP_NONE,
+        HEALTH_CHECK_STEP_LED,
+        HEALTH_CHECK_STEP_WIFI,
+        HEALTH_CHECK_STEP_SERVER,
+        HEALTH_CHECK_STEP_CONFIRM,
+    } health_check_step_t;
+
+    /**
+     * @brief Outcome of the last health check, persisted across reboots
+     */
+    typedef struct
+    {
+        uint8_t  result;      // health_check_result_t
+        uint8_t  failed_step; // health_check_step_t
+        uint32_t duration_ms;
+    } health_check_report_t;
+
+    /**
+     * @brief Initializes the health check and loads the last report
+     * @return true if the health check initialized successfully, false
+     * otherwise
+     */
+    bool health_check_init(void);
+
+    /**
+     * @brief Checks if the running image still needs to be confirmed
+     * @return true if the image is on trial after an update, false otherwise
+     */
+    bool health_check_is_pending(void);
+
+#ifdef CONFIG_APP_RUNTIME_EVENT_LOOP
+    /**
+     * @brief Starts the checks on the event loop, the image is confirmed if
+     * they all pass within the configured time budget and the device reboots
+     * to roll back otherwise
+     * @param passed Called on the event loop once the image is confirmed
+     */
+    void health_check_start(void (*passed)(void));
+#else
+    /**
+     * @brief Runs the checks within the configured time budget, confirms the
+     * image if they all pass and reboots to roll back otherwise
+     * @return true if the image was confirmed, does not return on failure
+     */
+    bool health_check_run(void);
+#endif // CONFIG_APP_RUNTIME_EVENT_LOOP
+
+    /**
+     * @brief Checks if the image was confirmed by the health check since boot
+     * @return true if confirmed during this boot, false otherwise
+     */
+    bool health_check_confirmed_this_boot(void);
+
+    /**
+     * @brief Gets the last persisted health check report
+     * @return Pointer to the report
+     */
+    const health_check_report_t *health_check_get_report(void);
+
+#ifdef __cplusplus
+}
+#endif // __cplusplus
+
+#endif // HEALTH_CHECK_H
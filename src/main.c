@@ -13,11 +13,27 @@ LOG_MODULE_REGISTER(main);
 #include <zephyr/device.h>
 #include <zephyr/drivers/gpio.h>
 
-#include <esp_sleep.h>
-
+#include "bench.h"
+#include "coredump_store.h"
 #include "led.h"
+#include "platform.h"
+#include "prof.h"
+#include "runtime.h"
 #include "wifi_agent.h"
+#include "wifi_ps_policy.h"
 #include "ota_agent.h"
+#ifdef CONFIG_APP_HEALTH_CHECK
+#include "health_check.h"
+#endif
+#ifdef CONFIG_APP_KV_STORE
+#include "kv_store.h"
+#endif
+#ifdef CONFIG_APP_WIFI_MULTI_AP
+#include "wifi_cred_store.h"
+#endif
+#ifdef CONFIG_APP_KV_BENCHMARK
+#include "kv_bench.h"
+#endif
 
 #define BT0_NODE DT_ALIAS(bt0)
 #if !DT_NODE_HAS_STATUS_OKAY(BT0_NODE)
@@ -25,45 +41,49 @@ LOG_MODULE_REGISTER(main);
 #endif
 static const struct gpio_dt_spec bt0 = GPIO_DT_SPEC_GET(BT0_NODE, gpios);
 static struct gpio_callback bt0_cb_data;
+// Cycle counter when the debounced press was signaled, for wake-up latency
+static uint32_t button_pressed_cycles;
+
+#ifdef CONFIG_APP_RUNTIME_EVENT_LOOP
+// Application events
+#define APP_EVENT_BUTTON BIT(0)
+#define APP_EVENT_SLEEP  BIT(1)
+
+static void app_handler(struct runtime_agent *agent, uint32_t events);
+static RUNTIME_AGENT_DEFINE(app_agent, app_handler);
+#else
 K_SEM_DEFINE(button_pressed_sem, 0, 1);
+#endif // CONFIG_APP_RUNTIME_EVENT_LOOP
 
 
 static void cooldown_expired(struct k_work *work)
 {
     ARG_UNUSED(work);
+    button_pressed_cycles = k_cycle_get_32();
+#ifdef CONFIG_APP_RUNTIME_EVENT_LOOP
+    runtime_post(&app_agent, APP_EVENT_BUTTON);
+#else
     k_sem_give(&button_pressed_sem);
+#endif // CONFIG_APP_RUNTIME_EVENT_LOOP
 }
 static K_WORK_DELAYABLE_DEFINE(cooldown_work, cooldown_expired);
 
 void button_pressed(const struct device *dev, struct gpio_callback *cb, uint32_t pins)
 {
+    uint32_t start = k_cycle_get_32();
+
     // Debounce the button press by scheduling a delayed work
     k_work_reschedule(&cooldown_work, K_MSEC(15));
+    prof_probe(PROF_PROBE_BUTTON_CALLBACK, start);
 }
 
-#define APP_THREAD_STACK_SIZE (2048)
-#define APP_THREAD_PRIORITY   (5)
-
-static void enter_deep_sleep(void)
-{
-    LOG_INF("Preparing for deep sleep.\n");
-
-    esp_sleep_enable_ext0_wakeup(bt0.pin, 1);
-
-    LOG_INF("Entering deep sleep NOW.\n");
-    k_msleep(2000);
-    esp_deep_sleep_start();
-
-    // Code never returns here
-}
-
-void
-app_thread(void *arg1, void *arg2, void *arg3)
+static bool
+button_init(void)
 {
     if (!gpio_is_ready_dt(&bt0))
     {
         LOG_ERR("Error: button device %s is not ready", bt0.port->name);
-        goto ERROR;
+        return false;
     }
     int ret = gpio_pin_configure_dt(&bt0, GPIO_INPUT);
     if (ret != 0)
@@ -72,7 +92,7 @@ app_thread(void *arg1, void *arg2, void *arg3)
                 ret,
                 bt0.port->name,
                 bt0.pin);
-        goto ERROR;
+        return false;
     }
     ret = gpio_pin_interrupt_configure_dt(&bt0, GPIO_INT_LEVEL_ACTIVE);
     if (ret != 0)
@@ -81,25 +101,90 @@ app_thread(void *arg1, void *arg2, void *arg3)
                 ret,
                 bt0.port->name,
                 bt0.pin);
-        goto ERROR;
+        return false;
     }
     gpio_init_callback(&bt0_cb_data, button_pressed, BIT(bt0.pin));
     gpio_add_callback(bt0.port, &bt0_cb_data);
     ui_led_set(UI_LED_COLOR_OFF);
+    return true;
+}
+
+static void
+enter_sleep(void)
+{
+    ui_led_set(UI_LED_COLOR_OFF);
+
+    bench_mark(BENCH_EVENT_SLEEP);
+    wifi_ps_policy_report();
+#ifdef CONFIG_APP_WIFI_MULTI_AP
+    // The connection history is lost if not written before the sleep
+    wifi_cred_store_flush();
+#endif
+    prof_report();
+    bench_report();
+    platform_deep_sleep(&bt0);
+}
+
+#ifdef CONFIG_APP_RUNTIME_EVENT_LOOP
+static void
+app_handler(struct runtime_agent *agent, uint32_t events)
+{
+    static bool awake = false;
+
+    if (events & APP_EVENT_BUTTON)
+    {
+        bench_latency("wake_latency", button_pressed_cycles);
+        prof_probe(PROF_PROBE_BUTTON_RESPONSE, button_pressed_cycles);
+        if (!awake)
+        {
+            awake = true;
+            LOG_INF("Button pressed, connect to Wi-Fi update...");
+            bench_mark(BENCH_EVENT_WAKE);
+            // Connecting Wi-Fi alone never activated the Mender client, the
+            // OTA agent connects it before activating the client
+            ota_agent_start();
+        }
+        else
+        {
+            LOG_INF("Button pressed again, putting device to sleep...");
+            ota_agent_stop();
+            runtime_post_after(agent, APP_EVENT_SLEEP, K_MSEC(2000));
+        }
+    }
+
+    if (events & APP_EVENT_SLEEP)
+    {
+        enter_sleep();
+    }
+}
+#else
+#define APP_THREAD_STACK_SIZE (2048)
+#define APP_THREAD_PRIORITY   (5)
+
+void
+app_thread(void *arg1, void *arg2, void *arg3)
+{
+    if (!button_init())
+    {
+        goto ERROR;
+    }
 
     while (1)
     {
         k_sem_take(&button_pressed_sem, K_FOREVER);
+        bench_latency("wake_latency", button_pressed_cycles);
+        prof_probe(PROF_PROBE_BUTTON_RESPONSE, button_pressed_cycles);
         LOG_INF("Button pressed, connect to Wi-Fi update...");
-        wifi_agent_connect();
+        bench_mark(BENCH_EVENT_WAKE);
+        // The OTA agent connects Wi-Fi before activating the Mender client
+        ota_agent_start();
 
         k_sem_take(&button_pressed_sem, K_FOREVER);
+        prof_probe(PROF_PROBE_BUTTON_RESPONSE, button_pressed_cycles);
         LOG_INF("Button pressed again, putting device to sleep...");
-        wifi_agent_disconnect();
+        ota_agent_stop();
         k_msleep(2000);
-        ui_led_set(UI_LED_COLOR_OFF);
-
-        enter_deep_sleep();
+        enter_sleep();
     }
 
 ERROR:
@@ -119,16 +204,66 @@ K_THREAD_DEFINE(app_thread_id,
                 APP_THREAD_PRIORITY,
                 0,
                 0);
+#endif // CONFIG_APP_RUNTIME_EVENT_LOOP
+
+#ifdef CONFIG_APP_KV_STORE
+static void
+count_boot (void)
+{
+    uint32_t              boots = 0;
+    struct kv_store_stats stats;
+
+    if (!kv_store_init())
+    {
+        return;
+    }
+    if (kv_store_get("app/boots", &boots, sizeof(boots)) < 0)
+    {
+        boots = 0;
+    }
+    boots++;
+    if (kv_store_set("app/boots", &boots, sizeof(boots)) && kv_store_commit())
+    {
+        // On the board, the durations of the flash itself
+        kv_store_get_stats(&stats);
+        LOG_INF("Boot #%u, committed in %u us (%u flash ops)",
+                boots,
+                stats.commit_last_us,
+                stats.commit_last_ops);
+    }
+}
+#endif // CONFIG_APP_KV_STORE
 
 int
 main (void)
 {
     LOG_INF("Witekio Zephyr's app running on %s", CONFIG_BOARD_TARGET);
 
+#ifdef CONFIG_APP_KV_STORE
+    count_boot();
+#endif
+#ifdef CONFIG_APP_KV_BENCHMARK
+    kv_bench_run();
+#endif
+    // Dumps of the previous crashes are uploaded by the OTA agent
+    coredump_store_init();
+
     // Initialize subsystems
     wifi_agent_init();
     ota_agent_init();
     ui_led_init();
+#ifdef CONFIG_APP_HEALTH_CHECK
+    health_check_init();
+#endif
+
+#ifdef CONFIG_APP_RUNTIME_EVENT_LOOP
+    // The application runs on the event loop instead of its own thread
+    runtime_agent_init(&app_agent);
+    if (!button_init())
+    {
+        z_fatal_error(K_ERR_CPU_EXCEPTION, 0);
+    }
+#endif // CONFIG_APP_RUNTIME_EVENT_LOOP
 
     while (1)
     {
@@ -0,0 +1,428 @@
+/**
+ * @file      dns_cache.c
+ * @author    Theodore Bardy
+ *
+ * @note      This file is part of Witekio's Zephyr Demo project
+ * @brief     DNS cache kept across deep sleep
+ */
+
+#include <zephyr/logging/log.h>
+LOG_MODULE_REGISTER(dns_cache);
+
+#include "dns_cache.h"
+
+#ifdef CONFIG_APP_DNS_CACHE
+
+#include <stdlib.h>
+#include <string.h>
+#include <zephyr/kernel.h>
+#include <zephyr/net/socket.h>
+#include <zephyr/sys/crc.h>
+
+#include "bench.h"
+#include "platform.h"
+
+/*
+ * zsock_getaddrinfo() and zsock_freeaddrinfo() are wrapped at link time (see
+ * CMakeLists.txt) so that the Mender client and the health check use the
+ * cache without being modified:
+ *   - a name resolved before deep sleep is answered from retained memory
+ *     until its TTL expires, and resolved again in the background as soon
+ *     as it is answered, once per boot, to pick up address changes before
+ *     the next attempt of a client which failed to connect;
+ *   - the health check, which owns its connection, reports a failure with
+ *     dns_cache_refresh(), which drops the entry and resolves the name
+ *     again at once.
+ */
+#define DNS_CACHE_MAGIC           (0x31534E44U) // "DNS1"
+#define DNS_CACHE_HOST_MAX_LENGTH (64)
+// Results handed out at once, freed by zsock_freeaddrinfo()
+#define DNS_CACHE_RESULTS         (4)
+
+#define DNS_CACHE_THREAD_STACK_SIZE (2048)
+#define DNS_CACHE_THREAD_PRIORITY   (7)
+
+struct dns_cache_entry
+{
+    char     host[DNS_CACHE_HOST_MAX_LENGTH];
+    uint32_t addr;       // IPv4 address, network order
+    uint64_t expires_ms; // platform_get_rtc_ms() time
+};
+
+struct dns_cache_retained
+{
+    uint32_t               magic;
+    uint32_t               crc;
+    struct dns_cache_entry entries[CONFIG_APP_DNS_CACHE_ENTRIES];
+};
+
+struct dns_cache_result
+{
+    struct zsock_addrinfo info;
+    struct sockaddr_in    addr;
+};
+
+static PLATFORM_RETAINED struct dns_cache_retained cache;
+
+static struct dns_cache_result results[DNS_CACHE_RESULTS];
+static bool                    results_used[DNS_CACHE_RESULTS];
+static struct dns_cache_stats  stats;
+// Entries to resolve again in the background, and already resolved
+static uint32_t pending;
+static uint32_t revalidated;
+static bool     checked  = false;
+static bool     measured = false;
+
+K_MUTEX_DEFINE(dns_cache_lock);
+K_SEM_DEFINE(sem_dns_cache_revalidate, 0, 1);
+
+int  __real_zsock_getaddrinfo(const char                  *host,
+                              const char                  *service,
+                              const struct zsock_addrinfo *hints,
+                              struct zsock_addrinfo      **res);
+void __real_zsock_freeaddrinfo(struct zsock_addrinfo *ai);
+
+static uint32_t
+prvCrc (void)
+{
+    return crc32_ieee((const uint8_t *)cache.entries, sizeof(cache.entries));
+}
+
+/**
+ * @brief Validates the retained entries once per boot, they are garbage after
+ * a power loss
+ */
+static void
+prvCheck (void)
+{
+    if (checked)
+    {
+        return;
+    }
+    checked = true;
+
+    if ((DNS_CACHE_MAGIC != cache.magic) || (prvCrc() != cache.crc))
+    {
+        LOG_INF("No retained DNS entries");
+        memset(&cache, 0, sizeof(cache));
+        cache.magic = DNS_CACHE_MAGIC;
+        cache.crc   = prvCrc();
+    }
+}
+
+static struct dns_cache_entry *
+prvFind (const char *host)
+{
+    for (size_t i = 0; i < ARRAY_SIZE(cache.entries); i++)
+    {
+        if (0 == strcmp(cache.entries[i].host, host))
+        {
+            return &cache.entries[i];
+        }
+    }
+    return NULL;
+}
+
+static void
+prvStore (const char *host, const struct zsock_addrinfo *res)
+{
+    while ((NULL != res) && (AF_INET != res->ai_family))
+    {
+        res = res->ai_next;
+    }
+    if (NULL == res)
+    {
+        return;
+    }
+
+    // Replace the entry of the host, a free one or the oldest one
+    struct dns_cache_entry *entry = prvFind(host);
+    for (size_t i = 0; (NULL == entry) && (i < ARRAY_SIZE(cache.entries));
+         i++)
+    {
+        if ('\0' == cache.entries[i].host[0])
+        {
+            entry = &cache.entries[i];
+        }
+    }
+    if (NULL == entry)
+    {
+        entry = &cache.entries[0];
+        for (size_t i = 1; i < ARRAY_SIZE(cache.entries); i++)
+        {
+            if (cache.entries[i].expires_ms < entry->expires_ms)
+            {
+                entry = &cache.entries[i];
+            }
+        }
+    }
+
+    strcpy(entry->host, host);
+    entry->addr = ((const struct sockaddr_in *)res->ai_addr)->sin_addr.s_addr;
+    entry->expires_ms
+        = platform_get_rtc_ms() + (uint64_t)CONFIG_APP_DNS_CACHE_TTL_S * 1000;
+    cache.crc = prvCrc();
+}
+
+static bool
+prvParsePort (const char *service, uint16_t *port)
+{
+    char *end  = NULL;
+    long value = 0;
+
+    if (NULL != service)
+    {
+        value = strtol(service, &end, 10);
+        if (('\0' == service[0]) || ('\0' != *end) || (value < 0)
+            || (value > UINT16_MAX))
+        {
+            return false;
+        }
+    }
+    if (NULL != port)
+    {
+        *port = (uint16_t)value;
+    }
+    return true;
+}
+
+/**
+ * @brief Checks whether a resolution can be answered by the cache: IPv4 names
+ * with a numeric port, as used by the Mender client
+ */
+static bool
+prvCacheable (const char                  *host,
+              const char                  *service,
+              const struct zsock_addrinfo *hints)
+{
+    struct in_addr numeric;
+
+    if ((NULL == host) || (strlen(host) >= DNS_CACHE_HOST_MAX_LENGTH)
+        || (1 == zsock_inet_pton(AF_INET, host, &numeric)))
+    {
+        return false;
+    }
+    if ((NULL != hints)
+        && (((AF_INET != hints->ai_family) && (AF_UNSPEC != hints->ai_family))
+            || (0 != (hints->ai_flags & AI_NUMERICHOST))))
+    {
+        return false;
+    }
+    return prvParsePort(service, NULL);
+}
+
+/**
+ * @brief Builds a result from an entry, freed by zsock_freeaddrinfo()
+ */
+static struct zsock_addrinfo *
+prvResult (const struct dns_cache_entry *entry,
+           const char                   *service,
+           const struct zsock_addrinfo  *hints)
+{
+    for (size_t i = 0; i < ARRAY_SIZE(results); i++)
+    {
+        if (results_used[i])
+        {
+            continue;
+        }
+        results_used[i] = true;
+
+        struct dns_cache_result *result = &results[i];
+        uint16_t                 port   = 0;
+        memset(result, 0, sizeof(*result));
+        prvParsePort(service, &port);
+        result->addr.sin_family      = AF_INET;
+        result->addr.sin_port        = htons(port);
+        result->addr.sin_addr.s_addr = entry->addr;
+        result->info.ai_family       = AF_INET;
+        result->info.ai_socktype
+            = ((NULL != hints) && (0 != hints->ai_socktype))
+                  ? hints->ai_socktype
+                  : SOCK_STREAM;
+        result->info.ai_protocol = (NULL != hints) ? hints->ai_protocol : 0;
+        result->info.ai_addr     = (struct sockaddr *)&result->addr;
+        result->info.ai_addrlen  = sizeof(result->addr);
+        return &result->info;
+    }
+    return NULL;
+}
+
+int
+__wrap_zsock_getaddrinfo (const char                  *host,
+                          const char                  *service,
+                          const struct zsock_addrinfo *hints,
+                          struct zsock_addrinfo      **res)
+{
+    uint32_t start = k_cycle_get_32();
+
+    if (!prvCacheable(host, service, hints))
+    {
+        return __real_zsock_getaddrinfo(host, service, hints, res);
+    }
+
+    k_mutex_lock(&dns_cache_lock, K_FOREVER);
+    prvCheck();
+    struct dns_cache_entry *entry = prvFind(host);
+    if ((NULL != entry) && (platform_get_rtc_ms() < entry->expires_ms)
+        && (NULL != (*res = prvResult(entry, service, hints))))
+    {
+        // Use the address right away and check it is still current later
+        size_t index = entry - cache.entries;
+        if (0 == (revalidated & BIT(index)))
+        {
+            revalidated |= BIT(index);
+            pending |= BIT(index);
+            k_sem_give(&sem_dns_cache_revalidate);
+        }
+        stats.hits++;
+        k_mutex_unlock(&dns_cache_lock);
+        LOG_DBG("%s answered from the cache", host);
+        goto END;
+    }
+    stats.misses++;
+    k_mutex_unlock(&dns_cache_lock);
+
+    int ret = __real_zsock_getaddrinfo(host, service, hints, res);
+    if (0 != ret)
+    {
+        return ret;
+    }
+    k_mutex_lock(&dns_cache_lock, K_FOREVER);
+    prvStore(host, *res);
+    k_mutex_unlock(&dns_cache_lock);
+
+END:
+    // Time to the first address of the boot, parsed by scripts/ota_benchmark.py
+    if (!measured)
+    {
+        measured = true;
+        bench_latency("dns", start);
+    }
+    return 0;
+}
+
+void
+__wrap_zsock_freeaddrinfo (struct zsock_addrinfo *ai)
+{
+    for (size_t i = 0; i < ARRAY_SIZE(results); i++)
+    {
+        if (ai == &results[i].info)
+        {
+            k_mutex_lock(&dns_cache_lock, K_FOREVER);
+            results_used[i] = false;
+            k_mutex_unlock(&dns_cache_lock);
+            return;
+        }
+    }
+    __real_zsock_freeaddrinfo(ai);
+}
+
+void
+dns_cache_get_stats (struct dns_cache_stats *out)
+{
+    k_mutex_lock(&dns_cache_lock, K_FOREVER);
+    *out = stats;
+    k_mutex_unlock(&dns_cache_lock);
+}
+
+/**
+ * @brief Resolves a name with the resolver and caches its address
+ * @return true if the name was resolved, false otherwise
+ */
+static bool
+prvResolve (const char *host)
+{
+    struct zsock_addrinfo  hints = { .ai_family   = AF_INET,
+                                     .ai_socktype = SOCK_STREAM };
+    struct zsock_addrinfo *res   = NULL;
+
+    if (0 != __real_zsock_getaddrinfo(host, NULL, &hints, &res))
+    {
+        LOG_WRN("Unable to resolve %s again", host);
+        return false;
+    }
+    k_mutex_lock(&dns_cache_lock, K_FOREVER);
+    prvStore(host, res);
+    stats.revalidations++;
+    k_mutex_unlock(&dns_cache_lock);
+    __real_zsock_freeaddrinfo(res);
+    return true;
+}
+
+void
+dns_cache_refresh (const char *host)
+{
+    if (!prvCacheable(host, NULL, NULL))
+    {
+        return;
+    }
+
+    k_mutex_lock(&dns_cache_lock, K_FOREVER);
+    prvCheck();
+    struct dns_cache_entry *entry = prvFind(host);
+    if (NULL != entry)
+    {
+        memset(entry, 0, sizeof(*entry));
+        cache.crc = prvCrc();
+        stats.invalidations++;
+    }
+    k_mutex_unlock(&dns_cache_lock);
+
+    if (NULL != entry)
+    {
+        LOG_WRN("Unable to connect to %s, resolving it again", host);
+        prvResolve(host);
+    }
+}
+
+static void
+prvRevalidate (size_t index)
+{
+    char host[DNS_CACHE_HOST_MAX_LENGTH];
+
+    k_mutex_lock(&dns_cache_lock, K_FOREVER);
+    strcpy(host, cache.entries[index].host);
+    k_mutex_unlock(&dns_cache_lock);
+
+    // On failure, the entry is kept until its TTL expires or
+    // dns_cache_refresh() drops it
+    if ('\0' != host[0])
+    {
+        prvResolve(host);
+    }
+}
+
+static void
+prvRevalidateThread (void *p1, void *p2, void *p3)
+{
+    ARG_UNUSED(p1);
+    ARG_UNUSED(p2);
+    ARG_UNUSED(p3);
+
+    while (1)
+    {
+        k_sem_take(&sem_dns_cache_revalidate, K_FOREVER);
+        for (size_t i = 0; i < ARRAY_SIZE(cache.entries); i++)
+        {
+            k_mutex_lock(&dns_cache_lock, K_FOREVER);
+            bool todo = (0 != (pending & BIT(i)));
+            pending &= ~BIT(i);
+            k_mutex_unlock(&dns_cache_lock);
+            if (todo)
+            {
+                prvRevalidate(i);
+            }
+        }
+    }
+}
+K_THREAD_DEFINE(dns_cache_thread_id,
+                DNS_CACHE_THREAD_STACK_SIZE,
+                prvRevalidateThread,
+                NULL,
+                NULL,
+                NULL,
+                DNS_CACHE_THREAD_PRIORITY,
+                0,
+                0);
+
+#endif // CONFIG_APP_DNS_CACHE
@@ -0,0 +1,62 @@
+/**
+ * @file      dns_cache.h
+ * @author    Theodore Bardy
+ *
+ * @note      This file is part of Witekio's Zephyr Demo project
+ * @brief     DNS cache kept across deep sleep
+ */
+
+#ifndef DNS_CACHE_H
+#define DNS_CACHE_H
+
+#include <stdint.h>
+#include <zephyr/sys/util.h>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif // __cplusplus
+
+    /**
+     * @brief DNS cache statistics since boot
+     */
+    struct dns_cache_stats
+    {
+        uint32_t hits;          // Resolutions answered from the cache
+        uint32_t misses;        // Resolutions sent to the resolver
+        uint32_t revalidations; // Background resolutions of cached names
+        uint32_t invalidations; // Entries dropped after a connection failure
+    };
+
+#ifdef CONFIG_APP_DNS_CACHE
+
+
+    /**
+     * @brief Gets the DNS cache statistics
+     * @param stats Statistics
+     */
+    void dns_cache_get_stats(struct dns_cache_stats *stats);
+
+    /**
+     * @brief Drops the cached address of a host after a connection to it
+     * failed, and resolves the name again right away so that the next
+     * attempt uses a current address
+     * @param host Host name
+     */
+    void dns_cache_refresh(const char *host);
+
+#else
+
+static inline void
+dns_cache_refresh (const char *host)
+{
+    ARG_UNUSED(host);
+}
+
+#endif // CONFIG_APP_DNS_CACHE
+
+#ifdef __cplusplus
+}
+#endif // __cplusplus
+
+#endif // DNS_CACHE_H
@@ -17,7 +17,12 @@ LOG_MODULE_REGISTER(wifi_agent);
 #include <zephyr/net/wifi_mgmt.h>
 
 #include "wifi_agent.h"
+#include "wifi_ps_policy.h"
+#include "wifi_select.h"
+#include "bench.h"
 #include "led.h"
+#include "prof.h"
+#include "runtime.h"
 
 // Nubmer of attempts to connect to Wi-Fi and sleep time between attempts
 #define WIFI_NB_TRIES        (5)
@@ -43,18 +48,46 @@ _Static_assert(strlen(CONFIG_WIFI_PASSWORD) >= 8
                "Wi-Fi password must be between 8 and 64 characters");
 #endif
 
-#define WIFI_AGENT_THREAD_STACK_SIZE (1024)
+#ifdef CONFIG_APP_RUNTIME_EVENT_LOOP
+// Wi-Fi agent events
+#define WIFI_EVENT_CONNECT      BIT(0)
+#define WIFI_EVENT_RETRY        BIT(1)
+#define WIFI_EVENT_CONNECTED    BIT(2)
+#define WIFI_EVENT_DISCONNECTED BIT(3)
+#define WIFI_EVENT_FAILED       BIT(4)
+#define WIFI_EVENT_SCANNED      BIT(5)
+#define WIFI_EVENT_SCAN_TIMEOUT BIT(6)
+
+static void prvWifiAgentHandler(struct runtime_agent *agent, uint32_t events);
+static RUNTIME_AGENT_DEFINE(wifi_agent, prvWifiAgentHandler);
+static uint8_t nb_tries_left = 0;
+#else
+// The known networks are written to flash from the system work queue, the
+// deepest calls are the Wi-Fi management requests, as for the event loop
+#define WIFI_AGENT_THREAD_STACK_SIZE (2048)
 #define WIFI_AGENT_THREAD_PRIORITY   (3)
 
 K_SEM_DEFINE(wifi_agent_initialized, 0, 1);
 K_SEM_DEFINE(sem_wifi_agent_connect, 0, 1);
 K_SEM_DEFINE(sem_wifi_agent_connected, 0, 1);
 K_SEM_DEFINE(sem_wifi_agent_disconnected, 0, 1);
+static bool connect_failed = false;
+#ifdef CONFIG_APP_WIFI_MULTI_AP
+K_SEM_DEFINE(sem_wifi_agent_scanned, 0, 1);
+#endif // CONFIG_APP_WIFI_MULTI_AP
+#endif // CONFIG_APP_RUNTIME_EVENT_LOOP
 
 #define NET_EVENT_WIFI_MASK \
     (NET_EVENT_WIFI_CONNECT_RESULT | NET_EVENT_WIFI_DISCONNECT_RESULT)
 
-static struct net_if                 *wifi_iface  = NULL;
+static struct net_if *wifi_iface = NULL;
+#ifdef CONFIG_APP_WIFI_MULTI_AP
+// Access point of the connection, rank of the next one to try in the last
+// scan, and reconnection requested by the roaming
+static struct wifi_candidate candidate;
+static size_t                next_candidate = 0;
+static bool                  roam_pending   = false;
+#elif defined(CONFIG_WIFI)
 static struct wifi_connect_req_params wifi_config = {
     .ssid        = (const uint8_t *)CONFIG_WIFI_SSID,
     .ssid_length = strlen(CONFIG_WIFI_SSID),
@@ -63,6 +96,7 @@ static struct wifi_connect_req_params wifi_config = {
     .channel     = WIFI_CHANNEL_ANY,
     .security    = WIFI_SECURITY_TYPE_PSK,
 };
+#endif // CONFIG_APP_WIFI_MULTI_AP
 
 // Wi-Fi agent state machine enumeration
 enum wifi_agent_state
@@ -72,8 +106,61 @@ enum wifi_agent_state
     WIFI_AGENT_STATE_CONNECTED
 };
 static enum wifi_agent_state current_state = WIFI_AGENT_STATE_IDLE;
+// Set once DHCP gave the interface an address, after the link is up
+static bool ipv4_acquired = false;
+// Profiling phase interrupted by the connection, e.g. a download that roams
+static enum prof_phase resumed_phase = PROF_PHASE_IDLE;
 
 static struct net_mgmt_event_callback cb;
+static struct net_mgmt_event_callback ipv4_cb;
+
+static void
+prvSignalConnected (void)
+{
+#ifdef CONFIG_APP_RUNTIME_EVENT_LOOP
+    runtime_post(&wifi_agent, WIFI_EVENT_CONNECTED);
+#else
+    k_sem_give(&sem_wifi_agent_connected);
+#endif // CONFIG_APP_RUNTIME_EVENT_LOOP
+}
+
+#if defined(CONFIG_WIFI) || defined(CONFIG_APP_WIFI_MULTI_AP)
+static void
+prvSignalConnectFailed (void)
+{
+#ifdef CONFIG_APP_RUNTIME_EVENT_LOOP
+    runtime_post(&wifi_agent, WIFI_EVENT_FAILED);
+#else
+    connect_failed = true;
+    k_sem_give(&sem_wifi_agent_connected);
+#endif // CONFIG_APP_RUNTIME_EVENT_LOOP
+}
+#endif // CONFIG_WIFI || CONFIG_APP_WIFI_MULTI_AP
+
+static void
+prvSignalDisconnected (void)
+{
+#ifdef CONFIG_APP_RUNTIME_EVENT_LOOP
+    runtime_post(&wifi_agent, WIFI_EVENT_DISCONNECTED);
+#else
+    k_sem_give(&sem_wifi_agent_disconnected);
+#endif // CONFIG_APP_RUNTIME_EVENT_LOOP
+}
+
+#ifdef CONFIG_WIFI
+/**
+ * @brief Gets the SSID of the network being joined
+ */
+static const char *
+prvNetworkName (void)
+{
+#ifdef CONFIG_APP_WIFI_MULTI_AP
+    return candidate.cred.ssid;
+#else
+    return CONFIG_WIFI_SSID;
+#endif // CONFIG_APP_WIFI_MULTI_AP
+}
+
 static void
 prvWifiEventHandler (struct net_mgmt_event_callback *cb,
                      uint64_t                        mgmt_event,
@@ -82,13 +169,25 @@ prvWifiEventHandler (struct net_mgmt_event_callback *cb,
     switch (mgmt_event)
     {
         case NET_EVENT_WIFI_CONNECT_RESULT:
-            k_sem_give(&sem_wifi_agent_connected);
-            LOG_INF("Wi-Fi connected to %s", CONFIG_WIFI_SSID);
+        {
+            const struct wifi_status *status = cb->info;
+            if ((NULL != status) && (0 != status->status))
+            {
+                LOG_WRN("Wi-Fi connection to %s failed (%d)",
+                        prvNetworkName(),
+                        status->status);
+                prvSignalConnectFailed();
+                break;
+            }
+            bench_mark(BENCH_EVENT_LINK_UP);
+            prvSignalConnected();
+            LOG_INF("Wi-Fi connected to %s", prvNetworkName());
             break;
+        }
 
         case NET_EVENT_WIFI_DISCONNECT_RESULT:
-            k_sem_give(&sem_wifi_agent_disconnected);
-            LOG_INF("Wi-Fi disconnected from %s", CONFIG_WIFI_SSID);
+            prvSignalDisconnected();
+            LOG_INF("Wi-Fi disconnected from %s", prvNetworkName());
             break;
 
         default:
@@ -96,15 +195,83 @@ prvWifiEventHandler (struct net_mgmt_event_callback *cb,
             break;
     }
 }
+#endif // CONFIG_WIFI
+
+static void
+prvIpv4EventHandler (struct net_mgmt_event_callback *cb,
+                     uint64_t                        mgmt_event,
+                     struct net_if                  *iface)
+{
+    bench_mark(BENCH_EVENT_IP_ACQUIRED);
+    ipv4_acquired = true;
+    LOG_INF("IPv4 address acquired");
+}
+
+/**
+ * @brief Starts the services of the link, once connected
+ */
+static void
+prvLinkUp (void)
+{
+    prof_phase_set(resumed_phase);
+#ifdef CONFIG_APP_WIFI_MULTI_AP
+    wifi_cred_store_report_connection(candidate.cred.ssid, true);
+    wifi_select_set_current(wifi_iface, &candidate);
+#endif // CONFIG_APP_WIFI_MULTI_AP
+#ifdef CONFIG_APP_WIFI_PS_POLICY
+    wifi_ps_policy_start(wifi_iface);
+#endif // CONFIG_APP_WIFI_PS_POLICY
+}
+
+/**
+ * @brief Stops the services of the link, once disconnected
+ */
+static void
+prvLinkDown (void)
+{
+    ipv4_acquired = false;
+#ifdef CONFIG_APP_WIFI_PS_POLICY
+    wifi_ps_policy_stop();
+#endif // CONFIG_APP_WIFI_PS_POLICY
+#ifdef CONFIG_APP_WIFI_MULTI_AP
+    wifi_select_set_current(NULL, NULL);
+#endif // CONFIG_APP_WIFI_MULTI_AP
+}
+
+/**
+ * @brief Records a failed connection, the next try uses the next candidate
+ */
+static void
+prvConnectFailed (void)
+{
+#ifdef CONFIG_APP_WIFI_MULTI_AP
+    wifi_cred_store_report_connection(candidate.cred.ssid, false);
+#endif // CONFIG_APP_WIFI_MULTI_AP
+}
 
 void
 wifi_agent_init (void)
 {
+#ifdef CONFIG_APP_WIFI_MULTI_AP
+    if (!wifi_select_init())
+    {
+        LOG_ERR("No Wi-Fi network known");
+    }
+#endif // CONFIG_APP_WIFI_MULTI_AP
+#ifdef CONFIG_WIFI
     net_mgmt_init_event_callback(&cb, prvWifiEventHandler, NET_EVENT_WIFI_MASK);
     net_mgmt_add_event_callback(&cb);
+#endif // CONFIG_WIFI
+    net_mgmt_init_event_callback(
+        &ipv4_cb, prvIpv4EventHandler, NET_EVENT_IPV4_ADDR_ADD);
+    net_mgmt_add_event_callback(&ipv4_cb);
 
     LOG_INF("Wi-Fi agent initialized");
+#ifdef CONFIG_APP_RUNTIME_EVENT_LOOP
+    runtime_agent_init(&wifi_agent);
+#else
     k_sem_give(&wifi_agent_initialized);
+#endif // CONFIG_APP_RUNTIME_EVENT_LOOP
 }
 
 bool
@@ -116,13 +283,26 @@ wifi_agent_connect (void)
         return true;
     }
 
+    // The OTA agent requests the connection again every 2 seconds until it
+    // is up, and the health check requests it too, these requests wait for
+    // the connection in progress instead of failing
+    if (WIFI_AGENT_STATE_CONNECTING == current_state)
+    {
+        LOG_INF("Wi-Fi agent is already connecting");
+        return true;
+    }
+
     if (WIFI_AGENT_STATE_IDLE != current_state)
     {
         LOG_WRN("Wi-Fi agent is not idle, cannot connect");
         return false;
     }
 
+#ifdef CONFIG_APP_RUNTIME_EVENT_LOOP
+    runtime_post(&wifi_agent, WIFI_EVENT_CONNECT);
+#else
     k_sem_give(&sem_wifi_agent_connect);
+#endif // CONFIG_APP_RUNTIME_EVENT_LOOP
     return true;
 }
 
@@ -136,14 +316,38 @@ wifi_agent_disconnect (void)
     }
 
     ui_led_set(UI_LED_COLOR_RED);
+#ifdef CONFIG_WIFI
     if (net_mgmt(NET_REQUEST_WIFI_DISCONNECT, wifi_iface, NULL, 0))
     {
         LOG_ERR("Failed to initiate Wi-Fi disconnection");
         return false;
     }
+#else
+    prvSignalDisconnected();
+#endif // CONFIG_WIFI
+
+    return true;
+}
+
+#ifdef CONFIG_APP_WIFI_MULTI_AP
+bool
+wifi_agent_roam (void)
+{
+    if (WIFI_AGENT_STATE_CONNECTED != current_state)
+    {
+        return false;
+    }
 
+    // The disconnection is followed by a connection without scanning again
+    roam_pending = true;
+    if (!wifi_agent_disconnect())
+    {
+        roam_pending = false;
+        return false;
+    }
     return true;
 }
+#endif // CONFIG_APP_WIFI_MULTI_AP
 
 bool
 wifi_agent_is_connected (size_t delay_ms)
@@ -151,13 +355,102 @@ wifi_agent_is_connected (size_t delay_ms)
     while (delay_ms > 0 && WIFI_AGENT_STATE_CONNECTED != current_state)
     {
         k_msleep(100);
-        delay_ms -= 100;
+        delay_ms -= MIN(delay_ms, 100);
     }
     return (WIFI_AGENT_STATE_CONNECTED == current_state) ? true : false;
 }
 
+bool
+wifi_agent_has_address (size_t delay_ms)
+{
+    while (delay_ms > 0
+           && (WIFI_AGENT_STATE_CONNECTED != current_state || !ipv4_acquired))
+    {
+        k_msleep(100);
+        delay_ms -= MIN(delay_ms, 100);
+    }
+    return (WIFI_AGENT_STATE_CONNECTED == current_state) && ipv4_acquired;
+}
+
+#ifdef CONFIG_APP_WIFI_MULTI_AP
+static void
+prvScanDone (size_t count)
+{
+    ARG_UNUSED(count);
+
+#ifdef CONFIG_APP_RUNTIME_EVENT_LOOP
+    runtime_post(&wifi_agent, WIFI_EVENT_SCANNED);
+#else
+    k_sem_give(&sem_wifi_agent_scanned);
+#endif // CONFIG_APP_RUNTIME_EVENT_LOOP
+}
+
+/**
+ * @brief Ranks the access points before connecting, except after a roam that
+ * already did
+ * @return true if a scan was started, false otherwise
+ */
 static bool
-prvWifiConnect (void)
+prvWifiScan (void)
+{
+    next_candidate = 0;
+    if (roam_pending)
+    {
+        roam_pending = false;
+        return false;
+    }
+
+#ifdef CONFIG_WIFI
+    struct net_if *iface = net_if_get_wifi_sta();
+#else
+    struct net_if *iface = net_if_get_default();
+#endif // CONFIG_WIFI
+    wifi_select_scan(iface, prvScanDone);
+    return true;
+}
+
+/**
+ * @brief Fills the connection parameters with the next candidate of the last
+ * scan, back to the best one after the last
+ * @return true if a candidate was found, false otherwise
+ */
+static bool
+prvNextCandidate (struct wifi_connect_req_params *params)
+{
+    if (!wifi_select_get(next_candidate, &candidate))
+    {
+        next_candidate = 0;
+        if (!wifi_select_get(next_candidate, &candidate))
+        {
+            LOG_ERR("No Wi-Fi network to connect to");
+            return false;
+        }
+    }
+    next_candidate++;
+
+    memset(params, 0, sizeof(*params));
+    params->ssid        = (const uint8_t *)candidate.cred.ssid;
+    params->ssid_length = strlen(candidate.cred.ssid);
+    params->psk         = (const uint8_t *)candidate.cred.psk;
+    params->psk_length  = strlen(candidate.cred.psk);
+    params->band        = WIFI_FREQ_BAND_UNKNOWN;
+    params->channel     = candidate.channel;
+    params->security    = candidate.security;
+    // Pin the access point of the scan, zero lets the driver pick one. The
+    // ESP32 driver ignores it and picks an access point of the network
+    memcpy(params->bssid, candidate.bssid, sizeof(params->bssid));
+
+    LOG_INF("Connecting to %s at %d dBm (score %d)",
+            candidate.cred.ssid,
+            candidate.rssi,
+            candidate.score);
+    return true;
+}
+#endif // CONFIG_APP_WIFI_MULTI_AP
+
+#ifdef CONFIG_WIFI
+static bool
+prvWifiConnectRequest (void)
 {
     wifi_iface = net_if_get_wifi_sta();
     if (NULL == wifi_iface)
@@ -166,38 +459,83 @@ prvWifiConnect (void)
         return false;
     }
 
-    uint8_t nb_tries = WIFI_NB_TRIES;
-    while (nb_tries-- > 0)
+#ifdef CONFIG_APP_WIFI_MULTI_AP
+    struct wifi_connect_req_params wifi_config;
+    if (!prvNextCandidate(&wifi_config))
     {
-        if (net_mgmt(NET_REQUEST_WIFI_CONNECT,
-                     wifi_iface,
-                     &wifi_config,
-                     sizeof(struct wifi_connect_req_params)))
-        {
-            LOG_ERR("Connect request failed. Retrying...");
-            k_msleep(WIFI_SLEEP_BTW_TRIES);
-        }
-        else
-        {
-            break;
-        }
+        return false;
+    }
+#endif // CONFIG_APP_WIFI_MULTI_AP
+
+    if (net_mgmt(NET_REQUEST_WIFI_CONNECT,
+                 wifi_iface,
+                 &wifi_config,
+                 sizeof(struct wifi_connect_req_params)))
+    {
+        LOG_ERR("Connect request failed");
+        return false;
     }
 
     net_dhcpv4_start(wifi_iface);
+    return true;
+}
+#else
+static bool
+prvWifiConnectRequest (void)
+{
+    // Without Wi-Fi (e.g. native_sim) the default interface is the link and
+    // it is configured by the board, report it as connected right away
+    wifi_iface = net_if_get_default();
+    if (NULL == wifi_iface)
+    {
+        LOG_ERR("Failed to get network interface");
+        return false;
+    }
 
-    return (nb_tries > 0) ? true : false;
+#ifdef CONFIG_APP_WIFI_MULTI_AP
+    // The fake driver emulates the association with the access point
+    struct wifi_connect_req_params params;
+    if (!prvNextCandidate(&params))
+    {
+        return false;
+    }
+    if (0
+        != net_mgmt(
+            NET_REQUEST_WIFI_CONNECT, wifi_iface, &params, sizeof(params)))
+    {
+        LOG_WRN("Wi-Fi connection to %s failed", candidate.cred.ssid);
+        prvSignalConnectFailed();
+        return true;
+    }
+#endif // CONFIG_APP_WIFI_MULTI_AP
+
+    bench_mark(BENCH_EVENT_LINK_UP);
+    bench_mark(BENCH_EVENT_IP_ACQUIRED);
+    ipv4_acquired = true;
+    prvSignalConnected();
+    return true;
 }
+#endif // CONFIG_WIFI
 
 void
 wifi_agent_get_mac_address (char *mac_address)
 {
     assert(NULL != mac_address);
 
-    struct net_if *iface = net_if_get_first_up();
-    assert(NULL != iface);
+    struct net_if       *iface    = net_if_get_first_up();
+    struct net_linkaddr *linkaddr = NULL;
+    if (NULL != iface)
+    {
+        linkaddr = net_if_get_link_addr(iface);
+    }
 
-    struct net_linkaddr *linkaddr = net_if_get_link_addr(iface);
-    assert(NULL != linkaddr);
+    // Offloaded interfaces (e.g. native_sim host sockets) have no link address
+    if ((NULL == linkaddr) || (linkaddr->len < 6))
+    {
+        LOG_WRN("No link address available");
+        strcpy(mac_address, "00:00:00:00:00:00");
+        return;
+    }
 
     snprintf(mac_address,
              18,
@@ -210,6 +548,152 @@ wifi_agent_get_mac_address (char *mac_address)
              linkaddr->addr[5]);
 }
 
+#ifdef CONFIG_APP_RUNTIME_EVENT_LOOP
+static void
+prvWifiAgentHandler (struct runtime_agent *agent, uint32_t events)
+{
+    if ((events & WIFI_EVENT_CONNECT)
+        && (WIFI_AGENT_STATE_IDLE == current_state))
+    {
+        LOG_INF("Attempting to connect to Wi-Fi...");
+        ui_led_set(UI_LED_COLOR_CYAN);
+        resumed_phase = prof_phase_set(PROF_PHASE_CONNECT);
+        current_state = WIFI_AGENT_STATE_CONNECTING;
+        nb_tries_left = WIFI_NB_TRIES;
+#ifdef CONFIG_APP_WIFI_MULTI_AP
+        // Connect once the access points are ranked, or with the access
+        // points seen if the driver does not report the end of the scan
+        if (prvWifiScan())
+        {
+            runtime_post_after(agent,
+                               WIFI_EVENT_SCAN_TIMEOUT,
+                               K_MSEC(WIFI_SELECT_SCAN_TIMEOUT_MS));
+        }
+        else
+        {
+            events |= WIFI_EVENT_RETRY;
+        }
+#else
+        events |= WIFI_EVENT_RETRY;
+#endif // CONFIG_APP_WIFI_MULTI_AP
+    }
+
+#ifdef CONFIG_APP_WIFI_MULTI_AP
+    if ((events & WIFI_EVENT_SCAN_TIMEOUT)
+        && (WIFI_AGENT_STATE_CONNECTING == current_state))
+    {
+        // Posts WIFI_EVENT_SCANNED, nothing is done if the scan just ended
+        LOG_WRN("Scan timed out");
+        wifi_select_scan_done();
+    }
+
+    if ((events & WIFI_EVENT_SCANNED)
+        && (WIFI_AGENT_STATE_CONNECTING == current_state))
+    {
+        runtime_cancel(agent);
+        events |= WIFI_EVENT_RETRY;
+    }
+#endif // CONFIG_APP_WIFI_MULTI_AP
+
+    if ((events & WIFI_EVENT_RETRY)
+        && (WIFI_AGENT_STATE_CONNECTING == current_state))
+    {
+        if (!prvWifiConnectRequest())
+        {
+            events |= WIFI_EVENT_FAILED;
+        }
+    }
+
+    if ((events & WIFI_EVENT_FAILED)
+        && (WIFI_AGENT_STATE_CONNECTING == current_state))
+    {
+        // Retry later instead of sleeping, other agents keep running
+        prvConnectFailed();
+        if (--nb_tries_left > 0)
+        {
+            LOG_ERR("Retrying...");
+            runtime_post_after(
+                agent, WIFI_EVENT_RETRY, K_MSEC(WIFI_SLEEP_BTW_TRIES));
+        }
+        else
+        {
+            LOG_ERR("Failed to connect to Wi-Fi");
+            prof_phase_set(resumed_phase);
+            current_state = WIFI_AGENT_STATE_IDLE;
+        }
+    }
+
+    if ((events & WIFI_EVENT_CONNECTED)
+        && (WIFI_AGENT_STATE_CONNECTING == current_state))
+    {
+        LOG_INF("Wi-Fi connected to the AP");
+        ui_led_set(UI_LED_COLOR_GREEN);
+        current_state = WIFI_AGENT_STATE_CONNECTED;
+        prvLinkUp();
+    }
+
+    if ((events & WIFI_EVENT_DISCONNECTED)
+        && (WIFI_AGENT_STATE_CONNECTED == current_state))
+    {
+        prvLinkDown();
+        current_state = WIFI_AGENT_STATE_IDLE;
+#ifdef CONFIG_APP_WIFI_MULTI_AP
+        if (roam_pending)
+        {
+            runtime_post(agent, WIFI_EVENT_CONNECT);
+        }
+#endif // CONFIG_APP_WIFI_MULTI_AP
+    }
+}
+#else
+/**
+ * @brief Waits for the result of a connection request
+ * @return true if connected, false if the connection failed
+ */
+static bool
+prvWifiWaitConnected (void)
+{
+    k_sem_take(&sem_wifi_agent_connected, K_FOREVER);
+    if (connect_failed)
+    {
+        connect_failed = false;
+        prvConnectFailed();
+        return false;
+    }
+    return true;
+}
+
+static bool
+prvWifiConnect (void)
+{
+#ifdef CONFIG_APP_WIFI_MULTI_AP
+    // Connect once the access points are ranked
+    k_sem_reset(&sem_wifi_agent_scanned);
+    if (prvWifiScan()
+        && (0
+            != k_sem_take(&sem_wifi_agent_scanned,
+                          K_MSEC(WIFI_SELECT_SCAN_TIMEOUT_MS))))
+    {
+        // Ends the scan, a new one can start on the next connection
+        LOG_WRN("Scan timed out");
+        wifi_select_scan_done();
+    }
+#endif // CONFIG_APP_WIFI_MULTI_AP
+
+    uint8_t nb_tries = WIFI_NB_TRIES;
+    while (nb_tries-- > 0)
+    {
+        if (prvWifiConnectRequest() && prvWifiWaitConnected())
+        {
+            return true;
+        }
+        LOG_ERR("Retrying...");
+        k_msleep(WIFI_SLEEP_BTW_TRIES);
+    }
+
+    return false;
+}
+
 static void
 prvWifiAgentThread (void *arg1, void *arg2, void *arg3)
 {
@@ -232,14 +716,15 @@ prvWifiAgentThread (void *arg1, void *arg2, void *arg3)
                 // Attempt to connect to Wi-Fi
                 LOG_INF("Attempting to connect to Wi-Fi...");
                 ui_led_set(UI_LED_COLOR_CYAN);
+                resumed_phase = prof_phase_set(PROF_PHASE_CONNECT);
                 if (!prvWifiConnect())
                 {
                     LOG_ERR("Failed to connect to Wi-Fi");
+                    prof_phase_set(resumed_phase);
                     current_state = WIFI_AGENT_STATE_IDLE;
                     continue;
                 }
 
-                k_sem_take(&sem_wifi_agent_connected, K_FOREVER);
                 current_state = WIFI_AGENT_STATE_CONNECTED;
                 break;
 
@@ -247,9 +732,17 @@ prvWifiAgentThread (void *arg1, void *arg2, void *arg3)
                 // Handle connected state
                 LOG_INF("Wi-Fi connected to the AP");
                 ui_led_set(UI_LED_COLOR_GREEN);
+                prvLinkUp();
 
                 k_sem_take(&sem_wifi_agent_disconnected, K_FOREVER);
+                prvLinkDown();
                 current_state = WIFI_AGENT_STATE_IDLE;
+#ifdef CONFIG_APP_WIFI_MULTI_AP
+                if (roam_pending)
+                {
+                    k_sem_give(&sem_wifi_agent_connect);
+                }
+#endif // CONFIG_APP_WIFI_MULTI_AP
                 break;
 
             default:
@@ -268,3 +761,5 @@ K_THREAD_DEFINE(wifi_agent_thread_id,
                 WIFI_AGENT_THREAD_PRIORITY,
                 0,
                 0);
+
+#endif // CONFIG_APP_RUNTIME_EVENT_LOOP
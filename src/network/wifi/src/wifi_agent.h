@@ -21,8 +21,10 @@ extern "C"
 
     /**
      * @brief Connects to the Wi-Fi network
-     * @return true if the connection was initiated successfully, false
-     * otherwise
+     * Several callers may request the connection, a request made while the
+     * agent is connecting joins the connection in progress
+     * @return true if connected, connecting or if the connection was
+     * initiated successfully, false otherwise
      */
     bool wifi_agent_connect(void);
 
@@ -35,11 +37,29 @@ extern "C"
 
     /**
      * @brief Checks if the Wi-Fi agent is connected to a network
-     * @param delay_ms Delay in milliseconds to wait for connection status
+     * @param delay_ms Delay in milliseconds to wait for connection status,
+     * must be 0 when called from the event loop
      * @return true if connected, false otherwise
      */
     bool wifi_agent_is_connected(size_t delay_ms);
 
+    /**
+     * @brief Checks if the Wi-Fi agent is connected and the interface has an
+     * IPv4 address
+     * @param delay_ms Delay in milliseconds to wait for the address, must be 0
+     * when called from the event loop
+     * @return true if connected with an address, false otherwise
+     */
+    bool wifi_agent_has_address(size_t delay_ms);
+
+#ifdef CONFIG_APP_WIFI_MULTI_AP
+    /**
+     * @brief Reconnects to the best access point of the last scan
+     * @return true if the roam was initiated successfully, false otherwise
+     */
+    bool wifi_agent_roam(void);
+#endif // CONFIG_APP_WIFI_MULTI_AP
+
     /**
      * @brief Gets the MAC address of the Wi-Fi interface
      * @param mac_address Pointer to a buffer where the MAC address will be
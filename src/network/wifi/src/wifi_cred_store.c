@@ -0,0 +1,373 @@
+/**
+ * @file      wifi_cred_store.c
+ * @author    Theodore Bardy
+ *
+ * @note      This file is part of Witekio's Zephyr Demo project
+ * @brief     Wi-Fi networks known by the device
+ */
+
+#include <zephyr/logging/log.h>
+LOG_MODULE_REGISTER(wifi_cred_store);
+
+#include "wifi_cred_store.h"
+
+#ifdef CONFIG_APP_WIFI_MULTI_AP
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <zephyr/kernel.h>
+#include <zephyr/sys/util.h>
+
+#ifdef CONFIG_APP_KV_STORE
+#include "kv_store.h"
+
+// One record per network, "wifi/net/<index>"
+#define WIFI_CRED_KEY_FORMAT "wifi/net/%u"
+#define WIFI_CRED_KEY_SIZE   (16)
+
+BUILD_ASSERT(sizeof(struct wifi_cred) <= CONFIG_APP_KV_MAX_VALUE_LEN,
+             "Wi-Fi networks do not fit in a key-value store record");
+BUILD_ASSERT(CONFIG_APP_WIFI_MAX_NETWORKS <= 32,
+             "Records to save do not fit in a bit mask");
+#endif // CONFIG_APP_KV_STORE
+
+// Weight of the last download in the average throughput, 1 / 2^N
+#define WIFI_CRED_THROUGHPUT_SHIFT (2)
+
+static struct wifi_cred networks[CONFIG_APP_WIFI_MAX_NETWORKS];
+static size_t           network_count;
+#ifdef CONFIG_APP_KV_STORE
+// Records to write, the ones past network_count are deleted
+static uint32_t dirty;
+
+static void prvSaveWork(struct k_work *work);
+static K_WORK_DEFINE(save_work, prvSaveWork);
+#endif // CONFIG_APP_KV_STORE
+
+K_MUTEX_DEFINE(wifi_cred_lock);
+
+static struct wifi_cred *
+prvFind (const char *ssid)
+{
+    for (size_t i = 0; i < network_count; i++)
+    {
+        if (0 == strcmp(networks[i].ssid, ssid))
+        {
+            return &networks[i];
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief Schedules the write of the records from first to last, only the
+ * changed ones are rewritten
+ * @param first Index of the first record to write
+ * @param last Index of the last record to write, the ones past network_count
+ * are deleted
+ */
+static void
+prvSave (size_t first, size_t last)
+{
+#ifdef CONFIG_APP_KV_STORE
+    dirty |= GENMASK(last, first);
+    // Flash writes and compactions need more stack than the Wi-Fi agent has,
+    // and must not delay the connection
+    k_work_submit(&save_work);
+#else
+    ARG_UNUSED(first);
+    ARG_UNUSED(last);
+#endif // CONFIG_APP_KV_STORE
+}
+
+#ifdef CONFIG_APP_KV_STORE
+/**
+ * @brief Writes the changed records to the key-value store, one at a time so
+ * that the networks stay available during the flash operations. The passwords
+ * are kept in clear like the Mender client keeps its key
+ */
+static void
+prvSaveWork (struct k_work *work)
+{
+    ARG_UNUSED(work);
+    char             key[WIFI_CRED_KEY_SIZE];
+    struct wifi_cred cred;
+    uint32_t         written = 0;
+    bool             ret     = true;
+
+    while (ret)
+    {
+        k_mutex_lock(&wifi_cred_lock, K_FOREVER);
+        if (0 == dirty)
+        {
+            k_mutex_unlock(&wifi_cred_lock);
+            break;
+        }
+        size_t index = find_lsb_set(dirty) - 1;
+        bool   found = (index < network_count);
+        if (found)
+        {
+            cred = networks[index];
+        }
+        dirty &= ~BIT(index);
+        written |= BIT(index);
+        k_mutex_unlock(&wifi_cred_lock);
+
+        snprintf(key, sizeof(key), WIFI_CRED_KEY_FORMAT, (unsigned int)index);
+        ret = found ? kv_store_set(key, &cred, sizeof(cred))
+                    : kv_store_delete(key);
+    }
+
+    if ((0 != written) && (!ret || !kv_store_commit()))
+    {
+        // Written again with the next change, or before going to sleep
+        LOG_ERR("Failed to save the Wi-Fi networks");
+        k_mutex_lock(&wifi_cred_lock, K_FOREVER);
+        dirty |= written;
+        k_mutex_unlock(&wifi_cred_lock);
+    }
+}
+#endif // CONFIG_APP_KV_STORE
+
+static void
+prvLoad (void)
+{
+#ifdef CONFIG_APP_KV_STORE
+    char key[WIFI_CRED_KEY_SIZE];
+
+    while (network_count < ARRAY_SIZE(networks))
+    {
+        struct wifi_cred *cred = &networks[network_count];
+
+        snprintf(key,
+                 sizeof(key),
+                 WIFI_CRED_KEY_FORMAT,
+                 (unsigned int)network_count);
+        if (sizeof(*cred) != kv_store_get(key, cred, sizeof(*cred)))
+        {
+            break;
+        }
+        // Terminate the strings of a record written by another build
+        cred->ssid[WIFI_CRED_SSID_MAX_LENGTH] = '\0';
+        cred->psk[WIFI_CRED_PSK_MAX_LENGTH]   = '\0';
+        network_count++;
+    }
+#endif // CONFIG_APP_KV_STORE
+}
+
+/**
+ * @brief Adds a network and schedules the write of its record
+ * @return 1 if the store changed, 0 if the network is unchanged, -errno if the
+ * network cannot be added
+ */
+static int
+prvAdd (const char *ssid, const char *psk, uint8_t priority)
+{
+    size_t ssid_len = strlen(ssid);
+    size_t psk_len  = strlen(psk);
+
+    if ((0 == ssid_len) || (ssid_len > WIFI_CRED_SSID_MAX_LENGTH)
+        || (psk_len < 8) || (psk_len > WIFI_CRED_PSK_MAX_LENGTH))
+    {
+        LOG_ERR("Invalid credentials for '%s'", ssid);
+        return -EINVAL;
+    }
+
+    struct wifi_cred *cred = prvFind(ssid);
+    if (NULL == cred)
+    {
+        if (network_count >= ARRAY_SIZE(networks))
+        {
+            LOG_ERR("No room left for '%s'", ssid);
+            return -ENOMEM;
+        }
+        cred = &networks[network_count++];
+        memset(cred, 0, sizeof(*cred));
+        strcpy(cred->ssid, ssid);
+    }
+    else if ((0 == strcmp(cred->psk, psk)) && (cred->priority == priority))
+    {
+        return 0;
+    }
+
+    // Forget the failures of the previous password
+    strcpy(cred->psk, psk);
+    cred->priority = priority;
+    cred->failures = 0;
+    prvSave(cred - networks, cred - networks);
+    return 1;
+}
+
+/**
+ * @brief Adds the "ssid:password:priority" entries, separated by ';', of
+ * CONFIG_APP_WIFI_EXTRA_NETWORKS
+ */
+static void
+prvAddExtraNetworks (void)
+{
+    char  list[] = CONFIG_APP_WIFI_EXTRA_NETWORKS;
+    char *entry_ctx;
+
+    for (char *entry = strtok_r(list, ";", &entry_ctx); NULL != entry;
+         entry       = strtok_r(NULL, ";", &entry_ctx))
+    {
+        char *field_ctx;
+        char *ssid     = strtok_r(entry, ":", &field_ctx);
+        char *psk      = strtok_r(NULL, ":", &field_ctx);
+        char *priority = strtok_r(NULL, ":", &field_ctx);
+
+        if ((NULL == ssid) || (NULL == psk))
+        {
+            LOG_ERR("Invalid entry in CONFIG_APP_WIFI_EXTRA_NETWORKS");
+            continue;
+        }
+        uint8_t level = (NULL != priority) ? (uint8_t)atoi(priority) : 0;
+        prvAdd(ssid, psk, level);
+    }
+}
+
+bool
+wifi_cred_store_init (void)
+{
+    k_mutex_lock(&wifi_cred_lock, K_FOREVER);
+    prvLoad();
+    LOG_INF("%zu Wi-Fi networks loaded", network_count);
+
+    // The networks of the configuration are always known, an update of the
+    // firmware can change their password or priority
+    struct wifi_cred *seed     = prvFind(CONFIG_WIFI_SSID);
+    uint8_t           priority = (NULL != seed) ? seed->priority : 0;
+    prvAdd(CONFIG_WIFI_SSID, CONFIG_WIFI_PASSWORD, priority);
+    prvAddExtraNetworks();
+
+    bool ret = (network_count > 0);
+    k_mutex_unlock(&wifi_cred_lock);
+    return ret;
+}
+
+bool
+wifi_cred_store_add (const char *ssid, const char *psk, uint8_t priority)
+{
+    k_mutex_lock(&wifi_cred_lock, K_FOREVER);
+    int ret = prvAdd(ssid, psk, priority);
+    k_mutex_unlock(&wifi_cred_lock);
+    return (ret >= 0);
+}
+
+bool
+wifi_cred_store_remove (const char *ssid)
+{
+    bool ret = false;
+
+    k_mutex_lock(&wifi_cred_lock, K_FOREVER);
+    struct wifi_cred *cred = prvFind(ssid);
+    if (NULL != cred)
+    {
+        size_t index = cred - networks;
+        memmove(cred,
+                cred + 1,
+                (network_count - index - 1) * sizeof(networks[0]));
+        // The following records move down, the last one is deleted
+        prvSave(index, network_count - 1);
+        network_count--;
+        ret = true;
+    }
+    k_mutex_unlock(&wifi_cred_lock);
+    return ret;
+}
+
+bool
+wifi_cred_store_get (size_t index, struct wifi_cred *cred)
+{
+    bool ret = false;
+
+    k_mutex_lock(&wifi_cred_lock, K_FOREVER);
+    if (index < network_count)
+    {
+        *cred = networks[index];
+        ret   = true;
+    }
+    k_mutex_unlock(&wifi_cred_lock);
+    return ret;
+}
+
+bool
+wifi_cred_store_find (const char *ssid, struct wifi_cred *cred)
+{
+    k_mutex_lock(&wifi_cred_lock, K_FOREVER);
+    struct wifi_cred *found = prvFind(ssid);
+    if (NULL != found)
+    {
+        *cred = *found;
+    }
+    k_mutex_unlock(&wifi_cred_lock);
+    return (NULL != found);
+}
+
+void
+wifi_cred_store_report_connection (const char *ssid, bool success)
+{
+    k_mutex_lock(&wifi_cred_lock, K_FOREVER);
+    struct wifi_cred *cred = prvFind(ssid);
+    if (NULL != cred)
+    {
+        uint8_t failures = success ? 0 : MIN(cred->failures + 1, UINT8_MAX);
+        if (failures != cred->failures)
+        {
+            cred->failures = failures;
+            prvSave(cred - networks, cred - networks);
+        }
+    }
+    k_mutex_unlock(&wifi_cred_lock);
+}
+
+void
+wifi_cred_store_report_throughput (const char *ssid, uint32_t kibps)
+{
+    kibps = MIN(kibps, UINT16_MAX);
+
+    k_mutex_lock(&wifi_cred_lock, K_FOREVER);
+    struct wifi_cred *cred = prvFind(ssid);
+    if (NULL != cred)
+    {
+        // Moving average, the first download sets it
+        uint32_t average = cred->throughput_kibps;
+        if (0 == average)
+        {
+            average = kibps;
+        }
+        else
+        {
+            average -= (average >> WIFI_CRED_THROUGHPUT_SHIFT);
+            average += (kibps >> WIFI_CRED_THROUGHPUT_SHIFT);
+        }
+        if (average != cred->throughput_kibps)
+        {
+            cred->throughput_kibps = (uint16_t)average;
+            prvSave(cred - networks, cred - networks);
+        }
+    }
+    k_mutex_unlock(&wifi_cred_lock);
+}
+
+void
+wifi_cred_store_flush (void)
+{
+#ifdef CONFIG_APP_KV_STORE
+    struct k_work_sync sync;
+
+    // Also retries the records that failed to be written
+    k_mutex_lock(&wifi_cred_lock, K_FOREVER);
+    bool pending = (0 != dirty);
+    k_mutex_unlock(&wifi_cred_lock);
+    if (pending)
+    {
+        k_work_submit(&save_work);
+    }
+    k_work_flush(&save_work, &sync);
+#endif // CONFIG_APP_KV_STORE
+}
+
+#endif // CONFIG_APP_WIFI_MULTI_AP
@@ -0,0 +1,101 @@
+/**
+ * @file      wifi_cred_store.h
+ * @author    Theodore Bardy
+ *
+ * @note      This file is part of Witekio's Zephyr Demo project
+ * @brief     Wi-Fi networks known by the device
+ */
+
+#ifndef WIFI_CRED_STORE_H
+#define WIFI_CRED_STORE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define WIFI_CRED_SSID_MAX_LENGTH (32)
+#define WIFI_CRED_PSK_MAX_LENGTH  (64)
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif // __cplusplus
+
+    /**
+     * @brief Known network, with its connection history
+     */
+    struct wifi_cred
+    {
+        char     ssid[WIFI_CRED_SSID_MAX_LENGTH + 1];
+        char     psk[WIFI_CRED_PSK_MAX_LENGTH + 1];
+        uint8_t  priority;         // Higher is preferred
+        uint8_t  failures;         // Consecutive failed connections
+        uint16_t throughput_kibps; // Average download throughput, 0 if unknown
+    };
+
+    /**
+     * @brief Loads the known networks and adds the ones of the configuration
+     * (CONFIG_WIFI_SSID and CONFIG_APP_WIFI_EXTRA_NETWORKS)
+     * @return true if at least one network is known, false otherwise
+     */
+    bool wifi_cred_store_init(void);
+
+    /**
+     * @brief Adds a network, or updates its password and priority
+     * @param ssid SSID, 1 to 32 characters
+     * @param psk Password, 8 to 64 characters
+     * @param priority Priority, higher is preferred
+     * @return true if the network was saved, false otherwise
+     */
+    bool wifi_cred_store_add(const char *ssid,
+                             const char *psk,
+                             uint8_t     priority);
+
+    /**
+     * @brief Forgets a network
+     * @param ssid SSID
+     * @return true if the network was removed, false otherwise
+     */
+    bool wifi_cred_store_remove(const char *ssid);
+
+    /**
+     * @brief Gets a known network
+     * @param index Index of the network
+     * @param cred Network
+     * @return true if the network exists, false past the last one
+     */
+    bool wifi_cred_store_get(size_t index, struct wifi_cred *cred);
+
+    /**
+     * @brief Gets a known network by SSID
+     * @param ssid SSID
+     * @param cred Network
+     * @return true if the network is known, false otherwise
+     */
+    bool wifi_cred_store_find(const char *ssid, struct wifi_cred *cred);
+
+    /**
+     * @brief Records the outcome of a connection to a network
+     * @param ssid SSID
+     * @param success true if the connection succeeded
+     */
+    void wifi_cred_store_report_connection(const char *ssid, bool success);
+
+    /**
+     * @brief Records the throughput of a download over a network
+     * @param ssid SSID
+     * @param kibps Throughput in KiB/s
+     */
+    void wifi_cred_store_report_throughput(const char *ssid, uint32_t kibps);
+
+    /**
+     * @brief Waits for the changes to be written to the key-value store, e.g.
+     * before going to sleep
+     */
+    void wifi_cred_store_flush(void);
+
+#ifdef __cplusplus
+}
+#endif // __cplusplus
+
+#endif // WIFI_CRED_STORE_H
@@ -0,0 +1,282 @@
+/**
+ * @file      wifi_fake_driver.c
+ * @author    Theodore Bardy
+ *
+ * @note      This file is part of Witekio's Zephyr Demo project
+ * @brief     Fake Wi-Fi management driver for boards without Wi-Fi
+ */
+
+#include <zephyr/logging/log.h>
+LOG_MODULE_REGISTER(wifi_fake_driver);
+
+#ifdef CONFIG_APP_WIFI_FAKE_DRIVER
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <zephyr/kernel.h>
+#include <zephyr/net/net_mgmt.h>
+#include <zephyr/net/wifi_mgmt.h>
+
+#include "wifi_select.h"
+
+/*
+ * Handles NET_REQUEST_WIFI_PS when the Wi-Fi stack is not built (e.g. on
+ * native_sim), so that the power save policy runs unmodified: the requested
+ * configuration is only kept and logged.
+ */
+static enum wifi_ps             enabled         = WIFI_PS_DISABLED;
+static enum wifi_ps_wakeup_mode wakeup_mode     = WIFI_PS_WAKEUP_MODE_DTIM;
+static unsigned short           listen_interval = 0;
+
+static int
+prvFakePowerSave (uint64_t       mgmt_request,
+                  struct net_if *iface,
+                  void          *data,
+                  size_t         len)
+{
+    ARG_UNUSED(mgmt_request);
+    ARG_UNUSED(iface);
+    struct wifi_ps_params *params = data;
+
+    if ((NULL == params) || (sizeof(*params) != len))
+    {
+        return -EINVAL;
+    }
+    if (IS_ENABLED(CONFIG_APP_WIFI_FAKE_PS_STATE_ONLY)
+        && (WIFI_PS_PARAM_STATE != params->type))
+    {
+        params->fail_reason = WIFI_PS_PARAM_FAIL_OPERATION_NOT_SUPPORTED;
+        return -ENOTSUP;
+    }
+
+    switch (params->type)
+    {
+        case WIFI_PS_PARAM_STATE:
+            enabled = params->enabled;
+            break;
+
+        case WIFI_PS_PARAM_WAKEUP_MODE:
+            wakeup_mode = params->wakeup_mode;
+            break;
+
+        case WIFI_PS_PARAM_LISTEN_INTERVAL:
+            listen_interval = params->listen_interval;
+            break;
+
+        default:
+            params->fail_reason = WIFI_PS_PARAM_FAIL_OPERATION_NOT_SUPPORTED;
+            return -ENOTSUP;
+    }
+
+    LOG_INF("Power save %s, wake-up every %s (listen interval %u)",
+            (WIFI_PS_ENABLED == enabled) ? "on" : "off",
+            (WIFI_PS_WAKEUP_MODE_DTIM == wakeup_mode) ? "DTIM"
+                                                      : "listen interval",
+            listen_interval);
+    return 0;
+}
+NET_MGMT_REGISTER_REQUEST_HANDLER(NET_REQUEST_WIFI_PS, prvFakePowerSave);
+
+#ifdef CONFIG_APP_WIFI_MULTI_AP
+/*
+ * Handles the scan, connection and status requests with the access points of
+ * CONFIG_APP_WIFI_FAKE_SCAN_RESULTS, so that the selection and the roaming
+ * run on native_sim. The signal of the access point the device is associated
+ * with drops by CONFIG_APP_WIFI_FAKE_RSSI_DECAY_DB_PER_S to trigger a roam.
+ */
+#define FAKE_MAX_APS          (WIFI_SELECT_MAX_CANDIDATES)
+#define FAKE_SCAN_DURATION_MS (100)
+// Signal reported without access point configured
+#define FAKE_DEFAULT_RSSI (-50)
+
+struct fake_ap
+{
+    char    ssid[WIFI_SSID_MAX_LEN + 1];
+    uint8_t bssid[WIFI_MAC_ADDR_LEN];
+    uint8_t channel;
+    int     rssi;
+};
+
+static struct fake_ap aps[FAKE_MAX_APS];
+static size_t         ap_count;
+// Associated access point, -1 if none, and time of the association
+static int     associated = -1;
+static int64_t associated_ms;
+
+static void prvFakeScanWork(struct k_work *work);
+static K_WORK_DELAYABLE_DEFINE(fake_scan_work, prvFakeScanWork);
+
+/**
+ * @brief Parses the "ssid:rssi" entries, separated by ',', of
+ * CONFIG_APP_WIFI_FAKE_SCAN_RESULTS
+ */
+static int
+prvFakeInit (void)
+{
+    static const uint8_t channels[] = { 1, 6, 11 };
+    char                 list[]     = CONFIG_APP_WIFI_FAKE_SCAN_RESULTS;
+    char                *entry_ctx;
+
+    for (char *entry = strtok_r(list, ",", &entry_ctx);
+         (NULL != entry) && (ap_count < ARRAY_SIZE(aps));
+         entry = strtok_r(NULL, ",", &entry_ctx))
+    {
+        char           *separator = strrchr(entry, ':');
+        struct fake_ap *ap        = &aps[ap_count];
+
+        if ((NULL == separator) || (separator - entry > WIFI_SSID_MAX_LEN))
+        {
+            LOG_ERR("Invalid entry in CONFIG_APP_WIFI_FAKE_SCAN_RESULTS");
+            continue;
+        }
+        *separator = '\0';
+        strcpy(ap->ssid, entry);
+        ap->rssi     = atoi(separator + 1);
+        ap->bssid[0] = 0x02; // Locally administered
+        ap->bssid[5] = (uint8_t)(ap_count + 1);
+        ap->channel  = channels[ap_count % ARRAY_SIZE(channels)];
+        ap_count++;
+    }
+    return 0;
+}
+SYS_INIT(prvFakeInit, APPLICATION, 0);
+
+static int
+prvRssi (size_t index)
+{
+    int rssi = aps[index].rssi;
+
+    if ((int)index == associated)
+    {
+        rssi -= (int)((k_uptime_get() - associated_ms) / 1000)
+                * CONFIG_APP_WIFI_FAKE_RSSI_DECAY_DB_PER_S;
+    }
+    return MAX(rssi, WIFI_SELECT_RSSI_UNKNOWN + 1);
+}
+
+/**
+ * @brief Reports the access points straight to the selection, the event
+ * information of a build without Wi-Fi is too small for scan results
+ */
+static void
+prvFakeScanWork (struct k_work *work)
+{
+    ARG_UNUSED(work);
+    struct wifi_scan_result result;
+
+    for (size_t i = 0; i < ap_count; i++)
+    {
+        memset(&result, 0, sizeof(result));
+        result.ssid_length = strlen(aps[i].ssid);
+        memcpy(result.ssid, aps[i].ssid, result.ssid_length);
+        memcpy(result.mac, aps[i].bssid, WIFI_MAC_ADDR_LEN);
+        result.mac_length = WIFI_MAC_ADDR_LEN;
+        result.band       = WIFI_FREQ_BAND_2_4_GHZ;
+        result.channel    = aps[i].channel;
+        result.security   = WIFI_SECURITY_TYPE_PSK;
+        result.rssi       = (int8_t)prvRssi(i);
+        wifi_select_scan_result(&result);
+    }
+    wifi_select_scan_done();
+}
+
+static int
+prvFakeScan (uint64_t       mgmt_request,
+             struct net_if *iface,
+             void          *data,
+             size_t         len)
+{
+    ARG_UNUSED(mgmt_request);
+    ARG_UNUSED(iface);
+    ARG_UNUSED(data);
+    ARG_UNUSED(len);
+
+    k_work_reschedule(&fake_scan_work, K_MSEC(FAKE_SCAN_DURATION_MS));
+    return 0;
+}
+NET_MGMT_REGISTER_REQUEST_HANDLER(NET_REQUEST_WIFI_SCAN, prvFakeScan);
+
+static int
+prvFakeConnect (uint64_t       mgmt_request,
+                struct net_if *iface,
+                void          *data,
+                size_t         len)
+{
+    ARG_UNUSED(mgmt_request);
+    ARG_UNUSED(iface);
+    static const uint8_t           any[WIFI_MAC_ADDR_LEN] = { 0 };
+    struct wifi_connect_req_params *params                 = data;
+
+    if ((NULL == params) || (sizeof(*params) != len))
+    {
+        return -EINVAL;
+    }
+
+    // Any network is joined when no access point is configured
+    associated    = -1;
+    associated_ms = k_uptime_get();
+    if (0 == ap_count)
+    {
+        return 0;
+    }
+
+    bool pinned = (0 != memcmp(params->bssid, any, sizeof(any)));
+    for (size_t i = 0; i < ap_count; i++)
+    {
+        bool match
+            = pinned ? (0 == memcmp(params->bssid, aps[i].bssid, sizeof(any)))
+                     : ((params->ssid_length == strlen(aps[i].ssid))
+                        && (0
+                            == memcmp(params->ssid,
+                                      aps[i].ssid,
+                                      params->ssid_length)));
+        if (match)
+        {
+            associated = (int)i;
+            LOG_INF("Associated with %s (%02x:..:%02x) at %d dBm",
+                    aps[i].ssid,
+                    aps[i].bssid[0],
+                    aps[i].bssid[5],
+                    aps[i].rssi);
+            return 0;
+        }
+    }
+    return -ENOENT;
+}
+NET_MGMT_REGISTER_REQUEST_HANDLER(NET_REQUEST_WIFI_CONNECT, prvFakeConnect);
+
+static int
+prvFakeIfaceStatus (uint64_t       mgmt_request,
+                    struct net_if *iface,
+                    void          *data,
+                    size_t         len)
+{
+    ARG_UNUSED(mgmt_request);
+    ARG_UNUSED(iface);
+    struct wifi_iface_status *status = data;
+
+    if ((NULL == status) || (sizeof(*status) != len))
+    {
+        return -EINVAL;
+    }
+
+    memset(status, 0, sizeof(*status));
+    status->state = WIFI_STATE_COMPLETED;
+    status->rssi  = FAKE_DEFAULT_RSSI;
+    if (associated >= 0)
+    {
+        const struct fake_ap *ap = &aps[associated];
+        status->ssid_len         = strlen(ap->ssid);
+        memcpy(status->ssid, ap->ssid, status->ssid_len);
+        memcpy(status->bssid, ap->bssid, WIFI_MAC_ADDR_LEN);
+        status->channel = ap->channel;
+        status->rssi    = prvRssi(associated);
+    }
+    return 0;
+}
+NET_MGMT_REGISTER_REQUEST_HANDLER(NET_REQUEST_WIFI_IFACE_STATUS,
+                                  prvFakeIfaceStatus);
+#endif // CONFIG_APP_WIFI_MULTI_AP
+
+#endif // CONFIG_APP_WIFI_FAKE_DRIVER
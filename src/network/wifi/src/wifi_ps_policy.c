@@ -0,0 +1,279 @@
+/**
+ * @file      wifi_ps_policy.c
+ * @author    Theodore Bardy
+ *
+ * @note      This file is part of Witekio's Zephyr Demo project
+ * @brief     Wi-Fi power save policy driven by the network activity
+ */
+
+#include <zephyr/logging/log.h>
+LOG_MODULE_REGISTER(wifi_ps_policy);
+
+#include "wifi_ps_policy.h"
+
+#ifdef CONFIG_APP_WIFI_PS_POLICY
+
+#include <zephyr/kernel.h>
+#include <zephyr/net/net_if.h>
+#include <zephyr/net/wifi_mgmt.h>
+
+// Names printed in the log, keep in sync with wifi_ps_level
+static const char *const level_names[WIFI_PS_LEVEL_COUNT] = {
+    "deep",
+    "balanced",
+    "performance",
+};
+
+static struct net_if       *ps_iface = NULL;
+static uint32_t             activities;
+// WIFI_PS_LEVEL_COUNT until a level is applied after the connection. The
+// level requested by the policy and the one in effect differ when the driver
+// rejects the wake-up parameters of the requested one
+static enum wifi_ps_level   requested = WIFI_PS_LEVEL_COUNT;
+static enum wifi_ps_level   applied   = WIFI_PS_LEVEL_COUNT;
+static int64_t              applied_since_ms;
+static struct wifi_ps_stats stats;
+
+K_MUTEX_DEFINE(wifi_ps_lock);
+
+static void prvLowerWork(struct k_work *work);
+static K_WORK_DELAYABLE_DEFINE(lower_work, prvLowerWork);
+
+/**
+ * @brief Adds the time spent in the applied level up to now
+ */
+static void
+prvAccount (void)
+{
+    int64_t now = k_uptime_get();
+
+    if (applied < WIFI_PS_LEVEL_COUNT)
+    {
+        stats.time_ms[applied] += (uint32_t)(now - applied_since_ms);
+    }
+    applied_since_ms = now;
+}
+
+static bool
+prvRequest (enum wifi_ps_param_type type, struct wifi_ps_params *params)
+{
+    params->type = type;
+    if (0 != net_mgmt(NET_REQUEST_WIFI_PS, ps_iface, params, sizeof(*params)))
+    {
+        LOG_DBG("Power save parameter %d rejected (%d)",
+                type,
+                params->fail_reason);
+        return false;
+    }
+    return true;
+}
+
+/**
+ * @brief Configures the driver for a level. Not all drivers support the
+ * wake-up parameters (the ESP32 one only supports the power save state):
+ * without them, power save wakes up every DTIM whatever the level
+ * @return Level in effect, WIFI_PS_LEVEL_COUNT if the power save state was
+ * rejected
+ */
+static enum wifi_ps_level
+prvApply (enum wifi_ps_level level)
+{
+    struct wifi_ps_params params   = { 0 };
+    bool                  complete = true;
+
+    switch (level)
+    {
+        case WIFI_PS_LEVEL_DEEP:
+            params.listen_interval = CONFIG_APP_WIFI_PS_LISTEN_INTERVAL;
+            params.wakeup_mode     = WIFI_PS_WAKEUP_MODE_LISTEN_INTERVAL;
+            complete = prvRequest(WIFI_PS_PARAM_LISTEN_INTERVAL, &params)
+                       && prvRequest(WIFI_PS_PARAM_WAKEUP_MODE, &params);
+            break;
+
+        case WIFI_PS_LEVEL_BALANCED:
+            params.wakeup_mode = WIFI_PS_WAKEUP_MODE_DTIM;
+            complete = prvRequest(WIFI_PS_PARAM_WAKEUP_MODE, &params);
+            break;
+
+        case WIFI_PS_LEVEL_PERFORMANCE:
+            break;
+
+        default:
+            return WIFI_PS_LEVEL_COUNT;
+    }
+
+    params.enabled = (WIFI_PS_LEVEL_PERFORMANCE == level) ? WIFI_PS_DISABLED
+                                                          : WIFI_PS_ENABLED;
+    if (!prvRequest(WIFI_PS_PARAM_STATE, &params))
+    {
+        return WIFI_PS_LEVEL_COUNT;
+    }
+    if (!complete)
+    {
+        stats.partial++;
+        return WIFI_PS_LEVEL_BALANCED;
+    }
+    return level;
+}
+
+/**
+ * @brief Applies the level selected for the ongoing activities, at once if it
+ * is higher than the applied one, otherwise after the idle delay so that the
+ * requests of a poll cycle do not switch the level back and forth
+ * @param now Lower the level without waiting
+ */
+static void
+prvUpdate (bool now)
+{
+    if (NULL == ps_iface)
+    {
+        return;
+    }
+
+    enum wifi_ps_level target = wifi_ps_policy_select(activities);
+    if (target == requested)
+    {
+        k_work_cancel_delayable(&lower_work);
+        return;
+    }
+    if (!now && (requested < WIFI_PS_LEVEL_COUNT) && (target < requested))
+    {
+        k_work_reschedule(&lower_work,
+                          K_MSEC(CONFIG_APP_WIFI_PS_IDLE_DELAY_MS));
+        return;
+    }
+
+    k_work_cancel_delayable(&lower_work);
+    prvAccount();
+    enum wifi_ps_level level = prvApply(target);
+    if (WIFI_PS_LEVEL_COUNT == level)
+    {
+        LOG_WRN("Failed to apply the %s power save level",
+                level_names[target]);
+        stats.failures++;
+        return;
+    }
+    if (level != target)
+    {
+        LOG_WRN("Wake-up parameters rejected, %s power save runs as %s",
+                level_names[target],
+                level_names[level]);
+    }
+    LOG_DBG("Power save level: %s", level_names[level]);
+    requested = target;
+    applied   = level;
+    stats.switches++;
+}
+
+static void
+prvLowerWork (struct k_work *work)
+{
+    ARG_UNUSED(work);
+
+    k_mutex_lock(&wifi_ps_lock, K_FOREVER);
+    prvUpdate(true);
+    k_mutex_unlock(&wifi_ps_lock);
+}
+
+enum wifi_ps_level
+wifi_ps_policy_select (uint32_t ongoing)
+{
+    // Full speed while downloading, the transfer time dominates
+    if (0 != (ongoing & BIT(WIFI_PS_ACTIVITY_DOWNLOAD)))
+    {
+        return WIFI_PS_LEVEL_PERFORMANCE;
+    }
+    // Short requests, keep the latency of each round trip low
+    if (0 != (ongoing & BIT(WIFI_PS_ACTIVITY_EXCHANGE)))
+    {
+        return WIFI_PS_LEVEL_BALANCED;
+    }
+    // Nothing expected until the next poll
+    return WIFI_PS_LEVEL_DEEP;
+}
+
+void
+wifi_ps_policy_start (struct net_if *iface)
+{
+    k_mutex_lock(&wifi_ps_lock, K_FOREVER);
+    ps_iface         = iface;
+    requested        = WIFI_PS_LEVEL_COUNT;
+    applied          = WIFI_PS_LEVEL_COUNT;
+    applied_since_ms = k_uptime_get();
+    prvUpdate(true);
+    k_mutex_unlock(&wifi_ps_lock);
+}
+
+void
+wifi_ps_policy_stop (void)
+{
+    k_mutex_lock(&wifi_ps_lock, K_FOREVER);
+    k_work_cancel_delayable(&lower_work);
+    prvAccount();
+    ps_iface  = NULL;
+    requested = WIFI_PS_LEVEL_COUNT;
+    applied   = WIFI_PS_LEVEL_COUNT;
+    k_mutex_unlock(&wifi_ps_lock);
+}
+
+void
+wifi_ps_policy_begin (enum wifi_ps_activity activity)
+{
+    k_mutex_lock(&wifi_ps_lock, K_FOREVER);
+    activities |= BIT(activity);
+    prvUpdate(false);
+    k_mutex_unlock(&wifi_ps_lock);
+}
+
+void
+wifi_ps_policy_end (enum wifi_ps_activity activity)
+{
+    k_mutex_lock(&wifi_ps_lock, K_FOREVER);
+    activities &= ~BIT(activity);
+    prvUpdate(false);
+    k_mutex_unlock(&wifi_ps_lock);
+}
+
+enum wifi_ps_level
+wifi_ps_policy_get_level (void)
+{
+    k_mutex_lock(&wifi_ps_lock, K_FOREVER);
+    enum wifi_ps_level level = applied;
+    k_mutex_unlock(&wifi_ps_lock);
+    return level;
+}
+
+void
+wifi_ps_policy_get_stats (struct wifi_ps_stats *out)
+{
+    k_mutex_lock(&wifi_ps_lock, K_FOREVER);
+    prvAccount();
+    *out = stats;
+    k_mutex_unlock(&wifi_ps_lock);
+}
+
+void
+wifi_ps_policy_report (void)
+{
+    struct wifi_ps_stats current;
+
+    wifi_ps_policy_get_stats(&current);
+    LOG_INF("Wi-Fi power save: performance %u ms, balanced %u ms, deep %u "
+            "ms, %u switches, %u partial, %u failures",
+            current.time_ms[WIFI_PS_LEVEL_PERFORMANCE],
+            current.time_ms[WIFI_PS_LEVEL_BALANCED],
+            current.time_ms[WIFI_PS_LEVEL_DEEP],
+            current.switches,
+            current.partial,
+            current.failures);
+
+#ifdef CONFIG_APP_BENCHMARK
+    // Fixed format, parsed by scripts/ota_benchmark.py
+    for (size_t i = 0; i < WIFI_PS_LEVEL_COUNT; i++)
+    {
+        LOG_INF("BENCH ps_%s_ms %u", level_names[i], current.time_ms[i]);
+    }
+#endif // CONFIG_APP_BENCHMARK
+}
+
+#endif // CONFIG_APP_WIFI_PS_POLICY
@@ -0,0 +1,125 @@
+/**
+ * @file      wifi_ps_policy.h
+ * @author    Theodore Bardy
+ *
+ * @note      This file is part of Witekio's Zephyr Demo project
+ * @brief     Wi-Fi power save policy driven by the network activity
+ */
+
+#ifndef WIFI_PS_POLICY_H
+#define WIFI_PS_POLICY_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif // __cplusplus
+
+    struct net_if;
+
+    /**
+     * @brief Network activities, the policy follows the most demanding one
+     */
+    enum wifi_ps_activity
+    {
+        WIFI_PS_ACTIVITY_EXCHANGE, // Requests to the Mender server
+        WIFI_PS_ACTIVITY_DOWNLOAD, // Artifact download
+        WIFI_PS_ACTIVITY_COUNT
+    };
+
+    /**
+     * @brief Power save levels, from the lowest current to the lowest latency
+     */
+    enum wifi_ps_level
+    {
+        WIFI_PS_LEVEL_DEEP,        // Wake up every listen interval
+        WIFI_PS_LEVEL_BALANCED,    // Wake up every DTIM
+        WIFI_PS_LEVEL_PERFORMANCE, // Power save disabled
+        WIFI_PS_LEVEL_COUNT
+    };
+
+    /**
+     * @brief Time spent in each level in effect while connected
+     */
+    struct wifi_ps_stats
+    {
+        uint32_t time_ms[WIFI_PS_LEVEL_COUNT];
+        uint32_t switches; // Levels applied
+        uint32_t partial;  // Levels applied without their wake-up parameters
+        uint32_t failures; // Levels rejected by the driver
+    };
+
+#ifdef CONFIG_APP_WIFI_PS_POLICY
+    /**
+     * @brief Selects the level for a set of activities
+     * @param ongoing Bit mask of the ongoing wifi_ps_activity
+     * @return Level to apply
+     */
+    enum wifi_ps_level wifi_ps_policy_select(uint32_t ongoing);
+
+    /**
+     * @brief Starts applying the policy, once the interface is connected
+     * @param iface Wi-Fi interface
+     */
+    void wifi_ps_policy_start(struct net_if *iface);
+
+    /**
+     * @brief Stops applying the policy, once the interface is disconnected
+     */
+    void wifi_ps_policy_stop(void);
+
+    /**
+     * @brief Signals the start of an activity, the level is raised at once
+     * @param activity Activity
+     */
+    void wifi_ps_policy_begin(enum wifi_ps_activity activity);
+
+    /**
+     * @brief Signals the end of an activity, the level is lowered after
+     * CONFIG_APP_WIFI_PS_IDLE_DELAY_MS without activity
+     * @param activity Activity
+     */
+    void wifi_ps_policy_end(enum wifi_ps_activity activity);
+
+    /**
+     * @brief Gets the level in effect, which is lower than the one selected
+     * when the driver rejects its wake-up parameters
+     * @return Level, WIFI_PS_LEVEL_COUNT if none is applied
+     */
+    enum wifi_ps_level wifi_ps_policy_get_level(void);
+
+    /**
+     * @brief Gets the time spent in each level
+     * @param stats Statistics
+     */
+    void wifi_ps_policy_get_stats(struct wifi_ps_stats *stats);
+
+    /**
+     * @brief Logs the time spent in each level
+     */
+    void wifi_ps_policy_report(void);
+#else
+static inline void
+wifi_ps_policy_begin (enum wifi_ps_activity activity)
+{
+    (void)activity;
+}
+
+static inline void
+wifi_ps_policy_end (enum wifi_ps_activity activity)
+{
+    (void)activity;
+}
+
+static inline void
+wifi_ps_policy_report (void)
+{
+}
+#endif // CONFIG_APP_WIFI_PS_POLICY
+
+#ifdef __cplusplus
+}
+#endif // __cplusplus
+
+#endif // WIFI_PS_POLICY_H
@@ -0,0 +1,535 @@
+/**
+ * @file      wifi_select.c
+ * @author    Theodore Bardy
+ *
+ * @note      This file is part of Witekio's Zephyr Demo project
+ * @brief     Selection of the access point and roaming
+ */
+
+#include <zephyr/logging/log.h>
+LOG_MODULE_REGISTER(wifi_select);
+
+#include "wifi_select.h"
+
+#ifdef CONFIG_APP_WIFI_MULTI_AP
+
+#include <string.h>
+#include <zephyr/kernel.h>
+#include <zephyr/net/net_mgmt.h>
+#include <zephyr/sys/util.h>
+
+#include "wifi_agent.h"
+
+// Bonus of the average throughput, 1 dB per step up to the maximum
+#define WIFI_SELECT_THROUGHPUT_STEP_KIBPS (16)
+#define WIFI_SELECT_THROUGHPUT_MAX_DB     (10)
+// Penalty of each consecutive failure, up to the maximum count
+#define WIFI_SELECT_FAILURE_PENALTY_DB (10)
+#define WIFI_SELECT_FAILURE_MAX        (3)
+// Time without roaming after a roam, against ping-pong between two APs
+#define WIFI_SELECT_ROAM_COOLDOWN_MS (30000)
+
+// Ranked candidates of the last scan
+static struct wifi_candidate candidates[WIFI_SELECT_MAX_CANDIDATES];
+static size_t                candidate_count;
+// Candidates of the ongoing scan, NULL callback when no scan is ongoing
+static struct wifi_candidate scanned[WIFI_SELECT_MAX_CANDIDATES];
+static size_t                scanned_count;
+static wifi_select_scan_cb_t scan_done;
+static int64_t               scan_started_ms;
+
+// Access point of the connection, NULL interface when disconnected
+static struct net_if        *current_iface = NULL;
+static struct wifi_candidate current;
+static bool                  roam_active;
+static int64_t               last_roam_ms;
+// Roam decided during a transfer, done once the network is released
+static bool roam_deferred;
+
+K_MUTEX_DEFINE(wifi_select_lock);
+
+static void prvRoamCheckWork(struct k_work *work);
+static K_WORK_DELAYABLE_DEFINE(roam_check_work, prvRoamCheckWork);
+static void prvRoamWork(struct k_work *work);
+static K_WORK_DEFINE(roam_work, prvRoamWork);
+
+#ifdef CONFIG_WIFI
+#define NET_EVENT_WIFI_SCAN_MASK \
+    (NET_EVENT_WIFI_SCAN_RESULT | NET_EVENT_WIFI_SCAN_DONE)
+
+static struct net_mgmt_event_callback scan_cb;
+
+static void
+prvScanEventHandler (struct net_mgmt_event_callback *cb,
+                     uint64_t                        mgmt_event,
+                     struct net_if                  *iface)
+{
+    ARG_UNUSED(iface);
+
+    switch (mgmt_event)
+    {
+        case NET_EVENT_WIFI_SCAN_RESULT:
+            wifi_select_scan_result(cb->info);
+            break;
+
+        case NET_EVENT_WIFI_SCAN_DONE:
+            wifi_select_scan_done();
+            break;
+
+        default:
+            break;
+    }
+}
+#endif // CONFIG_WIFI
+
+static bool
+prvIsSeen (const struct wifi_candidate *candidate)
+{
+    return (WIFI_SELECT_RSSI_UNKNOWN != candidate->rssi);
+}
+
+/**
+ * @brief Tells whether a candidate ranks before another, the access points
+ * seen by the scan first
+ */
+static bool
+prvIsBetter (const struct wifi_candidate *a, const struct wifi_candidate *b)
+{
+    if (prvIsSeen(a) != prvIsSeen(b))
+    {
+        return prvIsSeen(a);
+    }
+    if (a->score != b->score)
+    {
+        return (a->score > b->score);
+    }
+    return (a->rssi > b->rssi);
+}
+
+int
+wifi_select_score (const struct wifi_cred *cred, int rssi)
+{
+    int score = rssi + cred->priority * CONFIG_APP_WIFI_PRIORITY_WEIGHT_DB;
+
+    // A network that served downloads well is worth a few dB of signal
+    score += MIN(cred->throughput_kibps / WIFI_SELECT_THROUGHPUT_STEP_KIBPS,
+                 WIFI_SELECT_THROUGHPUT_MAX_DB);
+    score -= MIN(cred->failures, WIFI_SELECT_FAILURE_MAX)
+             * WIFI_SELECT_FAILURE_PENALTY_DB;
+    return score;
+}
+
+void
+wifi_select_rank (struct wifi_candidate *list, size_t count)
+{
+    // Insertion sort, there are a handful of candidates
+    for (size_t i = 1; i < count; i++)
+    {
+        struct wifi_candidate candidate = list[i];
+        size_t                j         = i;
+        while ((j > 0) && prvIsBetter(&candidate, &list[j - 1]))
+        {
+            list[j] = list[j - 1];
+            j--;
+        }
+        list[j] = candidate;
+    }
+}
+
+bool
+wifi_select_should_roam (const struct wifi_candidate *current,
+                         const struct wifi_candidate *best)
+{
+    // Only leave a degraded link, and only for a clearly better access
+    // point: each roam drops the ongoing connections
+    return (current->rssi <= CONFIG_APP_WIFI_ROAM_RSSI_DBM) && prvIsSeen(best)
+           && (best->score
+               >= current->score + CONFIG_APP_WIFI_ROAM_HYSTERESIS_DB);
+}
+
+bool
+wifi_select_init (void)
+{
+#ifdef CONFIG_WIFI
+    net_mgmt_init_event_callback(
+        &scan_cb, prvScanEventHandler, NET_EVENT_WIFI_SCAN_MASK);
+    net_mgmt_add_event_callback(&scan_cb);
+#endif // CONFIG_WIFI
+
+    return wifi_cred_store_init();
+}
+
+void
+wifi_select_scan (struct net_if *iface, wifi_select_scan_cb_t done)
+{
+    k_mutex_lock(&wifi_select_lock, K_FOREVER);
+    bool ongoing = (NULL != scan_done);
+    // A scan already ongoing serves the new request
+    scan_done = done;
+    if (!ongoing)
+    {
+        scanned_count   = 0;
+        scan_started_ms = k_uptime_get();
+    }
+    k_mutex_unlock(&wifi_select_lock);
+    if (ongoing)
+    {
+        return;
+    }
+
+    struct wifi_scan_params params = { 0 };
+    if (0 != net_mgmt(NET_REQUEST_WIFI_SCAN, iface, &params, sizeof(params)))
+    {
+        LOG_WRN("Scan request failed, trying the known networks");
+        wifi_select_scan_done();
+    }
+}
+
+bool
+wifi_select_get (size_t index, struct wifi_candidate *candidate)
+{
+    bool ret = false;
+
+    k_mutex_lock(&wifi_select_lock, K_FOREVER);
+    if (index < candidate_count)
+    {
+        *candidate = candidates[index];
+        ret        = true;
+    }
+    k_mutex_unlock(&wifi_select_lock);
+    return ret;
+}
+
+void
+wifi_select_scan_result (const struct wifi_scan_result *result)
+{
+    struct wifi_cred cred;
+    char             ssid[WIFI_CRED_SSID_MAX_LENGTH + 1];
+    size_t ssid_len = MIN(result->ssid_length, WIFI_CRED_SSID_MAX_LENGTH);
+
+    memcpy(ssid, result->ssid, ssid_len);
+    ssid[ssid_len] = '\0';
+    if (!wifi_cred_store_find(ssid, &cred))
+    {
+        return;
+    }
+
+    k_mutex_lock(&wifi_select_lock, K_FOREVER);
+    if (NULL == scan_done)
+    {
+        goto END;
+    }
+
+    // Keep the strongest access points, once each
+    struct wifi_candidate *slot    = NULL;
+    struct wifi_candidate *weakest = NULL;
+    for (size_t i = 0; i < scanned_count; i++)
+    {
+        if (0 == memcmp(scanned[i].bssid, result->mac, WIFI_MAC_ADDR_LEN))
+        {
+            slot = &scanned[i];
+            break;
+        }
+        if ((NULL == weakest) || (scanned[i].rssi < weakest->rssi))
+        {
+            weakest = &scanned[i];
+        }
+    }
+    if ((NULL == slot) && (scanned_count < ARRAY_SIZE(scanned)))
+    {
+        slot = &scanned[scanned_count++];
+    }
+    else if ((NULL == slot) && (weakest->rssi < result->rssi))
+    {
+        slot = weakest;
+    }
+    if (NULL != slot)
+    {
+        slot->cred = cred;
+        memcpy(slot->bssid, result->mac, WIFI_MAC_ADDR_LEN);
+        slot->channel  = result->channel;
+        slot->security = result->security;
+        slot->rssi     = result->rssi;
+    }
+
+END:
+    k_mutex_unlock(&wifi_select_lock);
+}
+
+static bool
+prvIsScanned (const char *ssid)
+{
+    for (size_t i = 0; i < scanned_count; i++)
+    {
+        if (0 == strcmp(scanned[i].cred.ssid, ssid))
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+void
+wifi_select_scan_done (void)
+{
+    struct wifi_cred cred;
+
+    k_mutex_lock(&wifi_select_lock, K_FOREVER);
+    wifi_select_scan_cb_t done = scan_done;
+    if (NULL == done)
+    {
+        k_mutex_unlock(&wifi_select_lock);
+        return;
+    }
+
+    // Known networks the scan did not see, e.g. hidden ones, as last resort
+    for (size_t i = 0;
+         (scanned_count < ARRAY_SIZE(scanned)) && wifi_cred_store_get(i, &cred);
+         i++)
+    {
+        if (!prvIsScanned(cred.ssid))
+        {
+            struct wifi_candidate *slot = &scanned[scanned_count++];
+            memset(slot, 0, sizeof(*slot));
+            slot->cred     = cred;
+            slot->channel  = WIFI_CHANNEL_ANY;
+            slot->security = WIFI_SECURITY_TYPE_PSK;
+            slot->rssi     = WIFI_SELECT_RSSI_UNKNOWN;
+        }
+    }
+    for (size_t i = 0; i < scanned_count; i++)
+    {
+        scanned[i].score = wifi_select_score(&scanned[i].cred, scanned[i].rssi);
+    }
+    wifi_select_rank(scanned, scanned_count);
+    memcpy(candidates, scanned, scanned_count * sizeof(scanned[0]));
+    candidate_count = scanned_count;
+    scan_done       = NULL;
+
+    if (candidate_count > 0)
+    {
+        LOG_INF("%zu candidates, best %s at %d dBm (score %d)",
+                candidate_count,
+                candidates[0].cred.ssid,
+                candidates[0].rssi,
+                candidates[0].score);
+    }
+    k_mutex_unlock(&wifi_select_lock);
+
+    done(candidate_count);
+}
+
+void
+wifi_select_set_current (struct net_if               *iface,
+                         const struct wifi_candidate *candidate)
+{
+    k_mutex_lock(&wifi_select_lock, K_FOREVER);
+    current_iface = iface;
+    if (NULL != candidate)
+    {
+        current = *candidate;
+    }
+    else
+    {
+        memset(&current, 0, sizeof(current));
+        // The next connection scans again
+        roam_deferred = false;
+    }
+    // Keep monitoring after a reconnection, the download may still be ongoing
+    if (roam_active && (NULL != iface))
+    {
+        k_work_reschedule(&roam_check_work,
+                          K_MSEC(CONFIG_APP_WIFI_ROAM_CHECK_MS));
+    }
+    k_mutex_unlock(&wifi_select_lock);
+}
+
+void
+wifi_select_report_throughput (uint32_t kibps)
+{
+    char ssid[WIFI_CRED_SSID_MAX_LENGTH + 1];
+
+    k_mutex_lock(&wifi_select_lock, K_FOREVER);
+    strcpy(ssid, current.cred.ssid);
+    k_mutex_unlock(&wifi_select_lock);
+
+    if ('\0' != ssid[0])
+    {
+        wifi_cred_store_report_throughput(ssid, kibps);
+    }
+}
+
+void
+wifi_select_roam_begin (void)
+{
+    k_mutex_lock(&wifi_select_lock, K_FOREVER);
+    roam_active = true;
+    if (NULL != current_iface)
+    {
+        k_work_reschedule(&roam_check_work,
+                          K_MSEC(CONFIG_APP_WIFI_ROAM_CHECK_MS));
+    }
+    k_mutex_unlock(&wifi_select_lock);
+}
+
+void
+wifi_select_roam_end (void)
+{
+    k_mutex_lock(&wifi_select_lock, K_FOREVER);
+    roam_active = false;
+    k_work_cancel_delayable(&roam_check_work);
+    k_mutex_unlock(&wifi_select_lock);
+}
+
+void
+wifi_select_release (void)
+{
+    k_mutex_lock(&wifi_select_lock, K_FOREVER);
+    bool roam     = roam_deferred && (NULL != current_iface);
+    roam_deferred = false;
+    k_mutex_unlock(&wifi_select_lock);
+
+    if (roam)
+    {
+        k_work_submit(&roam_work);
+    }
+}
+
+/**
+ * @brief Compares the current access point with the best other one of the
+ * scan started by the degraded link
+ */
+static void
+prvRoamScanDone (size_t count)
+{
+    ARG_UNUSED(count);
+    struct wifi_candidate best;
+    bool                  roam = false;
+
+    k_mutex_lock(&wifi_select_lock, K_FOREVER);
+    if (!roam_active || (NULL == current_iface))
+    {
+        goto END;
+    }
+
+    size_t index = 0;
+    while ((index < candidate_count)
+           && (0
+               == memcmp(candidates[index].bssid,
+                         current.bssid,
+                         WIFI_MAC_ADDR_LEN)))
+    {
+        index++;
+    }
+    if (index < candidate_count)
+    {
+        best = candidates[index];
+        roam = wifi_select_should_roam(&current, &best);
+    }
+
+    if (roam)
+    {
+        // A disconnection would drop the transfer, roam once the network is
+        // released
+        LOG_INF("Roaming from %s (%d dBm, score %d) to %s (%d dBm, score %d) "
+                "after the transfer",
+                current.cred.ssid,
+                current.rssi,
+                current.score,
+                best.cred.ssid,
+                best.rssi,
+                best.score);
+        // The agent reconnects to the first candidate
+        memmove(&candidates[1], &candidates[0], index * sizeof(candidates[0]));
+        candidates[0] = best;
+        last_roam_ms  = k_uptime_get();
+        roam_deferred = true;
+        k_work_cancel_delayable(&roam_check_work);
+    }
+    else
+    {
+        k_work_reschedule(&roam_check_work,
+                          K_MSEC(CONFIG_APP_WIFI_ROAM_CHECK_MS));
+    }
+
+END:
+    k_mutex_unlock(&wifi_select_lock);
+}
+
+/**
+ * @brief Samples the signal of the current access point, and scans for a
+ * better one when it is below CONFIG_APP_WIFI_ROAM_RSSI_DBM, also ends a
+ * scan whose end was not reported
+ */
+static void
+prvRoamCheckWork (struct k_work *work)
+{
+    ARG_UNUSED(work);
+    struct wifi_iface_status status = { 0 };
+
+    k_mutex_lock(&wifi_select_lock, K_FOREVER);
+    struct net_if *iface   = roam_active ? current_iface : NULL;
+    bool           expired = (NULL != scan_done)
+                   && (k_uptime_get() - scan_started_ms
+                       >= WIFI_SELECT_SCAN_TIMEOUT_MS);
+    k_mutex_unlock(&wifi_select_lock);
+    if (expired)
+    {
+        // The scan callback checks the link again
+        LOG_WRN("Scan timed out, ranking the access points seen");
+        wifi_select_scan_done();
+        return;
+    }
+    if (NULL == iface)
+    {
+        return;
+    }
+
+    if (0
+        != net_mgmt(
+            NET_REQUEST_WIFI_IFACE_STATUS, iface, &status, sizeof(status)))
+    {
+        LOG_DBG("Failed to get the link status");
+        k_work_reschedule(&roam_check_work,
+                          K_MSEC(CONFIG_APP_WIFI_ROAM_CHECK_MS));
+        return;
+    }
+
+    k_mutex_lock(&wifi_select_lock, K_FOREVER);
+    current.rssi  = (int8_t)status.rssi;
+    current.score = wifi_select_score(&current.cred, status.rssi);
+    bool cooling  = (0 != last_roam_ms)
+                   && (k_uptime_get() - last_roam_ms
+                       < WIFI_SELECT_ROAM_COOLDOWN_MS);
+    bool degraded = (status.rssi <= CONFIG_APP_WIFI_ROAM_RSSI_DBM) && !cooling;
+    if (!degraded)
+    {
+        k_work_reschedule(&roam_check_work,
+                          K_MSEC(CONFIG_APP_WIFI_ROAM_CHECK_MS));
+    }
+    k_mutex_unlock(&wifi_select_lock);
+
+    if (degraded)
+    {
+        // Checked again if the driver does not report the end of the scan,
+        // the scan callback checks earlier otherwise
+        LOG_INF("Link degraded to %d dBm, scanning", status.rssi);
+        k_work_reschedule(&roam_check_work,
+                          K_MSEC(WIFI_SELECT_SCAN_TIMEOUT_MS));
+        wifi_select_scan(iface, prvRoamScanDone);
+    }
+}
+
+static void
+prvRoamWork (struct k_work *work)
+{
+    ARG_UNUSED(work);
+
+    // Out of the scan callback, the agent requests the disconnection
+    if (!wifi_agent_roam())
+    {
+        LOG_WRN("Roaming aborted");
+    }
+}
+
+#endif // CONFIG_APP_WIFI_MULTI_AP
@@ -0,0 +1,168 @@
+/**
+ * @file      wifi_select.h
+ * @author    Theodore Bardy
+ *
+ * @note      This file is part of Witekio's Zephyr Demo project
+ * @brief     Selection of the access point and roaming
+ */
+
+#ifndef WIFI_SELECT_H
+#define WIFI_SELECT_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <zephyr/net/net_if.h>
+#include <zephyr/net/wifi_mgmt.h>
+
+#include "wifi_cred_store.h"
+
+// Access points kept from a scan
+#define WIFI_SELECT_MAX_CANDIDATES (8)
+// RSSI of the known networks the scan did not see, e.g. hidden ones
+#define WIFI_SELECT_RSSI_UNKNOWN (-100)
+// Maximum duration of a scan, the driver may not report its end
+#define WIFI_SELECT_SCAN_TIMEOUT_MS (10000)
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif // __cplusplus
+
+    /**
+     * @brief Access point of a known network, ranked by score
+     */
+    struct wifi_candidate
+    {
+        struct wifi_cred        cred;
+        uint8_t                 bssid[WIFI_MAC_ADDR_LEN]; // Zero if unseen
+        uint8_t                 channel; // WIFI_CHANNEL_ANY if unseen
+        enum wifi_security_type security;
+        int8_t                  rssi;  // dBm
+        int16_t                 score; // Higher is better
+    };
+
+    /**
+     * @brief Callback invoked at the end of a scan
+     * @param count Number of candidates, best first
+     */
+    typedef void (*wifi_select_scan_cb_t)(size_t count);
+
+#ifdef CONFIG_APP_WIFI_MULTI_AP
+    /**
+     * @brief Initializes the selection and the known networks
+     * @return true if a network is known, false otherwise
+     */
+    bool wifi_select_init(void);
+
+    /**
+     * @brief Scores an access point: its signal, plus the priority and the
+     * average throughput of its network, minus the recent failures
+     * @param cred Network of the access point
+     * @param rssi Signal of the access point (dBm)
+     * @return Score, higher is better
+     */
+    int wifi_select_score(const struct wifi_cred *cred, int rssi);
+
+    /**
+     * @brief Sorts candidates from the best score to the worst
+     * @param candidates Candidates
+     * @param count Number of candidates
+     */
+    void wifi_select_rank(struct wifi_candidate *candidates, size_t count);
+
+    /**
+     * @brief Tells whether to leave the current access point for another one
+     * @param current Current access point, with its score at its latest RSSI
+     * @param best Best other access point
+     * @return true if the best one is worth the reconnection, false otherwise
+     */
+    bool wifi_select_should_roam(const struct wifi_candidate *current,
+                                 const struct wifi_candidate *best);
+
+    /**
+     * @brief Scans the access points of the known networks in the background
+     * and ranks them, the known networks that are not seen are ranked last
+     * @param iface Wi-Fi interface
+     * @param done Callback invoked at the end of the scan, also if it fails
+     */
+    void wifi_select_scan(struct net_if *iface, wifi_select_scan_cb_t done);
+
+    /**
+     * @brief Gets a candidate of the last scan
+     * @param index Rank of the candidate, 0 is the best
+     * @param candidate Candidate
+     * @return true if the candidate exists, false past the last one
+     */
+    bool wifi_select_get(size_t index, struct wifi_candidate *candidate);
+
+    /**
+     * @brief Reports a scan result, called by the Wi-Fi driver
+     * @param result Access point found
+     */
+    void wifi_select_scan_result(const struct wifi_scan_result *result);
+
+    /**
+     * @brief Reports the end of a scan, called by the Wi-Fi driver, or by
+     * the caller of the scan after WIFI_SELECT_SCAN_TIMEOUT_MS
+     */
+    void wifi_select_scan_done(void);
+
+    /**
+     * @brief Sets the access point the device is connected to
+     * @param iface Wi-Fi interface, NULL when disconnected
+     * @param candidate Access point, NULL when disconnected
+     */
+    void wifi_select_set_current(struct net_if               *iface,
+                                 const struct wifi_candidate *candidate);
+
+    /**
+     * @brief Records the throughput of a download over the current network
+     * @param kibps Throughput in KiB/s
+     */
+    void wifi_select_report_throughput(uint32_t kibps);
+
+    /**
+     * @brief Monitors the link during a download and selects a better access
+     * point when it degrades
+     */
+    void wifi_select_roam_begin(void);
+
+    /**
+     * @brief Stops monitoring the link at the end of a download
+     */
+    void wifi_select_roam_end(void);
+
+    /**
+     * @brief Signals that the network is not used until the next poll, the
+     * roam selected during the download happens then
+     */
+    void wifi_select_release(void);
+#else
+static inline void
+wifi_select_report_throughput (uint32_t kibps)
+{
+    (void)kibps;
+}
+
+static inline void
+wifi_select_roam_begin (void)
+{
+}
+
+static inline void
+wifi_select_roam_end (void)
+{
+}
+
+static inline void
+wifi_select_release (void)
+{
+}
+#endif // CONFIG_APP_WIFI_MULTI_AP
+
+#ifdef __cplusplus
+}
+#endif // __cplusplus
+
+#endif // WIFI_SELECT_H
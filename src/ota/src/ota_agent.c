@@ -17,8 +17,20 @@ LOG_MODULE_REGISTER(ota_agent);
 #include <mender/client.h>
 #include <mender/inventory.h>
 
+#include "bench.h"
+#include "coredump_upload.h"
 #include "ota_agent.h"
+#include "ota_heap.h"
+#include "ota_image.h"
+#include "platform.h"
+#include "prof.h"
+#include "runtime.h"
 #include "wifi_agent.h"
+#include "wifi_ps_policy.h"
+#include "wifi_select.h"
+#ifdef CONFIG_APP_HEALTH_CHECK
+#include "health_check.h"
+#endif
 
 // Ensure Mender inventory feature is enabled
 #ifdef CONFIG_MENDER_CLIENT_INVENTORY_DISABLE
@@ -43,12 +55,29 @@ static mender_identity_t mender_identity        = {
            .value = device_mac_address,
 };
 
+#ifdef CONFIG_APP_RUNTIME_EVENT_LOOP
+// OTA agent events
+#define OTA_EVENT_INIT  BIT(0)
+#define OTA_EVENT_START BIT(1)
+#define OTA_EVENT_STOP  BIT(2)
+#define OTA_EVENT_POLL  BIT(3)
+
+// Period at which the Wi-Fi connection is checked while connecting, and at
+// which the connection is requested again as the threads do
+#define OTA_AGENT_POLL_PERIOD_MS    (100)
+#define OTA_AGENT_CONNECT_PERIOD_MS (2000)
+
+static void prvOtaAgentHandler(struct runtime_agent *agent, uint32_t events);
+static RUNTIME_AGENT_DEFINE(ota_agent, prvOtaAgentHandler);
+static int64_t connect_requested_ms = 0;
+#else
 #define OTA_AGENT_THREAD_STACK_SIZE (4096)
 #define OTA_AGENT_THREAD_PRIORITY   (3)
 
 K_SEM_DEFINE(ota_agent_initialized_sem, 0, 1);
 K_SEM_DEFINE(ota_agent_start_sem, 0, 1);
 K_SEM_DEFINE(ota_agent_stop_sem, 0, 1);
+#endif // CONFIG_APP_RUNTIME_EVENT_LOOP
 
 // OTA agent state machine enumeration
 enum ota_agent_state
@@ -63,6 +92,25 @@ static enum ota_agent_state current_state = OTA_AGENT_STATE_IDLE;
 // Flag indicating if the OTA agent has been initialized
 static bool is_ota_agent_initialized = false;
 
+#ifdef CONFIG_APP_COREDUMP
+// First and longest delays between two coredump upload attempts
+#define OTA_AGENT_UPLOAD_RETRY_MS     (5000)
+#define OTA_AGENT_UPLOAD_RETRY_MAX_MS (300000)
+#define OTA_AGENT_UPLOAD_PRIORITY     (K_LOWEST_APPLICATION_THREAD_PRIO)
+
+static void prvUploadWork(struct k_work *work);
+static K_WORK_DELAYABLE_DEFINE(upload_work, prvUploadWork);
+static K_THREAD_STACK_DEFINE(upload_stack,
+                             CONFIG_APP_COREDUMP_UPLOAD_STACK_SIZE);
+static struct k_work_q    upload_queue;
+static struct k_work_sync upload_sync;
+// Set once the dumps of the previous crashes are sent, retried until then
+// while the Mender client is active. Shared by the agent and the upload queue
+static atomic_t coredumps_sent  = ATOMIC_INIT(false);
+static atomic_t upload_enabled  = ATOMIC_INIT(false);
+static atomic_t upload_retry_ms = ATOMIC_INIT(OTA_AGENT_UPLOAD_RETRY_MS);
+#endif // CONFIG_APP_COREDUMP
+
 /**
  * @brief Install TLS credentials for Hosted Mender setup
  * @return return 0 on success, -EACCES, -ENOMEM or -EEXIST on error
@@ -98,13 +146,28 @@ MENDER_FUNC_WEAK mender_err_t
 prvMenderNetworkConnectCb (void)
 {
     LOG_DBG("prvMenderNetworkConnectCb");
-    return wifi_agent_is_connected(500) ? MENDER_OK : MENDER_FAIL;
+    if (!wifi_agent_is_connected(500))
+    {
+        return MENDER_FAIL;
+    }
+
+    wifi_ps_policy_begin(WIFI_PS_ACTIVITY_EXCHANGE);
+    prof_phase_set(PROF_PHASE_EXCHANGE);
+    return MENDER_OK;
 }
 
 MENDER_FUNC_WEAK mender_err_t
 prvMenderNetworkReleaseCb (void)
 {
     LOG_DBG("prvMenderNetworkReleaseCb");
+    ota_heap_session_end();
+    // Nothing else is expected until the next poll, an aborted download
+    // included
+    wifi_select_roam_end();
+    wifi_select_release();
+    wifi_ps_policy_end(WIFI_PS_ACTIVITY_DOWNLOAD);
+    wifi_ps_policy_end(WIFI_PS_ACTIVITY_EXCHANGE);
+    prof_phase_set(PROF_PHASE_IDLE);
     return MENDER_OK;
 }
 
@@ -146,6 +209,104 @@ prvPersistentInventoryCb (mender_keystore_t **keystore, uint8_t *keystore_len)
     return MENDER_OK;
 }
 
+#ifdef CONFIG_APP_HEALTH_CHECK
+static mender_err_t
+prvHealthInventoryCb (mender_keystore_t **keystore, uint8_t *keystore_len)
+{
+    static char              result[4];
+    static char              step[4];
+    static char              duration[12];
+    static mender_keystore_t inventory[] = {
+        { .name = "health_result", .value = result },
+        { .name = "health_failed_step", .value = step },
+        { .name = "health_duration_ms", .value = duration },
+    };
+
+    const health_check_report_t *report = health_check_get_report();
+    snprintf(result, sizeof(result), "%u", report->result);
+    snprintf(step, sizeof(step), "%u", report->failed_step);
+    snprintf(duration, sizeof(duration), "%u", report->duration_ms);
+
+    *keystore     = inventory;
+    *keystore_len = ARRAY_SIZE(inventory);
+    return MENDER_OK;
+}
+#endif // CONFIG_APP_HEALTH_CHECK
+
+#ifdef CONFIG_APP_PROFILING_INVENTORY
+// Per phase: its duration, the time in the ISRs and the worst latency
+#define PROF_INVENTORY_LEN (PROF_PHASE_COUNT * 3 + 1)
+
+static mender_err_t
+prvProfilingInventoryCb (mender_keystore_t **keystore, uint8_t *keystore_len)
+{
+    static char              names[PROF_INVENTORY_LEN][32];
+    static char              values[PROF_INVENTORY_LEN][32];
+    static mender_keystore_t inventory[PROF_INVENTORY_LEN];
+    struct prof_timing       timing;
+    struct prof_entry        entry;
+    size_t                   count = 0;
+
+    for (size_t i = 0; i < PROF_INVENTORY_LEN; i++)
+    {
+        inventory[i].name  = names[i];
+        inventory[i].value = values[i];
+    }
+
+    for (size_t phase = 0; phase < PROF_PHASE_COUNT; phase++)
+    {
+        const char *phase_name = prof_phase_name(phase);
+
+        snprintf(names[count], sizeof(names[0]), "prof_%s_ms", phase_name);
+        snprintf(values[count++],
+                 sizeof(values[0]),
+                 "%u",
+                 prof_phase_time_ms(phase));
+
+        prof_get_isr(phase, &timing);
+        snprintf(names[count], sizeof(names[0]), "prof_%s_isr_us", phase_name);
+        snprintf(values[count++],
+                 sizeof(values[0]),
+                 "%u",
+                 (uint32_t)k_cyc_to_us_floor64(timing.cycles));
+
+        // Worst latency and the thread or agent that suffered it
+        uint32_t worst_us = 0;
+        snprintf(names[count],
+                 sizeof(names[0]),
+                 "prof_%s_max_latency",
+                 phase_name);
+        snprintf(values[count], sizeof(values[0]), "0 us");
+        for (size_t i = 0; prof_get(i, &entry); i++)
+        {
+            if (entry.phases[phase].max_latency_us > worst_us)
+            {
+                worst_us = entry.phases[phase].max_latency_us;
+                snprintf(values[count],
+                         sizeof(values[0]),
+                         "%u us (%s)",
+                         worst_us,
+                         entry.name);
+            }
+        }
+        count++;
+    }
+
+    uint32_t button_us = 0;
+    for (size_t phase = 0; phase < PROF_PHASE_COUNT; phase++)
+    {
+        prof_get_probe(PROF_PROBE_BUTTON_RESPONSE, phase, &timing);
+        button_us = MAX(button_us, k_cyc_to_us_floor32(timing.max_cycles));
+    }
+    snprintf(names[count], sizeof(names[0]), "prof_button_response_max_us");
+    snprintf(values[count++], sizeof(values[0]), "%u", button_us);
+
+    *keystore     = inventory;
+    *keystore_len = (uint8_t)count;
+    return MENDER_OK;
+}
+#endif // CONFIG_APP_PROFILING_INVENTORY
+
 
 bool
 ota_agent_init (void)
@@ -180,6 +341,27 @@ ota_agent_init (void)
             break;
     }
 
+#ifdef CONFIG_OTA_CLIENT_HEAP
+    if (!ota_heap_init())
+    {
+        goto END;
+    }
+#endif // CONFIG_OTA_CLIENT_HEAP
+
+#ifdef CONFIG_APP_COREDUMP
+    const struct k_work_queue_config upload_config = { .name = "coredump" };
+    k_work_queue_start(&upload_queue,
+                       upload_stack,
+                       K_THREAD_STACK_SIZEOF(upload_stack),
+                       OTA_AGENT_UPLOAD_PRIORITY,
+                       &upload_config);
+    if (!coredump_upload_is_configured())
+    {
+        LOG_WRN("No coredump upload URL for the hosted Mender server, the "
+                "dumps stay stored");
+    }
+#endif // CONFIG_APP_COREDUMP
+
     // Initialize mender-client
     mender_client_config_t mender_client_config
         = { .device_type     = CONFIG_MENDER_DEVICE_TYPE,
@@ -216,6 +398,14 @@ ota_agent_init (void)
     LOG_INF("Update Module 'zephyr-image' initialized");
 #endif /* CONFIG_MENDER_ZEPHYR_IMAGE_UPDATE_MODULE */
 
+#ifdef CONFIG_OTA_IMAGE_UPDATE_MODULE
+    if (!ota_image_register_update_module())
+    {
+        goto END;
+    }
+    LOG_INF("Update Module 'zephyr-image' initialized (streaming verify)");
+#endif /* CONFIG_OTA_IMAGE_UPDATE_MODULE */
+
     if (MENDER_OK
         != mender_inventory_add_callback(prvPersistentInventoryCb,
                                         true))
@@ -225,8 +415,30 @@ ota_agent_init (void)
     }
     LOG_INF("Persistent inventory callback added");
 
+#ifdef CONFIG_APP_HEALTH_CHECK
+    if (MENDER_OK != mender_inventory_add_callback(prvHealthInventoryCb, false))
+    {
+        LOG_ERR("Failed to add health check inventory callback");
+        goto END;
+    }
+#endif // CONFIG_APP_HEALTH_CHECK
+
+#ifdef CONFIG_APP_PROFILING_INVENTORY
+    if (MENDER_OK
+        != mender_inventory_add_callback(prvProfilingInventoryCb, false))
+    {
+        LOG_ERR("Failed to add profiling inventory callback");
+        goto END;
+    }
+#endif // CONFIG_APP_PROFILING_INVENTORY
+
     LOG_INF("OTA agent initialized");
+#ifdef CONFIG_APP_RUNTIME_EVENT_LOOP
+    runtime_agent_init(&ota_agent);
+    runtime_post(&ota_agent, OTA_EVENT_INIT);
+#else
     k_sem_give(&ota_agent_initialized_sem);
+#endif // CONFIG_APP_RUNTIME_EVENT_LOOP
     is_ota_agent_initialized = true;
 
 END:
@@ -241,7 +453,11 @@ bool ota_agent_start(void)
         return false;
     }
 
+#ifdef CONFIG_APP_RUNTIME_EVENT_LOOP
+    runtime_post(&ota_agent, OTA_EVENT_START);
+#else
     k_sem_give(&ota_agent_start_sem);
+#endif // CONFIG_APP_RUNTIME_EVENT_LOOP
     return true;
 }
 
@@ -253,10 +469,196 @@ bool ota_agent_stop(void)
         return false;
     }
 
+#ifdef CONFIG_APP_RUNTIME_EVENT_LOOP
+    runtime_post(&ota_agent, OTA_EVENT_STOP);
+#else
     k_sem_give(&ota_agent_stop_sem);
+#endif // CONFIG_APP_RUNTIME_EVENT_LOOP
+    return true;
+}
+
+#ifdef CONFIG_APP_COREDUMP
+/**
+ * @brief Sends the dumps of the previous crashes in one batch. Runs on a
+ * queue of its own so that neither the agent nor the Mender client waits for
+ * the name resolution, the connection, the request and the erase
+ */
+static void
+prvUploadWork (struct k_work *work)
+{
+    char identity[32];
+
+    snprintf(identity,
+             sizeof(identity),
+             "%s=%s",
+             mender_identity.name,
+             mender_identity.value);
+    if (wifi_agent_has_address(0) && coredump_upload(identity))
+    {
+        atomic_set(&coredumps_sent, true);
+        return;
+    }
+    if (!atomic_get(&upload_enabled))
+    {
+        return;
+    }
+
+    atomic_val_t retry_ms = atomic_get(&upload_retry_ms);
+    LOG_WRN("Coredump upload retried in %d ms", (int)retry_ms);
+    k_work_reschedule_for_queue(&upload_queue,
+                                k_work_delayable_from_work(work),
+                                K_MSEC(retry_ms));
+    atomic_cas(&upload_retry_ms,
+               retry_ms,
+               MIN(2 * retry_ms, OTA_AGENT_UPLOAD_RETRY_MAX_MS));
+}
+#endif // CONFIG_APP_COREDUMP
+
+/**
+ * @brief Sends the stored coredumps in the background while the Mender client
+ * is active, until they are accepted
+ * @param enable true once the client is started, false when it is stopped
+ */
+static void
+prvUploadEnable (bool enable)
+{
+#ifdef CONFIG_APP_COREDUMP
+    atomic_set(&upload_enabled, enable);
+    if (!enable)
+    {
+        // Waits for an upload in progress, it may hold the network
+        k_work_cancel_delayable_sync(&upload_work, &upload_sync);
+    }
+    else if (!atomic_get(&coredumps_sent) && coredump_upload_is_configured())
+    {
+        atomic_set(&upload_retry_ms, OTA_AGENT_UPLOAD_RETRY_MS);
+        k_work_reschedule_for_queue(&upload_queue, &upload_work, K_NO_WAIT);
+    }
+#else
+    ARG_UNUSED(enable);
+#endif // CONFIG_APP_COREDUMP
+}
+
+/**
+ * @brief Starts the Mender client once connected
+ * @return true if the client started, false otherwise
+ */
+static bool
+prvActivateClient (void)
+{
+    if (!platform_get_device_id(device_mac_address,
+                                sizeof(device_mac_address)))
+    {
+        wifi_agent_get_mac_address(mender_identity.value);
+    }
+
+    if (MENDER_OK != mender_client_activate())
+    {
+        LOG_ERR("Failed to start Mender Client");
+        return false;
+    }
+    LOG_INF("Mender client started");
+    bench_mark(BENCH_EVENT_CLIENT_STARTED);
+    prvUploadEnable(true);
     return true;
 }
 
+/**
+ * @brief Stops the Mender client and releases the Wi-Fi connection
+ */
+static void
+prvDeactivateClient (void)
+{
+    prvUploadEnable(false);
+    if (MENDER_OK != mender_client_deactivate())
+    {
+        LOG_ERR("Failed to stop Mender Client");
+    }
+    LOG_INF("Mender client stopped");
+    wifi_agent_disconnect();
+}
+
+#ifdef CONFIG_APP_RUNTIME_EVENT_LOOP
+#ifdef CONFIG_APP_HEALTH_CHECK
+static void
+prvHealthCheckPassed (void)
+{
+    // The health check leaves Wi-Fi connected so the Mender client can report
+    // the deployment
+    runtime_post(&ota_agent, OTA_EVENT_START);
+}
+#endif // CONFIG_APP_HEALTH_CHECK
+
+static void
+prvOtaAgentHandler (struct runtime_agent *agent, uint32_t events)
+{
+#ifdef CONFIG_APP_HEALTH_CHECK
+    // Confirm a freshly updated image before anything else
+    if ((events & OTA_EVENT_INIT) && health_check_is_pending())
+    {
+        health_check_start(prvHealthCheckPassed);
+    }
+#endif // CONFIG_APP_HEALTH_CHECK
+
+    if ((events & OTA_EVENT_START) && (OTA_AGENT_STATE_IDLE == current_state))
+    {
+        LOG_INF("OTA_AGENT_STATE_CONNECTING");
+        if (!wifi_agent_connect())
+        {
+            LOG_ERR("Failed to connect to Wi-Fi");
+            return;
+        }
+        current_state        = OTA_AGENT_STATE_CONNECTING;
+        connect_requested_ms = k_uptime_get();
+        events |= OTA_EVENT_POLL;
+    }
+
+    if (events & OTA_EVENT_STOP)
+    {
+        LOG_INF("OTA_AGENT_STATE_DISCONNECTING");
+        runtime_cancel(agent);
+        if (OTA_AGENT_STATE_CONNECTED == current_state)
+        {
+            prvDeactivateClient();
+        }
+        else
+        {
+            wifi_agent_disconnect();
+        }
+        current_state = OTA_AGENT_STATE_IDLE;
+        LOG_INF("OTA_AGENT_STATE_IDLE");
+        return;
+    }
+
+    if ((events & OTA_EVENT_POLL)
+        && (OTA_AGENT_STATE_CONNECTING == current_state))
+    {
+        // Poll instead of waiting, the Wi-Fi agent runs on the same loop
+        if (wifi_agent_is_connected(0) && prvActivateClient())
+        {
+            current_state = OTA_AGENT_STATE_CONNECTED;
+            LOG_INF("OTA_AGENT_STATE_CONNECTED");
+            return;
+        }
+
+        // The Wi-Fi agent goes back to idle once its tries are exhausted,
+        // request the connection again as the threaded agent does
+        if ((k_uptime_get() - connect_requested_ms)
+            >= OTA_AGENT_CONNECT_PERIOD_MS)
+        {
+            connect_requested_ms = k_uptime_get();
+            if (!wifi_agent_connect())
+            {
+                LOG_ERR("Failed to connect to Wi-Fi");
+                current_state = OTA_AGENT_STATE_IDLE;
+                return;
+            }
+        }
+        runtime_post_after(
+            agent, OTA_EVENT_POLL, K_MSEC(OTA_AGENT_POLL_PERIOD_MS));
+    }
+}
+#else
 
 static void
 prvOtaAgentThread (void *arg1, void *arg2, void *arg3)
@@ -266,6 +668,15 @@ prvOtaAgentThread (void *arg1, void *arg2, void *arg3)
     // Wait for the OTA agent to be initialized
     k_sem_take(&ota_agent_initialized_sem, K_FOREVER);
 
+#ifdef CONFIG_APP_HEALTH_CHECK
+    // Confirm a freshly updated image before anything else, the health check
+    // leaves Wi-Fi connected so the Mender client can report the deployment
+    if (health_check_is_pending() && health_check_run())
+    {
+        current_state = OTA_AGENT_STATE_CONNECTING;
+    }
+#endif // CONFIG_APP_HEALTH_CHECK
+
     while (true)
     {
         switch (current_state)
@@ -285,17 +696,8 @@ prvOtaAgentThread (void *arg1, void *arg2, void *arg3)
                     break;
                 }
                 // Check connection for 2 seconds
-                if (wifi_agent_is_connected(2000))
+                if (wifi_agent_is_connected(2000) && prvActivateClient())
                 {
-                    wifi_agent_get_mac_address(mender_identity.value);
-
-                    // Start the Mender client
-                    if (MENDER_OK != mender_client_activate())
-                    {
-                        LOG_ERR("Failed to start Mender Client");
-                        break;
-                    }
-                    LOG_INF("Mender client started");
                     current_state = OTA_AGENT_STATE_CONNECTED;
                 }
                 break;
@@ -308,12 +710,7 @@ prvOtaAgentThread (void *arg1, void *arg2, void *arg3)
 
             case OTA_AGENT_STATE_DISCONNECTING:
                 LOG_INF("OTA_AGENT_STATE_DISCONNECTING");
-                if (MENDER_OK != mender_client_deactivate())
-                {
-                    LOG_ERR("Failed to stop Mender Client");
-                }
-                LOG_INF("Mender client stopped");
-                wifi_agent_disconnect();
+                prvDeactivateClient();
                 current_state = OTA_AGENT_STATE_IDLE;
                 break;
         
@@ -333,3 +730,4 @@ K_THREAD_DEFINE(ota_agent_thread_id,
                 OTA_AGENT_THREAD_PRIORITY,
                 0,
                 0);
+#endif // CONFIG_APP_RUNTIME_EVENT_LOOP
@@ -24,12 +24,14 @@ extern "C"
 
     /**
      * @brief Starts the OTA agent
+     * The agent connects to Wi-Fi itself, then activates the Mender client
      * @return true if the OTA agent started successfully, false otherwise
      */
     bool ota_agent_start(void);
     
     /**
      * @brief Stops the OTA agent
+     * The Mender client is deactivated and Wi-Fi is disconnected
      * @return true if the OTA agent stopped successfully, false otherwise
      */
     bool ota_agent_stop(void);
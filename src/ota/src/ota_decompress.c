@@ -0,0 +1,236 @@
+/**
+ * @file      ota_decompress.c
+ * @author    Theodore Bardy
+ *
+ * @note      This file is part of Witekio's Zephyr Demo project
+ * @brief     Streaming heatshrink (LZSS) decompressor for OTA images
+ */
+
+#include <zephyr/logging/log.h>
+LOG_MODULE_REGISTER(ota_decompress);
+
+#include "ota_decompress.h"
+
+#ifdef CONFIG_OTA_IMAGE_COMPRESSION
+
+#include <string.h>
+#include <zephyr/sys/byteorder.h>
+
+// Stream header: 'H' 'S' <window bits> <lookahead bits> <size (LE32)>
+#define HEADER_MAGIC_0       ('H')
+#define HEADER_MAGIC_1       ('S')
+#define HEADER_OFF_WINDOW    (2)
+#define HEADER_OFF_LOOKAHEAD (3)
+#define HEADER_OFF_SIZE      (4)
+#define LOOKAHEAD_BITS_MAX   (15)
+#define WINDOW_MASK          (OTA_DECOMPRESS_WINDOW_SIZE - 1)
+
+// Decoder states, one per field of the heatshrink bit stream
+enum ota_decompress_state
+{
+    OTA_DECOMPRESS_STATE_TAG,
+    OTA_DECOMPRESS_STATE_LITERAL,
+    OTA_DECOMPRESS_STATE_INDEX,
+    OTA_DECOMPRESS_STATE_COUNT,
+};
+
+/**
+ * @brief Reads @p count bits (MSB first) from the input
+ * @return The bits read, or -1 if the input is exhausted
+ */
+static int32_t
+prvGetBits (struct ota_decompress_ctx *ctx,
+            const uint8_t            **data,
+            size_t                    *len,
+            uint8_t                    count)
+{
+    while (ctx->bit_count < count)
+    {
+        if (0 == *len)
+        {
+            return -1;
+        }
+        ctx->bits = (ctx->bits << 8) | **data;
+        ctx->bit_count += 8;
+        (*data)++;
+        (*len)--;
+    }
+
+    ctx->bit_count -= count;
+    return (ctx->bits >> ctx->bit_count) & ((1U << count) - 1U);
+}
+
+static bool
+prvFlush (struct ota_decompress_ctx *ctx)
+{
+    if (0 == ctx->out_len)
+    {
+        return true;
+    }
+
+    bool ret     = ctx->sink->write(ctx->out, ctx->out_len);
+    ctx->out_len = 0;
+    return ret;
+}
+
+static bool
+prvEmit (struct ota_decompress_ctx *ctx, uint8_t byte)
+{
+    if (ctx->produced >= ctx->image_size)
+    {
+        LOG_ERR("Compressed stream exceeds the announced image size");
+        return false;
+    }
+
+    ctx->window[ctx->head]   = byte;
+    ctx->head                = (ctx->head + 1) & WINDOW_MASK;
+    ctx->out[ctx->out_len++] = byte;
+    ctx->produced++;
+
+    return (ctx->out_len < OTA_DECOMPRESS_OUT_SIZE) ? true : prvFlush(ctx);
+}
+
+static bool
+prvParseHeader (struct ota_decompress_ctx *ctx)
+{
+    if ((HEADER_MAGIC_0 != ctx->header[0])
+        || (HEADER_MAGIC_1 != ctx->header[1]))
+    {
+        LOG_ERR("Invalid compressed stream magic");
+        return false;
+    }
+
+    ctx->window_bits    = ctx->header[HEADER_OFF_WINDOW];
+    ctx->lookahead_bits = ctx->header[HEADER_OFF_LOOKAHEAD];
+    ctx->image_size     = sys_get_le32(&ctx->header[HEADER_OFF_SIZE]);
+
+    // A smaller window than ours can be decoded, a larger one cannot
+    if ((ctx->window_bits > CONFIG_OTA_IMAGE_COMPRESSION_WINDOW_BITS)
+        || (0 == ctx->lookahead_bits)
+        || (ctx->lookahead_bits > LOOKAHEAD_BITS_MAX)
+        || (ctx->lookahead_bits >= ctx->window_bits))
+    {
+        LOG_ERR("Unsupported compression parameters w=%u l=%u",
+                ctx->window_bits,
+                ctx->lookahead_bits);
+        return false;
+    }
+
+    return ctx->sink->open(ctx->image_size);
+}
+
+void
+ota_decompress_init (struct ota_decompress_ctx        *ctx,
+                     const struct ota_decompress_sink *sink)
+{
+    memset(ctx, 0, sizeof(*ctx));
+    ctx->sink  = sink;
+    ctx->state = OTA_DECOMPRESS_STATE_TAG;
+}
+
+bool
+ota_decompress_feed (struct ota_decompress_ctx *ctx,
+                     const uint8_t             *data,
+                     size_t                     len)
+{
+    if (ctx->header_len < OTA_DECOMPRESS_HEADER_SIZE)
+    {
+        size_t count = MIN(len, OTA_DECOMPRESS_HEADER_SIZE - ctx->header_len);
+        memcpy(&ctx->header[ctx->header_len], data, count);
+        ctx->header_len += count;
+        data += count;
+        len -= count;
+
+        if (ctx->header_len < OTA_DECOMPRESS_HEADER_SIZE)
+        {
+            return true;
+        }
+        if (!prvParseHeader(ctx))
+        {
+            return false;
+        }
+    }
+
+    while (true)
+    {
+        int32_t value;
+
+        switch (ctx->state)
+        {
+            case OTA_DECOMPRESS_STATE_TAG:
+                value = prvGetBits(ctx, &data, &len, 1);
+                if (value < 0)
+                {
+                    return prvFlush(ctx);
+                }
+                ctx->state = value ? OTA_DECOMPRESS_STATE_LITERAL
+                                   : OTA_DECOMPRESS_STATE_INDEX;
+                break;
+
+            case OTA_DECOMPRESS_STATE_LITERAL:
+                value = prvGetBits(ctx, &data, &len, 8);
+                if (value < 0)
+                {
+                    return prvFlush(ctx);
+                }
+                if (!prvEmit(ctx, (uint8_t)value))
+                {
+                    return false;
+                }
+                ctx->state = OTA_DECOMPRESS_STATE_TAG;
+                break;
+
+            case OTA_DECOMPRESS_STATE_INDEX:
+                value = prvGetBits(ctx, &data, &len, ctx->window_bits);
+                if (value < 0)
+                {
+                    return prvFlush(ctx);
+                }
+                ctx->index = (uint16_t)value + 1;
+                ctx->state = OTA_DECOMPRESS_STATE_COUNT;
+                break;
+
+            case OTA_DECOMPRESS_STATE_COUNT:
+                value = prvGetBits(ctx, &data, &len, ctx->lookahead_bits);
+                if (value < 0)
+                {
+                    return prvFlush(ctx);
+                }
+                for (int32_t i = 0; i <= value; i++)
+                {
+                    uint8_t byte
+                        = ctx->window[(ctx->head - ctx->index) & WINDOW_MASK];
+                    if (!prvEmit(ctx, byte))
+                    {
+                        return false;
+                    }
+                }
+                ctx->state = OTA_DECOMPRESS_STATE_TAG;
+                break;
+
+            default:
+                return false;
+        }
+    }
+}
+
+bool
+ota_decompress_finish (struct ota_decompress_ctx *ctx)
+{
+    if (!prvFlush(ctx))
+    {
+        return false;
+    }
+
+    if (ctx->produced < ctx->image_size)
+    {
+        LOG_ERR("Compressed stream truncated: %zu of %zu bytes",
+                ctx->produced,
+                ctx->image_size);
+        return false;
+    }
+
+    return true;
+}
+
+#endif // CONFIG_OTA_IMAGE_COMPRESSION
@@ -0,0 +1,96 @@
+/**
+ * @file      ota_decompress.h
+ * @author    Theodore Bardy
+ *
+ * @note      This file is part of Witekio's Zephyr Demo project
+ * @brief     Streaming heatshrink (LZSS) decompressor for OTA images
+ */
+
+#ifndef OTA_DECOMPRESS_H
+#define OTA_DECOMPRESS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif // __cplusplus
+
+#ifdef CONFIG_OTA_IMAGE_COMPRESSION
+
+// Size of the stream header written by scripts/compress_image.py
+#define OTA_DECOMPRESS_HEADER_SIZE (8)
+// Size of the decompressed data buffer handed to the sink
+#define OTA_DECOMPRESS_OUT_SIZE    (256)
+#define OTA_DECOMPRESS_WINDOW_SIZE \
+    (1U << CONFIG_OTA_IMAGE_COMPRESSION_WINDOW_BITS)
+
+    /**
+     * @brief Consumer of the decompressed data
+     */
+    struct ota_decompress_sink
+    {
+        // Called once the stream header announced the decompressed size
+        bool (*open)(size_t image_size);
+        // Called with each block of decompressed data
+        bool (*write)(const uint8_t *data, size_t len);
+    };
+
+    /**
+     * @brief Decompressor context, its size is dominated by the window
+     */
+    struct ota_decompress_ctx
+    {
+        const struct ota_decompress_sink *sink;
+        uint8_t  window[OTA_DECOMPRESS_WINDOW_SIZE];
+        uint8_t  out[OTA_DECOMPRESS_OUT_SIZE];
+        uint8_t  header[OTA_DECOMPRESS_HEADER_SIZE];
+        size_t   header_len;
+        size_t   out_len;
+        size_t   image_size;
+        size_t   produced;
+        uint32_t bits;
+        uint8_t  bit_count;
+        uint8_t  window_bits;
+        uint8_t  lookahead_bits;
+        uint8_t  state;
+        uint16_t head;
+        uint16_t index;
+    };
+
+    /**
+     * @brief Initializes the decompressor
+     * @param ctx Decompressor context
+     * @param sink Consumer of the decompressed data
+     */
+    void ota_decompress_init(struct ota_decompress_ctx        *ctx,
+                             const struct ota_decompress_sink *sink);
+
+    /**
+     * @brief Decompresses a chunk of the compressed stream
+     * @param ctx Decompressor context
+     * @param data Compressed data
+     * @param len Length of the compressed data
+     * @return true on success, false if the stream is invalid or the sink
+     * failed
+     */
+    bool ota_decompress_feed(struct ota_decompress_ctx *ctx,
+                             const uint8_t             *data,
+                             size_t                     len);
+
+    /**
+     * @brief Flushes the remaining decompressed data to the sink
+     * @param ctx Decompressor context
+     * @return true if the whole image was produced, false otherwise
+     */
+    bool ota_decompress_finish(struct ota_decompress_ctx *ctx);
+
+#endif // CONFIG_OTA_IMAGE_COMPRESSION
+
+#ifdef __cplusplus
+}
+#endif // __cplusplus
+
+#endif // OTA_DECOMPRESS_H
@@ -0,0 +1,206 @@
+/**
+ * @file      ota_heap.c
+ * @author    Theodore Bardy
+ *
+ * @note      This file is part of Witekio's Zephyr Demo project
+ * @brief     Dedicated heap for the Mender client allocations
+ */
+
+#include <zephyr/logging/log.h>
+LOG_MODULE_REGISTER(ota_heap);
+
+#include "ota_heap.h"
+
+#ifdef CONFIG_OTA_CLIENT_HEAP
+
+#include <stdlib.h>
+#include <string.h>
+#include <zephyr/kernel.h>
+#include <zephyr/sys/sys_heap.h>
+#include <zephyr/sys/util.h>
+#include <zephyr/sys/libc-hooks.h>
+
+#include <mender/alloc.h>
+
+// Larger allocations would quickly exhaust the heap, keep them on the system
+// one
+#define OTA_HEAP_MAX_ALLOC (CONFIG_OTA_CLIENT_HEAP_SIZE / 4)
+
+// The client allocations, short and long-lived, are kept apart from the
+// system heap: the blocks outliving a session (JWT, deployment data) no longer
+// fragment it, and its own fragmentation shows as fallbacks. A region reset
+// at the end of each session would free them too, the client does not say
+// which allocations outlive it
+static K_HEAP_DEFINE(client_heap, CONFIG_OTA_CLIENT_HEAP_SIZE);
+static struct ota_heap_stats stats = { .size = CONFIG_OTA_CLIENT_HEAP_SIZE };
+static struct k_spinlock      lock;
+
+static inline bool
+prvInClientHeap (const void *ptr)
+{
+    const uint8_t *start = client_heap.heap.init_mem;
+
+    return ((const uint8_t *)ptr >= start)
+           && ((const uint8_t *)ptr < start + client_heap.heap.init_bytes);
+}
+
+/**
+ * @brief Counts an allocation, served by the client heap or not
+ */
+static void
+prvCount (const void *ptr, size_t size)
+{
+    k_spinlock_key_t key = k_spin_lock(&lock);
+
+    if (NULL != ptr)
+    {
+        stats.allocs++;
+    }
+    else if (size > OTA_HEAP_MAX_ALLOC)
+    {
+        stats.oversized++;
+    }
+    else
+    {
+        stats.fallbacks++;
+    }
+    k_spin_unlock(&lock, key);
+}
+
+static void *
+prvMalloc (size_t size)
+{
+    void *ptr = NULL;
+
+    if (size <= OTA_HEAP_MAX_ALLOC)
+    {
+        ptr = k_heap_alloc(&client_heap, size, K_NO_WAIT);
+    }
+    prvCount(ptr, size);
+
+    return (NULL != ptr) ? ptr : malloc(size);
+}
+
+static void
+prvFree (void *ptr)
+{
+    if (NULL == ptr)
+    {
+        return;
+    }
+    if (!prvInClientHeap(ptr))
+    {
+        free(ptr);
+        return;
+    }
+
+    k_heap_free(&client_heap, ptr);
+}
+
+static void *
+prvRealloc (void *ptr, size_t size)
+{
+    if (NULL == ptr)
+    {
+        return prvMalloc(size);
+    }
+    if (!prvInClientHeap(ptr))
+    {
+        return realloc(ptr, size);
+    }
+
+    if (size <= OTA_HEAP_MAX_ALLOC)
+    {
+        void *resized = k_heap_realloc(&client_heap, ptr, size, K_NO_WAIT);
+        if (NULL != resized)
+        {
+            return resized;
+        }
+    }
+
+    // Moved to the system heap, the block is left untouched on failure
+    size_t old   = sys_heap_usable_size(&client_heap.heap, ptr);
+    void  *moved = malloc(size);
+    prvCount(NULL, size);
+    if (NULL != moved)
+    {
+        memcpy(moved, ptr, MIN(old, size));
+        k_heap_free(&client_heap, ptr);
+    }
+    return moved;
+}
+
+static void
+prvLogStats (void)
+{
+    struct ota_heap_stats current;
+
+    ota_heap_get_stats(&current);
+    // Fixed format, parsed by scripts/soak_test.py
+    LOG_INF("Client heap: sessions %u, used %zu, peak %zu/%zu, allocs %u, "
+            "oversized %u, fallbacks %u",
+            current.sessions,
+            current.used,
+            current.peak,
+            current.size,
+            current.allocs,
+            current.oversized,
+            current.fallbacks);
+
+#ifdef CONFIG_COMMON_LIBC_MALLOC
+    struct sys_memory_stats heap;
+    if (0 == malloc_runtime_stats_get(&heap))
+    {
+        LOG_INF("Heap: free %zu, allocated %zu, peak %zu",
+                heap.free_bytes,
+                heap.allocated_bytes,
+                heap.max_allocated_bytes);
+    }
+#endif // CONFIG_COMMON_LIBC_MALLOC
+}
+
+bool
+ota_heap_init (void)
+{
+    if (MENDER_OK
+        != mender_set_allocation_funcs(prvMalloc, prvRealloc, prvFree))
+    {
+        LOG_ERR("Failed to install the client heap allocator");
+        return false;
+    }
+
+    LOG_INF("Client heap allocator installed (%u bytes)", CONFIG_OTA_CLIENT_HEAP_SIZE);
+    return true;
+}
+
+void
+ota_heap_session_end (void)
+{
+    k_spinlock_key_t key      = k_spin_lock(&lock);
+    uint32_t         sessions = ++stats.sessions;
+    k_spin_unlock(&lock, key);
+
+    if (0 == (sessions % CONFIG_OTA_CLIENT_HEAP_STATS_INTERVAL))
+    {
+        prvLogStats();
+    }
+}
+
+void
+ota_heap_get_stats (struct ota_heap_stats *out)
+{
+    struct sys_memory_stats heap;
+
+    k_spinlock_key_t key = k_spin_lock(&lock);
+    *out                 = stats;
+    k_spin_unlock(&lock, key);
+
+    // Bytes in use and peak as seen by the heap itself
+    if (0 == sys_heap_runtime_stats_get(&client_heap.heap, &heap))
+    {
+        out->used = heap.allocated_bytes;
+        out->peak = heap.max_allocated_bytes;
+    }
+}
+
+#endif // CONFIG_OTA_CLIENT_HEAP
@@ -0,0 +1,69 @@
+/**
+ * @file      ota_heap.h
+ * @author    Theodore Bardy
+ *
+ * @note      This file is part of Witekio's Zephyr Demo project
+ * @brief     Dedicated heap for the Mender client allocations
+ */
+
+#ifndef OTA_HEAP_H
+#define OTA_HEAP_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif // __cplusplus
+
+#ifdef CONFIG_OTA_CLIENT_HEAP
+
+    /**
+     * @brief Client heap usage statistics
+     */
+    struct ota_heap_stats
+    {
+        size_t   size;      // Size of the client heap
+        size_t   used;      // Bytes currently allocated
+        size_t   peak;      // Highest value of used
+        uint32_t allocs;    // Allocations served by the client heap
+        uint32_t oversized; // Allocations too large, served by the heap
+        uint32_t fallbacks; // Allocations not fitting, served by the heap
+        uint32_t sessions;  // Sessions ended
+    };
+
+    /**
+     * @brief Installs the client heap as the Mender client allocator, must be
+     * called before mender_client_init()
+     * @return true if the allocator was installed, false otherwise
+     */
+    bool ota_heap_init(void);
+
+    /**
+     * @brief Counts the end of a session, the statistics are logged every
+     * CONFIG_OTA_CLIENT_HEAP_STATS_INTERVAL sessions
+     */
+    void ota_heap_session_end(void);
+
+    /**
+     * @brief Gets the client heap usage statistics
+     * @param stats Statistics
+     */
+    void ota_heap_get_stats(struct ota_heap_stats *stats);
+
+#else
+
+static inline void
+ota_heap_session_end (void)
+{
+}
+
+#endif // CONFIG_OTA_CLIENT_HEAP
+
+#ifdef __cplusplus
+}
+#endif // __cplusplus
+
+#endif // OTA_HEAP_H
@@ -0,0 +1,669 @@
+/**
+ * @file      ota_image.c
+ * @author    Theodore Bardy
+ *
+ * @note      This file is part of Witekio's Zephyr Demo project
+ * @brief     Streaming MCUboot image update module
+ */
+
+#include <zephyr/logging/log.h>
+LOG_MODULE_REGISTER(ota_image);
+
+#include "ota_image.h"
+
+#ifdef CONFIG_OTA_IMAGE_UPDATE_MODULE
+
+#include <string.h>
+#include <zephyr/kernel.h>
+#include <zephyr/sys/byteorder.h>
+#include <zephyr/storage/flash_map.h>
+#include <zephyr/dfu/flash_img.h>
+#include <zephyr/dfu/mcuboot.h>
+
+#include <mbedtls/sha256.h>
+
+#include <mender/update-module.h>
+
+#include "bench.h"
+#include "ota_decompress.h"
+#include "prof.h"
+#include "wifi_ps_policy.h"
+#include "wifi_select.h"
+#ifdef CONFIG_APP_HEALTH_CHECK
+#include "health_check.h"
+#endif
+
+#define OTA_IMAGE_ARTIFACT_TYPE            "zephyr-image"
+#define OTA_IMAGE_COMPRESSED_ARTIFACT_TYPE "zephyr-image-hs"
+#define OTA_IMAGE_SLOT_ID                  FIXED_PARTITION_ID(slot1_partition)
+#define OTA_IMAGE_SLOT_SIZE                FIXED_PARTITION_SIZE(slot1_partition)
+
+// MCUboot image format, see bootutil/image.h in the MCUboot sources
+#define IMAGE_MAGIC                 (0x96f3b83dU)
+#define IMAGE_HEADER_SIZE           (32)
+#define IMAGE_TLV_INFO_MAGIC        (0x6907U)
+#define IMAGE_TLV_INFO_SIZE         (4)
+#define IMAGE_TLV_HEADER_SIZE       (4)
+#define IMAGE_TLV_SHA256            (0x10U)
+#define IMAGE_HASH_SIZE             (32)
+#define IMAGE_HDR_OFF_MAGIC         (0)
+#define IMAGE_HDR_OFF_HDR_SIZE      (8)
+#define IMAGE_HDR_OFF_PROT_TLV_SIZE (10)
+#define IMAGE_HDR_OFF_IMG_SIZE      (12)
+
+// Stages of the streamed image parser
+enum ota_image_stage
+{
+    OTA_IMAGE_STAGE_HEADER,
+    OTA_IMAGE_STAGE_BODY,
+    OTA_IMAGE_STAGE_TLV_INFO,
+    OTA_IMAGE_STAGE_TLV_HEADER,
+    OTA_IMAGE_STAGE_TLV_HASH,
+    OTA_IMAGE_STAGE_TLV_SKIP,
+    OTA_IMAGE_STAGE_TRAILER,
+};
+
+// Streamed image parser context
+struct ota_image_ctx
+{
+    enum ota_image_stage       stage;
+    size_t                     image_size;
+    size_t                     position;
+    size_t                     hashed_size;
+    size_t                     tlv_end;
+    size_t                     tlv_value_left;
+    size_t                     scratch_len;
+    uint8_t                    scratch[IMAGE_HEADER_SIZE];
+    uint8_t                    digest[IMAGE_HASH_SIZE];
+    bool                       hash_verified;
+    bool                       open;
+    mbedtls_sha256_context     sha256;
+    struct flash_img_context   flash;
+    int64_t                    start_ms;
+#ifdef CONFIG_SCHED_THREAD_USAGE_ALL
+    k_thread_runtime_stats_t   start_stats;
+#endif
+};
+
+static struct ota_image_ctx ctx;
+
+/**
+ * @brief Collects bytes into the scratch buffer until it holds @p wanted bytes
+ * @return Number of bytes consumed from @p data
+ */
+static size_t
+prvCollect (const uint8_t *data, size_t len, size_t wanted)
+{
+    size_t count = MIN(len, wanted - ctx.scratch_len);
+    memcpy(&ctx.scratch[ctx.scratch_len], data, count);
+    ctx.scratch_len += count;
+    return count;
+}
+
+/**
+ * @brief Validates the MCUboot image header as soon as it has been received
+ * @return true if the header is consistent with the artifact, false otherwise
+ */
+static bool
+prvCheckHeader (void)
+{
+    uint32_t magic = sys_get_le32(&ctx.scratch[IMAGE_HDR_OFF_MAGIC]);
+    uint16_t hdr_size = sys_get_le16(&ctx.scratch[IMAGE_HDR_OFF_HDR_SIZE]);
+    uint16_t prot_tlv_size
+        = sys_get_le16(&ctx.scratch[IMAGE_HDR_OFF_PROT_TLV_SIZE]);
+    uint32_t img_size = sys_get_le32(&ctx.scratch[IMAGE_HDR_OFF_IMG_SIZE]);
+
+    if (IMAGE_MAGIC != magic)
+    {
+        LOG_ERR("Invalid image magic 0x%08x", magic);
+        return false;
+    }
+    if (hdr_size < IMAGE_HEADER_SIZE)
+    {
+        LOG_ERR("Invalid image header size %u", hdr_size);
+        return false;
+    }
+
+    ctx.hashed_size = (size_t)hdr_size + img_size + prot_tlv_size;
+    if (ctx.hashed_size + IMAGE_TLV_INFO_SIZE > ctx.image_size)
+    {
+        LOG_ERR("Image size %zu does not fit in payload of %zu bytes",
+                ctx.hashed_size,
+                ctx.image_size);
+        return false;
+    }
+
+    return true;
+}
+
+/**
+ * @brief Runs the streamed image parser over a chunk of the artifact
+ * @return true if the chunk is consistent with the image, false on mismatch
+ */
+static bool
+prvParse (const uint8_t *data, size_t len)
+{
+    while (len > 0)
+    {
+        size_t count = 0;
+
+        switch (ctx.stage)
+        {
+            case OTA_IMAGE_STAGE_HEADER:
+                count = prvCollect(data, len, IMAGE_HEADER_SIZE);
+                mbedtls_sha256_update(&ctx.sha256, data, count);
+                if (IMAGE_HEADER_SIZE == ctx.scratch_len)
+                {
+                    if (!prvCheckHeader())
+                    {
+                        return false;
+                    }
+                    ctx.stage = OTA_IMAGE_STAGE_BODY;
+                }
+                break;
+
+            case OTA_IMAGE_STAGE_BODY:
+                count = MIN(len, ctx.hashed_size - ctx.position);
+                mbedtls_sha256_update(&ctx.sha256, data, count);
+                if (ctx.position + count >= ctx.hashed_size)
+                {
+                    mbedtls_sha256_finish(&ctx.sha256, ctx.digest);
+                    ctx.scratch_len = 0;
+                    ctx.stage       = OTA_IMAGE_STAGE_TLV_INFO;
+                }
+                break;
+
+            case OTA_IMAGE_STAGE_TLV_INFO:
+                count = prvCollect(data, len, IMAGE_TLV_INFO_SIZE);
+                if (IMAGE_TLV_INFO_SIZE == ctx.scratch_len)
+                {
+                    if (IMAGE_TLV_INFO_MAGIC != sys_get_le16(&ctx.scratch[0]))
+                    {
+                        LOG_ERR("Invalid TLV area magic");
+                        return false;
+                    }
+                    ctx.tlv_end = ctx.hashed_size
+                                  + sys_get_le16(&ctx.scratch[2]);
+                    if (ctx.tlv_end > ctx.image_size)
+                    {
+                        LOG_ERR("TLV area exceeds payload size");
+                        return false;
+                    }
+                    ctx.scratch_len = 0;
+                    ctx.stage       = OTA_IMAGE_STAGE_TLV_HEADER;
+                }
+                break;
+
+            case OTA_IMAGE_STAGE_TLV_HEADER:
+                count = prvCollect(data, len, IMAGE_TLV_HEADER_SIZE);
+                if (IMAGE_TLV_HEADER_SIZE == ctx.scratch_len)
+                {
+                    uint16_t type = sys_get_le16(&ctx.scratch[0]);
+                    ctx.tlv_value_left = sys_get_le16(&ctx.scratch[2]);
+                    ctx.scratch_len    = 0;
+                    ctx.stage
+                        = ((IMAGE_TLV_SHA256 == type)
+                           && (IMAGE_HASH_SIZE == ctx.tlv_value_left))
+                              ? OTA_IMAGE_STAGE_TLV_HASH
+                              : OTA_IMAGE_STAGE_TLV_SKIP;
+                }
+                break;
+
+            case OTA_IMAGE_STAGE_TLV_HASH:
+                count = prvCollect(data, len, IMAGE_HASH_SIZE);
+                if (IMAGE_HASH_SIZE == ctx.scratch_len)
+                {
+                    if (0 != memcmp(ctx.scratch, ctx.digest, IMAGE_HASH_SIZE))
+                    {
+                        LOG_ERR("Image hash mismatch at offset %zu",
+                                ctx.position + count);
+                        return false;
+                    }
+                    LOG_INF("Image hash verified");
+                    ctx.hash_verified = true;
+                    ctx.scratch_len   = 0;
+                    ctx.stage         = OTA_IMAGE_STAGE_TLV_HEADER;
+                }
+                break;
+
+            case OTA_IMAGE_STAGE_TLV_SKIP:
+                count = MIN(len, ctx.tlv_value_left);
+                ctx.tlv_value_left -= count;
+                if (0 == ctx.tlv_value_left)
+                {
+                    ctx.stage = OTA_IMAGE_STAGE_TLV_HEADER;
+                }
+                break;
+
+            case OTA_IMAGE_STAGE_TRAILER:
+            default:
+                count = len;
+                break;
+        }
+
+        // Anything following the TLV area is padding and is not parsed
+        if (ctx.stage > OTA_IMAGE_STAGE_TLV_INFO
+            && ctx.position + count >= ctx.tlv_end)
+        {
+            ctx.stage = OTA_IMAGE_STAGE_TRAILER;
+        }
+
+        ctx.position += count;
+        data += count;
+        len -= count;
+    }
+
+    return true;
+}
+
+/**
+ * @brief Logs the download throughput and CPU load of the whole transfer
+ */
+static void
+prvReportThroughput (void)
+{
+    uint32_t elapsed_ms = MAX((uint32_t)(k_uptime_get() - ctx.start_ms), 1U);
+    uint32_t kib_per_s
+        = (uint32_t)(((uint64_t)ctx.position * 1000U) / 1024U / elapsed_ms);
+
+#ifdef CONFIG_SCHED_THREAD_USAGE_ALL
+    k_thread_runtime_stats_t stats;
+    k_thread_runtime_stats_all_get(&stats);
+
+    uint64_t all  = stats.execution_cycles - ctx.start_stats.execution_cycles;
+    uint64_t idle = stats.idle_cycles - ctx.start_stats.idle_cycles;
+    uint32_t cpu  = (all > 0) ? (uint32_t)(((all - idle) * 100U) / all) : 0;
+
+    LOG_INF("Wrote %zu bytes in %u ms: %u KiB/s, CPU %u%%",
+            ctx.position,
+            elapsed_ms,
+            kib_per_s,
+            cpu);
+#else
+    LOG_INF("Wrote %zu bytes in %u ms: %u KiB/s",
+            ctx.position,
+            elapsed_ms,
+            kib_per_s);
+#endif
+    wifi_select_report_throughput(kib_per_s);
+}
+
+/**
+ * @brief Signals the start of the download to the Wi-Fi policies and to the
+ * profiling
+ */
+static void
+prvDownloadBegin (void)
+{
+    wifi_ps_policy_begin(WIFI_PS_ACTIVITY_DOWNLOAD);
+    wifi_select_roam_begin();
+    prof_phase_set(PROF_PHASE_DOWNLOAD);
+}
+
+/**
+ * @brief Signals the end of the download to the Wi-Fi policies and to the
+ * profiling
+ */
+static void
+prvDownloadEnd (void)
+{
+    prof_phase_set(PROF_PHASE_EXCHANGE);
+    wifi_select_roam_end();
+    wifi_ps_policy_end(WIFI_PS_ACTIVITY_DOWNLOAD);
+}
+
+/**
+ * @brief Releases the hash context and ends the download, once per opening
+ */
+static void
+prvStreamClose (void)
+{
+    if (!ctx.open)
+    {
+        return;
+    }
+
+    ctx.open = false;
+    mbedtls_sha256_free(&ctx.sha256);
+    prvDownloadEnd();
+}
+
+/**
+ * @brief Prepares the secondary slot to receive an image
+ * @param name Name of the payload being installed
+ * @param image_size Size of the MCUboot image
+ * @return true if the slot is ready, false otherwise
+ */
+static bool
+prvStreamOpen (const char *name, size_t image_size)
+{
+    if (image_size > OTA_IMAGE_SLOT_SIZE)
+    {
+        LOG_ERR("Image of %zu bytes does not fit in the slot", image_size);
+        return false;
+    }
+
+    // Open the slot first, nothing has to be undone if it fails. A previous
+    // download the client gave up on is still open
+    prvStreamClose();
+    memset(&ctx, 0, sizeof(ctx));
+    if (0 != flash_img_init_id(&ctx.flash, OTA_IMAGE_SLOT_ID))
+    {
+        LOG_ERR("Failed to open the secondary slot");
+        return false;
+    }
+
+    ctx.image_size = image_size;
+    ctx.start_ms   = k_uptime_get();
+    bench_mark(BENCH_EVENT_DOWNLOAD_START);
+    prvDownloadBegin();
+#ifdef CONFIG_SCHED_THREAD_USAGE_ALL
+    k_thread_runtime_stats_all_get(&ctx.start_stats);
+#endif
+    mbedtls_sha256_init(&ctx.sha256);
+    mbedtls_sha256_starts(&ctx.sha256, 0);
+    ctx.open = true;
+    LOG_INF("Streaming '%s' (%zu bytes) to the secondary slot",
+            name,
+            image_size);
+
+    return true;
+}
+
+/**
+ * @brief Verifies and writes a chunk of the image to the secondary slot
+ * @return true if the chunk was written, false on mismatch or flash error
+ */
+static bool
+prvStreamWrite (const uint8_t *data, size_t len)
+{
+    size_t offset = ctx.position;
+
+    // Verify the chunk before it reaches the flash so that a corrupted
+    // artifact fails the deployment instead of being rejected after the
+    // reboot. The image has a single hash, a corrupted body is only detected
+    // once the SHA256 TLV following it is received
+    if (!prvParse(data, len))
+    {
+        LOG_ERR("Download aborted after %zu of %zu bytes",
+                offset + len,
+                ctx.image_size);
+        prvStreamClose();
+        return false;
+    }
+
+    bool last = (ctx.position >= ctx.image_size);
+    if (0 != flash_img_buffered_write(&ctx.flash, data, len, last))
+    {
+        LOG_ERR("Failed to write the secondary slot at offset %zu", offset);
+        prvStreamClose();
+        return false;
+    }
+
+    if (last)
+    {
+        prvStreamClose();
+        prvReportThroughput();
+        bench_mark(BENCH_EVENT_DOWNLOAD_DONE);
+        if (!ctx.hash_verified)
+        {
+            LOG_ERR("Image has no SHA256 TLV");
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static mender_err_t
+prvDownloadCb (mender_update_state_t      state,
+               mender_update_state_data_t callback_data)
+{
+    ARG_UNUSED(state);
+    mender_update_download_state_data_t *dl_data
+        = callback_data.download_state_data;
+
+    if (NULL == dl_data->filename)
+    {
+        return MENDER_OK;
+    }
+
+    if ((0 == dl_data->offset)
+        && !prvStreamOpen(dl_data->filename, dl_data->size))
+    {
+        return MENDER_FAIL;
+    }
+
+    return prvStreamWrite(dl_data->data, dl_data->data_length) ? MENDER_OK
+                                                               : MENDER_FAIL;
+}
+
+#ifdef CONFIG_OTA_IMAGE_COMPRESSION
+static struct ota_decompress_ctx decompress_ctx;
+static const char               *decompress_name;
+// Cycles spent decompressing, including the sink, and in the sink only
+static uint64_t decompress_cycles;
+static uint64_t sink_cycles;
+
+static bool
+prvDecompressOpen (size_t image_size)
+{
+    uint32_t start = k_cycle_get_32();
+    bool     ret   = prvStreamOpen(decompress_name, image_size);
+
+    sink_cycles += k_cycle_get_32() - start;
+    return ret;
+}
+
+static bool
+prvDecompressWrite (const uint8_t *data, size_t len)
+{
+    uint32_t start = k_cycle_get_32();
+    bool     ret   = prvStreamWrite(data, len);
+
+    sink_cycles += k_cycle_get_32() - start;
+    return ret;
+}
+
+static const struct ota_decompress_sink decompress_sink = {
+    .open  = prvDecompressOpen,
+    .write = prvDecompressWrite,
+};
+
+static mender_err_t
+prvCompressedDownloadCb (mender_update_state_t      state,
+                         mender_update_state_data_t callback_data)
+{
+    ARG_UNUSED(state);
+    mender_update_download_state_data_t *dl_data
+        = callback_data.download_state_data;
+
+    if (NULL == dl_data->filename)
+    {
+        return MENDER_OK;
+    }
+
+    if (0 == dl_data->offset)
+    {
+        decompress_name   = dl_data->filename;
+        decompress_cycles = 0;
+        sink_cycles       = 0;
+        ota_decompress_init(&decompress_ctx, &decompress_sink);
+    }
+
+    uint32_t start = k_cycle_get_32();
+    bool     ret   = ota_decompress_feed(
+        &decompress_ctx, dl_data->data, dl_data->data_length);
+    bool last = (dl_data->offset + dl_data->data_length >= dl_data->size);
+    if (ret && last)
+    {
+        ret = ota_decompress_finish(&decompress_ctx);
+    }
+    decompress_cycles += k_cycle_get_32() - start;
+
+    if (!ret)
+    {
+        // The decoder can fail after the sink opened, e.g. on a truncated
+        // stream, the sink only closes itself on its own failures
+        prvStreamClose();
+        return MENDER_FAIL;
+    }
+    if (last)
+    {
+        // Decoder only, the download and the flash writes are excluded
+        LOG_INF("Decompressed %zu bytes into %zu bytes, decoder %u us, "
+                "%zu bytes of RAM",
+                dl_data->size,
+                ctx.image_size,
+                (uint32_t)k_cyc_to_us_floor64(decompress_cycles
+                                              - sink_cycles),
+                sizeof(decompress_ctx));
+    }
+
+    return MENDER_OK;
+}
+#endif // CONFIG_OTA_IMAGE_COMPRESSION
+
+static mender_err_t
+prvInstallCb (mender_update_state_t      state,
+              mender_update_state_data_t callback_data)
+{
+    ARG_UNUSED(state);
+    ARG_UNUSED(callback_data);
+
+    if (!ctx.hash_verified)
+    {
+        LOG_ERR("Refusing to install an unverified image");
+        return MENDER_FAIL;
+    }
+
+    if (0 != boot_request_upgrade(BOOT_UPGRADE_TEST))
+    {
+        LOG_ERR("Failed to request the image upgrade");
+        return MENDER_FAIL;
+    }
+
+    return MENDER_OK;
+}
+
+static mender_err_t
+prvVerifyRebootCb (mender_update_state_t      state,
+                   mender_update_state_data_t callback_data)
+{
+    ARG_UNUSED(state);
+    ARG_UNUSED(callback_data);
+
+    // A confirmed image after the reboot means MCUboot did not swap, unless
+    // the health check already confirmed the new image
+    bool confirmed = boot_is_img_confirmed();
+#ifdef CONFIG_APP_HEALTH_CHECK
+    confirmed = confirmed && !health_check_confirmed_this_boot();
+#endif
+    if (confirmed)
+    {
+        LOG_ERR("New image is not running, MCUboot did not swap");
+        return MENDER_FAIL;
+    }
+
+    return MENDER_OK;
+}
+
+static mender_err_t
+prvCommitCb (mender_update_state_t      state,
+             mender_update_state_data_t callback_data)
+{
+    ARG_UNUSED(state);
+    ARG_UNUSED(callback_data);
+
+    if (0 != boot_write_img_confirmed())
+    {
+        LOG_ERR("Failed to confirm the image");
+        return MENDER_FAIL;
+    }
+
+    return MENDER_OK;
+}
+
+static mender_err_t
+prvRollbackVerifyRebootCb (mender_update_state_t      state,
+                           mender_update_state_data_t callback_data)
+{
+    ARG_UNUSED(state);
+    ARG_UNUSED(callback_data);
+
+    // MCUboot reverted to the previous image, which is always confirmed
+    return boot_is_img_confirmed() ? MENDER_OK : MENDER_FAIL;
+}
+
+static mender_err_t
+prvFailureCb (mender_update_state_t      state,
+              mender_update_state_data_t callback_data)
+{
+    ARG_UNUSED(state);
+    ARG_UNUSED(callback_data);
+
+    // A download interrupted by the client, e.g. on a network error, never
+    // received its last chunk
+    prvStreamClose();
+
+    // An unconfirmed running image is reverted by MCUboot on next reboot
+    if (!boot_is_img_confirmed())
+    {
+        return MENDER_OK;
+    }
+
+    // Otherwise drop the pending upgrade so the failed image is never booted
+    if (0 != boot_erase_img_bank(OTA_IMAGE_SLOT_ID))
+    {
+        LOG_ERR("Failed to erase the secondary slot");
+        return MENDER_FAIL;
+    }
+
+    return MENDER_OK;
+}
+
+bool
+ota_image_register_update_module (void)
+{
+    static mender_update_module_t module = {
+        .callbacks = {
+            [MENDER_UPDATE_STATE_DOWNLOAD]      = prvDownloadCb,
+            [MENDER_UPDATE_STATE_INSTALL]       = prvInstallCb,
+            [MENDER_UPDATE_STATE_VERIFY_REBOOT] = prvVerifyRebootCb,
+            [MENDER_UPDATE_STATE_COMMIT]        = prvCommitCb,
+            [MENDER_UPDATE_STATE_ROLLBACK_VERIFY_REBOOT]
+            = prvRollbackVerifyRebootCb,
+            [MENDER_UPDATE_STATE_FAILURE] = prvFailureCb,
+        },
+        .artifact_type     = OTA_IMAGE_ARTIFACT_TYPE,
+        .requires_reboot   = true,
+        .supports_rollback = true,
+    };
+
+    if (MENDER_OK != mender_update_module_register(&module))
+    {
+        LOG_ERR("Failed to register the '%s' Update Module",
+                OTA_IMAGE_ARTIFACT_TYPE);
+        return false;
+    }
+
+#ifdef CONFIG_OTA_IMAGE_COMPRESSION
+    // Same states as the raw image, only the download decompresses
+    static mender_update_module_t compressed_module;
+    compressed_module               = module;
+    compressed_module.artifact_type = OTA_IMAGE_COMPRESSED_ARTIFACT_TYPE;
+    compressed_module.callbacks[MENDER_UPDATE_STATE_DOWNLOAD]
+        = prvCompressedDownloadCb;
+
+    if (MENDER_OK != mender_update_module_register(&compressed_module))
+    {
+        LOG_ERR("Failed to register the '%s' Update Module",
+                OTA_IMAGE_COMPRESSED_ARTIFACT_TYPE);
+        return false;
+    }
+#endif // CONFIG_OTA_IMAGE_COMPRESSION
+
+    return true;
+}
+
+#endif // CONFIG_OTA_IMAGE_UPDATE_MODULE
@@ -0,0 +1,31 @@
+/**
+ * @file      ota_image.h
+ * @author    Theodore Bardy
+ *
+ * @note      This file is part of Witekio's Zephyr Demo project
+ * @brief     Streaming MCUboot image update module
+ */
+
+#ifndef OTA_IMAGE_H
+#define OTA_IMAGE_H
+
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif // __cplusplus
+
+    /**
+     * @brief Registers the 'zephyr-image' Update Module which verifies the
+     * MCUboot image while it is streamed to the secondary slot
+     * @return true if the Update Module was registered successfully, false
+     * otherwise
+     */
+    bool ota_image_register_update_module(void);
+
+#ifdef __cplusplus
+}
+#endif // __cplusplus
+
+#endif // OTA_IMAGE_H
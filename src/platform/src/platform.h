@@ -0,0 +1,58 @@
+/**
+ * @file      platform.h
+ * @author    Theodore Bardy
+ *
+ * @note      This file is part of Witekio's Zephyr Demo project
+ * @brief     Platform specific services
+ */
+
+#ifndef PLATFORM_H
+#define PLATFORM_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <zephyr/drivers/gpio.h>
+
+#if defined(CONFIG_SOC_FAMILY_ESPRESSIF_ESP32)
+#include <esp_attr.h>
+// RTC slow memory is powered during deep sleep
+#define PLATFORM_RETAINED RTC_NOINIT_ATTR
+#else
+// Saved to and restored from the file given with --retained
+#define PLATFORM_RETAINED __attribute__((section("app_retained")))
+#endif
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif // __cplusplus
+
+    /**
+     * @brief Puts the device in deep sleep until the wake-up button is
+     * pressed, the device then boots from scratch
+     * @param wakeup Button waking the device up
+     */
+    FUNC_NORETURN void platform_deep_sleep(const struct gpio_dt_spec *wakeup);
+
+    /**
+     * @brief Gets the device identity imposed by the platform, if any
+     * @param id Buffer receiving the identity
+     * @param len Size of the buffer
+     * @return true if the platform imposes an identity, false if the MAC
+     * address must be used
+     */
+    bool platform_get_device_id(char *id, size_t len);
+
+    /**
+     * @brief Gets the time of a clock which keeps running during deep sleep,
+     * to compare with times saved in PLATFORM_RETAINED variables
+     * @return Time in milliseconds, from an arbitrary origin
+     */
+    uint64_t platform_get_rtc_ms(void);
+
+#ifdef __cplusplus
+}
+#endif // __cplusplus
+
+#endif // PLATFORM_H
@@ -0,0 +1,49 @@
+/**
+ * @file      platform_esp32.c
+ * @author    Theodore Bardy
+ *
+ * @note      This file is part of Witekio's Zephyr Demo project
+ * @brief     Platform specific services for Espressif ESP32 SoCs
+ */
+
+#include <zephyr/logging/log.h>
+LOG_MODULE_REGISTER(platform);
+
+#include <zephyr/kernel.h>
+
+#include <esp_rtc_time.h>
+#include <esp_sleep.h>
+
+#include "platform.h"
+
+void
+platform_deep_sleep (const struct gpio_dt_spec *wakeup)
+{
+    LOG_INF("Preparing for deep sleep.");
+
+    esp_sleep_enable_ext0_wakeup(wakeup->pin, 1);
+
+    LOG_INF("Entering deep sleep NOW.");
+    k_msleep(2000);
+    esp_deep_sleep_start();
+
+    // Code never returns here
+    CODE_UNREACHABLE;
+}
+
+bool
+platform_get_device_id (char *id, size_t len)
+{
+    ARG_UNUSED(id);
+    ARG_UNUSED(len);
+
+    // Devices are identified by their MAC address
+    return false;
+}
+
+uint64_t
+platform_get_rtc_ms (void)
+{
+    // The RTC timer is not reset by deep sleep
+    return esp_rtc_get_time_us() / 1000;
+}
@@ -0,0 +1,211 @@
+/**
+ * @file      platform_native.c
+ * @author    Theodore Bardy
+ *
+ * @note      This file is part of Witekio's Zephyr Demo project
+ * @brief     Platform specific services for the native_sim board
+ */
+
+#include <zephyr/logging/log.h>
+LOG_MODULE_REGISTER(platform);
+
+#include <string.h>
+#include <zephyr/kernel.h>
+#include <zephyr/init.h>
+#include <zephyr/drivers/gpio/gpio_emul.h>
+#if defined(CONFIG_NET_SOCKETS_OFFLOAD) \
+    && defined(CONFIG_DNS_SERVER_IP_ADDRESSES)
+#include <zephyr/net/socket_offload.h>
+#endif
+
+#include <posix_board_if.h>
+#include <posix_native_task.h>
+#include <cmdline.h>
+#include <native_rtc.h>
+#include <nsi_host_trampolines.h>
+
+#include "platform.h"
+
+// Duration of an emulated button press
+#define PLATFORM_PRESS_DURATION_MS (50)
+// Command line value meaning the button is never pressed
+#define PLATFORM_NO_PRESS          (UINT32_MAX)
+// Host open() flags, the file must exist
+#define PLATFORM_HOST_O_RDONLY     (0)
+#define PLATFORM_HOST_O_WRONLY     (1)
+
+#define BT0_NODE DT_ALIAS(bt0)
+static const struct gpio_dt_spec bt0 = GPIO_DT_SPEC_GET(BT0_NODE, gpios);
+
+static uint32_t wake_after_ms  = PLATFORM_NO_PRESS;
+static uint32_t sleep_after_ms = PLATFORM_NO_PRESS;
+static bool     woken_up       = false;
+static char    *device_id      = NULL;
+static char    *retained_file  = NULL;
+
+// Bounds of the PLATFORM_RETAINED variables, defined by the linker
+extern uint8_t __start_app_retained[] __attribute__((weak));
+extern uint8_t __stop_app_retained[] __attribute__((weak));
+
+static void
+prvAddOptions (void)
+{
+    static struct args_struct_t options[] = {
+        { .option   = "wake-after-ms",
+          .name     = "ms",
+          .type     = 'u',
+          .dest     = (void *)&wake_after_ms,
+          .descript = "Press the button this long after boot" },
+        { .option   = "sleep-after-ms",
+          .name     = "ms",
+          .type     = 'u',
+          .dest     = (void *)&sleep_after_ms,
+          .descript = "Press the button again this long after the wake-up" },
+        { .option   = "device-id",
+          .name     = "id",
+          .type     = 's',
+          .dest     = (void *)&device_id,
+          .descript = "Identity used instead of the MAC address, so that "
+                      "several instances can run against the same server" },
+        { .option   = "retained",
+          .name     = "file",
+          .type     = 's',
+          .dest     = (void *)&retained_file,
+          .descript = "Existing file keeping the retained memory across deep "
+                      "sleep, i.e. across runs" },
+        ARG_TABLE_ENDMARKER,
+    };
+
+    native_add_command_line_opts(options);
+}
+NATIVE_TASK(prvAddOptions, PRE_BOOT_1, 1);
+
+/**
+ * @brief Transfers the retained memory from or to the --retained file
+ */
+static void
+prvRetainedTransfer (bool save)
+{
+    size_t size = __stop_app_retained - __start_app_retained;
+    if ((NULL == retained_file) || (NULL == __start_app_retained)
+        || (0 == size))
+    {
+        return;
+    }
+
+    int fd = nsi_host_open(retained_file,
+                           save ? PLATFORM_HOST_O_WRONLY
+                                : PLATFORM_HOST_O_RDONLY);
+    if (fd < 0)
+    {
+        return;
+    }
+    // An empty or short file is a power loss, the memory keeps its content
+    if (save)
+    {
+        nsi_host_write(fd, __start_app_retained, size);
+    }
+    else
+    {
+        nsi_host_read(fd, __start_app_retained, size);
+    }
+    nsi_host_close(fd);
+}
+
+static void
+prvRetainedLoad (void)
+{
+    prvRetainedTransfer(false);
+}
+NATIVE_TASK(prvRetainedLoad, PRE_BOOT_2, 1);
+
+#if defined(CONFIG_NET_SOCKETS_OFFLOAD) \
+    && defined(CONFIG_DNS_SERVER_IP_ADDRESSES)
+/**
+ * @brief Resolves names with the Zephyr resolver and the configured servers
+ * instead of the host resolver, so that a local DNS stand-in can be used
+ */
+static int
+prvUseZephyrResolver (void)
+{
+    socket_offload_dns_enable(false);
+    return 0;
+}
+SYS_INIT(prvUseZephyrResolver, APPLICATION, CONFIG_APPLICATION_INIT_PRIORITY);
+#endif
+
+static void prvPressWork(struct k_work *work);
+static K_WORK_DELAYABLE_DEFINE(press_work, prvPressWork);
+
+static void
+prvReleaseWork (struct k_work *work)
+{
+    ARG_UNUSED(work);
+    gpio_emul_input_set(bt0.port, bt0.pin, 0);
+
+    // Schedule the press sending the device back to sleep
+    if (!woken_up)
+    {
+        woken_up = true;
+        if (PLATFORM_NO_PRESS != sleep_after_ms)
+        {
+            k_work_schedule(&press_work, K_MSEC(sleep_after_ms));
+        }
+    }
+}
+static K_WORK_DELAYABLE_DEFINE(release_work, prvReleaseWork);
+
+static void
+prvPressWork (struct k_work *work)
+{
+    ARG_UNUSED(work);
+    LOG_INF("Emulating a button press");
+    gpio_emul_input_set(bt0.port, bt0.pin, 1);
+    k_work_schedule(&release_work, K_MSEC(PLATFORM_PRESS_DURATION_MS));
+}
+
+static int
+prvScheduleWakeUp (void)
+{
+    if (PLATFORM_NO_PRESS != wake_after_ms)
+    {
+        k_work_schedule(&press_work, K_MSEC(wake_after_ms));
+    }
+    return 0;
+}
+SYS_INIT(prvScheduleWakeUp, APPLICATION, CONFIG_APPLICATION_INIT_PRIORITY);
+
+void
+platform_deep_sleep (const struct gpio_dt_spec *wakeup)
+{
+    ARG_UNUSED(wakeup);
+
+    // Waking up from deep sleep is a cold boot, the caller restarts the
+    // process to emulate it
+    LOG_INF("Entering deep sleep NOW, exiting.");
+    prvRetainedTransfer(true);
+    k_msleep(100);
+    posix_exit(0);
+
+    CODE_UNREACHABLE;
+}
+
+bool
+platform_get_device_id (char *id, size_t len)
+{
+    if ((NULL == device_id) || (0 == len))
+    {
+        return false;
+    }
+
+    strncpy(id, device_id, len - 1);
+    id[len - 1] = '\0';
+    return true;
+}
+
+uint64_t
+platform_get_rtc_ms (void)
+{
+    // Host time, which keeps running between runs
+    return native_rtc_gettime_us(RTC_CLOCK_PSEUDOHOSTREALTIME) / 1000;
+}
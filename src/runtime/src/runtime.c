@@ -0,0 +1,107 @@
+/**
+ * @file      runtime.c
+ * @author    Theodore Bardy
+ *
+ * @note      This file is part of Witekio's Zephyr Demo project
+ * @brief     Cooperative event loop running the agents on a single thread
+ */
+
+#include <zephyr/logging/log.h>
+LOG_MODULE_REGISTER(runtime);
+
+#include "runtime.h"
+
+#ifdef CONFIG_APP_RUNTIME_EVENT_LOOP
+
+#include <zephyr/init.h>
+
+#include "prof.h"
+
+static K_THREAD_STACK_DEFINE(runtime_stack, CONFIG_APP_RUNTIME_STACK_SIZE);
+static struct k_work_q runtime_work_q;
+
+static void
+prvDispatch (struct k_work *work)
+{
+    struct runtime_agent *agent
+        = CONTAINER_OF(work, struct runtime_agent, work);
+
+    // Events posted while the handler runs resubmit the work
+    uint32_t events = (uint32_t)atomic_clear(&agent->events);
+    if (0 != events)
+    {
+#ifdef CONFIG_APP_PROFILING
+        uint32_t start = k_cycle_get_32();
+        agent->handler(agent, events);
+        prof_agent_ran(agent, agent->name, agent->posted_cycles, start);
+#else
+        agent->handler(agent, events);
+#endif // CONFIG_APP_PROFILING
+    }
+}
+
+static void
+prvTimerExpired (struct k_timer *timer)
+{
+    struct runtime_agent *agent
+        = CONTAINER_OF(timer, struct runtime_agent, timer);
+
+    runtime_post(agent, agent->timer_events);
+}
+
+void
+runtime_agent_init (struct runtime_agent *agent)
+{
+    atomic_clear(&agent->events);
+    k_work_init(&agent->work, prvDispatch);
+    k_timer_init(&agent->timer, prvTimerExpired, NULL);
+}
+
+void
+runtime_post (struct runtime_agent *agent, uint32_t events)
+{
+#ifdef CONFIG_APP_PROFILING
+    // The latency is measured from the first event posted since the dispatch
+    if (0 == atomic_or(&agent->events, (atomic_val_t)events))
+    {
+        agent->posted_cycles = k_cycle_get_32();
+    }
+#else
+    atomic_or(&agent->events, (atomic_val_t)events);
+#endif // CONFIG_APP_PROFILING
+    k_work_submit_to_queue(&runtime_work_q, &agent->work);
+}
+
+void
+runtime_post_after (struct runtime_agent *agent,
+                    uint32_t              events,
+                    k_timeout_t           delay)
+{
+    k_timer_stop(&agent->timer);
+    agent->timer_events = events;
+    k_timer_start(&agent->timer, delay, K_NO_WAIT);
+}
+
+void
+runtime_cancel (struct runtime_agent *agent)
+{
+    k_timer_stop(&agent->timer);
+}
+
+static int
+prvRuntimeInit (void)
+{
+    const struct k_work_queue_config config = { .name = "runtime" };
+
+    // Started before main() so the agents can be posted to from their init
+    k_work_queue_start(&runtime_work_q,
+                       runtime_stack,
+                       K_THREAD_STACK_SIZEOF(runtime_stack),
+                       CONFIG_APP_RUNTIME_PRIORITY,
+                       &config);
+    LOG_INF("Event loop started");
+    return 0;
+}
+SYS_INIT(prvRuntimeInit, APPLICATION, CONFIG_APPLICATION_INIT_PRIORITY);
+
+#endif // CONFIG_APP_RUNTIME_EVENT_LOOP
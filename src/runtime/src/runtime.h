@@ -0,0 +1,89 @@
+/**
+ * @file      runtime.h
+ * @author    Theodore Bardy
+ *
+ * @note      This file is part of Witekio's Zephyr Demo project
+ * @brief     Cooperative event loop running the agents on a single thread
+ */
+
+#ifndef RUNTIME_H
+#define RUNTIME_H
+
+#include <stdint.h>
+#include <zephyr/kernel.h>
+#include <zephyr/sys/atomic.h>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif // __cplusplus
+
+    struct runtime_agent;
+
+    /**
+     * @brief Agent handler, runs on the event loop and must not block
+     * @param agent The agent
+     * @param events Events posted since the previous call, one bit each
+     */
+    typedef void (*runtime_handler_t)(struct runtime_agent *agent,
+                                      uint32_t              events);
+
+    /**
+     * @brief Agent driven by the event loop, see RUNTIME_AGENT_DEFINE
+     */
+    struct runtime_agent
+    {
+        const char       *name;
+        runtime_handler_t handler;
+        atomic_t          events;
+        struct k_work     work;
+        struct k_timer    timer;
+        uint32_t          timer_events;
+#ifdef CONFIG_APP_PROFILING
+        uint32_t posted_cycles; // First event posted since the dispatch
+#endif // CONFIG_APP_PROFILING
+    };
+
+    /**
+     * @brief Statically defines an agent
+     * @param _name Name of the agent variable
+     * @param _handler Handler called with the posted events
+     */
+#define RUNTIME_AGENT_DEFINE(_name, _handler) \
+    struct runtime_agent _name = { .name = #_name, .handler = (_handler) }
+
+    /**
+     * @brief Initializes an agent, must be called before posting to it
+     * @param agent The agent
+     */
+    void runtime_agent_init(struct runtime_agent *agent);
+
+    /**
+     * @brief Posts events to an agent, can be called from an ISR
+     * @param agent The agent
+     * @param events Events to post, one bit each
+     */
+    void runtime_post(struct runtime_agent *agent, uint32_t events);
+
+    /**
+     * @brief Posts events to an agent after a delay, replacing the pending
+     * delayed events of this agent if any
+     * @param agent The agent
+     * @param events Events to post, one bit each
+     * @param delay Delay before posting
+     */
+    void runtime_post_after(struct runtime_agent *agent,
+                            uint32_t              events,
+                            k_timeout_t           delay);
+
+    /**
+     * @brief Cancels the pending delayed events of an agent
+     * @param agent The agent
+     */
+    void runtime_cancel(struct runtime_agent *agent);
+
+#ifdef __cplusplus
+}
+#endif // __cplusplus
+
+#endif // RUNTIME_H
@@ -0,0 +1,133 @@
+/**
+ * @file      kv_bench.c
+ * @author    Theodore Bardy
+ *
+ * @note      This file is part of Witekio's Zephyr Demo project
+ * @brief     Key-value store benchmark on the simulated flash
+ */
+
+#include <zephyr/logging/log.h>
+LOG_MODULE_REGISTER(kv_bench);
+
+#include "kv_bench.h"
+
+#ifdef CONFIG_APP_KV_BENCHMARK
+
+#include <stdio.h>
+#include <string.h>
+#include <zephyr/kernel.h>
+#include <zephyr/storage/flash_map.h>
+
+#include "kv_store.h"
+
+// A new session token is stored every few wake-ups, as after a reconnection
+#define KV_BENCH_TOKEN_PERIOD (10)
+
+// The benchmark writes to a scratch partition, not to the application store
+#if !FIXED_PARTITION_EXISTS(kv_bench_partition)
+#error The key-value store benchmark requires a kv_bench_partition partition
+#endif
+#define KV_BENCH_PARTITION_ID FIXED_PARTITION_ID(kv_bench_partition)
+
+/**
+ * @brief Erases the scratch partition so that every run starts blank
+ */
+static bool
+prvErase (void)
+{
+    const struct flash_area *fa = NULL;
+
+    int ret = flash_area_open(KV_BENCH_PARTITION_ID, &fa);
+    if (0 == ret)
+    {
+        ret = flash_area_erase(fa, 0, fa->fa_size);
+        flash_area_close(fa);
+    }
+    if (0 != ret)
+    {
+        LOG_ERR("Failed to erase the benchmark partition (%d)", ret);
+        return false;
+    }
+    return true;
+}
+
+/**
+ * @brief Simulates the wake-ups on the store opened on the scratch partition
+ */
+static void
+prvRun (void)
+{
+    struct kv_store_stats stats;
+    uint32_t              total_ops = 0;
+    char                  token[96];
+
+    for (uint32_t wake = 0; wake < CONFIG_APP_KV_BENCHMARK_WAKES; wake++)
+    {
+        // Each wake-up updates a counter, a timestamp and sometimes a token
+        int64_t uptime = k_uptime_get();
+        if (!kv_store_set("bench/wakes", &wake, sizeof(wake))
+            || !kv_store_set("bench/last_wake", &uptime, sizeof(uptime)))
+        {
+            return;
+        }
+        if (0 == (wake % KV_BENCH_TOKEN_PERIOD))
+        {
+            // Sized as a short JWT claim, padded so every token is as long
+            memset(token, 'x', sizeof(token));
+            int len = snprintf(token, sizeof(token), "token-%08x", wake);
+            token[len] = '.';
+            if (!kv_store_set("bench/token", token, sizeof(token)))
+            {
+                return;
+            }
+        }
+        if (!kv_store_commit())
+        {
+            return;
+        }
+        kv_store_get_stats(&stats);
+        total_ops += stats.commit_last_ops;
+    }
+
+    kv_store_get_stats(&stats);
+    // Fixed format, parsed by scripts/ota_benchmark.py
+    LOG_INF("BENCH kv_write_amplification_x100 %u",
+            (0 != stats.user_bytes)
+                ? (uint32_t)((uint64_t)stats.flash_bytes * 100
+                             / stats.user_bytes)
+                : 0);
+    // The simulated flash answers at the speed of the host, durations would
+    // say nothing of a board, the flash operations are counted instead
+    LOG_INF("BENCH kv_commit_avg_ops_x100 %u",
+            (uint32_t)((uint64_t)total_ops * 100 / stats.commits));
+    LOG_INF("BENCH kv_commit_max_ops %u", stats.commit_max_ops);
+    LOG_INF("BENCH kv_erases %u", stats.erases);
+    // Rewriting the values in place erases a sector for each updated key
+    LOG_INF("BENCH kv_inplace_erases %u",
+            CONFIG_APP_KV_BENCHMARK_WAKES * 2
+                + DIV_ROUND_UP(CONFIG_APP_KV_BENCHMARK_WAKES,
+                               KV_BENCH_TOKEN_PERIOD));
+
+    // Boot scan of a store which went through many compactions
+    if (kv_store_open(KV_BENCH_PARTITION_ID))
+    {
+        kv_store_get_stats(&stats);
+        LOG_INF("BENCH kv_index_build_ops %u", stats.index_build_ops);
+    }
+}
+
+void
+kv_bench_run (void)
+{
+    // The statistics of a store opened on the scratch partition only cover
+    // the benchmark
+    if (prvErase() && kv_store_open(KV_BENCH_PARTITION_ID))
+    {
+        prvRun();
+    }
+
+    // Back to the application store
+    kv_store_init();
+}
+
+#endif // CONFIG_APP_KV_BENCHMARK
@@ -0,0 +1,28 @@
+/**
+ * @file      kv_bench.h
+ * @author    Theodore Bardy
+ *
+ * @note      This file is part of Witekio's Zephyr Demo project
+ * @brief     Key-value store benchmark on the simulated flash
+ */
+
+#ifndef KV_BENCH_H
+#define KV_BENCH_H
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif // __cplusplus
+
+    /**
+     * @brief Simulates the writes of CONFIG_APP_KV_BENCHMARK_WAKES wake-ups
+     * and logs the write amplification, the commit latency, the erases and
+     * the index build time
+     */
+    void kv_bench_run(void);
+
+#ifdef __cplusplus
+}
+#endif // __cplusplus
+
+#endif // KV_BENCH_H
@@ -0,0 +1,734 @@
+/**
+ * @file      kv_store.c
+ * @author    Theodore Bardy
+ *
+ * @note      This file is part of Witekio's Zephyr Demo project
+ * @brief     Log-structured key-value store for frequently written state
+ */
+
+#include <zephyr/logging/log.h>
+LOG_MODULE_REGISTER(kv_store);
+
+#include "kv_store.h"
+
+#ifdef CONFIG_APP_KV_STORE
+
+#include <errno.h>
+#include <string.h>
+#include <zephyr/kernel.h>
+#include <zephyr/storage/flash_map.h>
+#include <zephyr/sys/byteorder.h>
+#include <zephyr/sys/crc.h>
+#include <zephyr/sys/util.h>
+
+/*
+ * The partition is split in sectors used round-robin, each starting with a
+ * header holding a sequence number so the oldest one is known at boot.
+ * Records are only ever appended:
+ *
+ *   | type | key_len | value_len (LE16) | crc32 (LE32) | key | value | pad |
+ *
+ * A value is updated by appending a new record and deleted by appending a
+ * record of type KV_RECORD_DELETE. One sector is always kept erased: when
+ * the write position moves to it, the records of the oldest sector which are
+ * still current are copied forward and the oldest sector is erased.
+ */
+#define KV_PARTITION_ID    FIXED_PARTITION_ID(app_kv_partition)
+#define KV_SECTOR_MAGIC    (0x3153564BU) // "KVS1"
+#define KV_RECORD_PUT      (0x50)
+#define KV_RECORD_DELETE   (0x44)
+#define KV_RECORD_HDR_SIZE (8)
+#define KV_RECORD_MAX_SIZE                                 \
+    (KV_RECORD_HDR_SIZE + CONFIG_APP_KV_MAX_KEY_LEN       \
+     + CONFIG_APP_KV_MAX_VALUE_LEN + KV_WRITE_BLOCK_MAX)
+// Largest write block size supported, records are padded to the actual one
+#define KV_WRITE_BLOCK_MAX (32)
+#define KV_MAX_SECTORS     (32)
+
+BUILD_ASSERT(CONFIG_APP_KV_BATCH_SIZE >= KV_RECORD_MAX_SIZE,
+             "The batch must hold at least one record of the maximum size");
+
+struct kv_sector_header
+{
+    uint32_t magic;
+    uint32_t seq;
+};
+
+// Sector header padded to the largest write block
+#define KV_SECTOR_HDR_MAX_SIZE \
+    (ROUND_UP(sizeof(struct kv_sector_header), KV_WRITE_BLOCK_MAX))
+
+BUILD_ASSERT(CONFIG_APP_KV_SECTOR_SIZE
+                 > KV_SECTOR_HDR_MAX_SIZE + KV_RECORD_MAX_SIZE,
+             "A sector must hold its header and a record of the maximum size");
+
+struct kv_index_entry
+{
+    uint32_t hash;
+    uint32_t offset; // Offset of the record in the partition
+    uint16_t value_len;
+};
+
+static const struct flash_area *fa = NULL;
+static struct k_mutex           lock;
+static size_t                   sector_count;
+static size_t                   write_block;
+static size_t                   sector_hdr_size;
+static uint32_t                 write_sector;
+static size_t                   write_offset;
+static uint32_t                 last_seq;
+
+static struct kv_index_entry index_entries[CONFIG_APP_KV_MAX_KEYS];
+static size_t                index_count;
+
+static uint8_t batch[CONFIG_APP_KV_BATCH_SIZE];
+static size_t  batch_len;
+// Keys the staged records add to the index, reserved in it
+static size_t batch_new_keys;
+static uint8_t scratch[KV_RECORD_MAX_SIZE];
+
+static struct kv_store_stats stats;
+
+static inline size_t
+prvSectorStart (uint32_t sector)
+{
+    return (size_t)sector * CONFIG_APP_KV_SECTOR_SIZE;
+}
+
+static inline size_t
+prvRecordSize (size_t key_len, size_t value_len)
+{
+    return ROUND_UP(KV_RECORD_HDR_SIZE + key_len + value_len, write_block);
+}
+
+static uint32_t
+prvHash (const char *key, size_t len)
+{
+    // FNV-1a
+    uint32_t hash = 2166136261U;
+    for (size_t i = 0; i < len; i++)
+    {
+        hash = (hash ^ (uint8_t)key[i]) * 16777619U;
+    }
+    return hash;
+}
+
+static uint32_t
+prvRecordCrc (const uint8_t *record)
+{
+    size_t len = record[1] + sys_get_le16(&record[2]);
+    uint32_t crc = crc32_ieee(record, 4);
+    return crc32_ieee_update(crc, &record[KV_RECORD_HDR_SIZE], len);
+}
+
+/**
+ * @brief Serializes a record, returns its padded size
+ */
+static size_t
+prvRecordEncode (uint8_t    *out,
+                 uint8_t     type,
+                 const char *key,
+                 size_t      key_len,
+                 const void *value,
+                 size_t      value_len)
+{
+    size_t size = prvRecordSize(key_len, value_len);
+
+    out[0] = type;
+    out[1] = (uint8_t)key_len;
+    sys_put_le16((uint16_t)value_len, &out[2]);
+    memcpy(&out[KV_RECORD_HDR_SIZE], key, key_len);
+    if (0 != value_len)
+    {
+        memcpy(&out[KV_RECORD_HDR_SIZE + key_len], value, value_len);
+    }
+    memset(&out[KV_RECORD_HDR_SIZE + key_len + value_len],
+           0xFF,
+           size - (KV_RECORD_HDR_SIZE + key_len + value_len));
+    sys_put_le32(prvRecordCrc(out), &out[4]);
+    return size;
+}
+
+static bool
+prvRead (size_t offset, void *data, size_t len)
+{
+    stats.flash_ops++;
+    return (0 == flash_area_read(fa, offset, data, len));
+}
+
+/**
+ * @brief Reads and checks the record at an offset of the partition
+ * @return Size of the record, 0 at the end of the records or if corrupted
+ */
+static size_t
+prvRecordRead (size_t offset, size_t limit)
+{
+    if ((offset + KV_RECORD_HDR_SIZE > limit)
+        || !prvRead(offset, scratch, KV_RECORD_HDR_SIZE))
+    {
+        return 0;
+    }
+    if ((KV_RECORD_PUT != scratch[0]) && (KV_RECORD_DELETE != scratch[0]))
+    {
+        return 0;
+    }
+
+    size_t key_len   = scratch[1];
+    size_t value_len = sys_get_le16(&scratch[2]);
+    size_t size      = prvRecordSize(key_len, value_len);
+    if ((key_len > CONFIG_APP_KV_MAX_KEY_LEN)
+        || (value_len > CONFIG_APP_KV_MAX_VALUE_LEN) || (offset + size > limit)
+        || !prvRead(offset + KV_RECORD_HDR_SIZE,
+                    &scratch[KV_RECORD_HDR_SIZE],
+                    size - KV_RECORD_HDR_SIZE)
+        || (sys_get_le32(&scratch[4]) != prvRecordCrc(scratch)))
+    {
+        return 0;
+    }
+    return size;
+}
+
+static struct kv_index_entry *
+prvIndexFind (const char *key, size_t key_len, uint32_t hash)
+{
+    for (size_t i = 0; i < index_count; i++)
+    {
+        struct kv_index_entry *entry = &index_entries[i];
+        if (entry->hash != hash)
+        {
+            continue;
+        }
+        // Compare the key itself, hashes may collide
+        uint8_t header[KV_RECORD_HDR_SIZE];
+        char    stored[CONFIG_APP_KV_MAX_KEY_LEN];
+        if (prvRead(entry->offset, header, sizeof(header))
+            && (header[1] == key_len)
+            && prvRead(entry->offset + KV_RECORD_HDR_SIZE, stored, key_len)
+            && (0 == memcmp(stored, key, key_len)))
+        {
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief Applies the record found in scratch, written at offset, to the index
+ */
+static void
+prvIndexApply (size_t offset)
+{
+    const char *key     = (const char *)&scratch[KV_RECORD_HDR_SIZE];
+    size_t      key_len = scratch[1];
+    uint32_t    hash    = prvHash(key, key_len);
+
+    struct kv_index_entry *entry = prvIndexFind(key, key_len, hash);
+    if (KV_RECORD_DELETE == scratch[0])
+    {
+        if (NULL != entry)
+        {
+            *entry = index_entries[--index_count];
+        }
+        return;
+    }
+
+    if (NULL == entry)
+    {
+        if (index_count >= ARRAY_SIZE(index_entries))
+        {
+            // New keys are rejected when staged, unless the partition was
+            // written with a larger CONFIG_APP_KV_MAX_KEYS
+            LOG_ERR("Index full, %.*s is ignored", (int)key_len, key);
+            return;
+        }
+        entry = &index_entries[index_count++];
+    }
+    entry->hash      = hash;
+    entry->offset    = (uint32_t)offset;
+    entry->value_len = sys_get_le16(&scratch[2]);
+}
+
+static bool
+prvSectorHeaderRead (uint32_t sector, struct kv_sector_header *header)
+{
+    return prvRead(prvSectorStart(sector), header, sizeof(*header))
+           && (KV_SECTOR_MAGIC == header->magic);
+}
+
+static bool
+prvSectorErase (uint32_t sector)
+{
+    stats.flash_ops++;
+    if (0
+        != flash_area_erase(
+            fa, prvSectorStart(sector), CONFIG_APP_KV_SECTOR_SIZE))
+    {
+        LOG_ERR("Failed to erase sector %u", sector);
+        return false;
+    }
+    stats.erases++;
+    return true;
+}
+
+static bool
+prvSectorIsErased (uint32_t sector)
+{
+    uint8_t erased = flash_area_erased_val(fa);
+
+    for (size_t offset = 0; offset < CONFIG_APP_KV_SECTOR_SIZE;
+         offset += sizeof(scratch))
+    {
+        size_t len = MIN(sizeof(scratch), CONFIG_APP_KV_SECTOR_SIZE - offset);
+        if (!prvRead(prvSectorStart(sector) + offset, scratch, len))
+        {
+            return false;
+        }
+        for (size_t i = 0; i < len; i++)
+        {
+            if (erased != scratch[i])
+            {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+static bool
+prvWrite (size_t offset, const void *data, size_t len)
+{
+    stats.flash_ops++;
+    if (0 != flash_area_write(fa, offset, data, len))
+    {
+        LOG_ERR("Failed to write %zu bytes at 0x%zx", len, offset);
+        return false;
+    }
+    stats.flash_bytes += len;
+    return true;
+}
+
+/**
+ * @brief Scans the records of a sector into the index
+ * @return Offset following the last valid record
+ */
+static size_t
+prvSectorScan (uint32_t sector)
+{
+    size_t limit  = prvSectorStart(sector) + CONFIG_APP_KV_SECTOR_SIZE;
+    size_t offset = prvSectorStart(sector) + sector_hdr_size;
+    size_t size;
+
+    while (0 != (size = prvRecordRead(offset, limit)))
+    {
+        prvIndexApply(offset);
+        offset += size;
+    }
+
+    // A torn record is not erased, do not append after it
+    if ((offset + KV_RECORD_HDR_SIZE <= limit)
+        && prvRead(offset, scratch, 1)
+        && (flash_area_erased_val(fa) != scratch[0]))
+    {
+        LOG_WRN("Corrupted record in sector %u at 0x%zx", sector, offset);
+        offset = limit;
+    }
+    return offset;
+}
+
+/**
+ * @brief Copies the current records of a sector to the write position and
+ * erases the sector
+ */
+static bool
+prvSectorCompact (uint32_t sector)
+{
+    size_t start = prvSectorStart(sector);
+
+    for (size_t i = 0; i < index_count; i++)
+    {
+        struct kv_index_entry *entry = &index_entries[i];
+        if ((entry->offset < start)
+            || (entry->offset >= start + CONFIG_APP_KV_SECTOR_SIZE))
+        {
+            continue;
+        }
+
+        size_t size
+            = prvRecordRead(entry->offset, start + CONFIG_APP_KV_SECTOR_SIZE);
+        if ((0 == size) || !prvWrite(write_offset, scratch, size))
+        {
+            return false;
+        }
+        entry->offset = (uint32_t)write_offset;
+        write_offset += size;
+    }
+
+    stats.compactions++;
+    return prvSectorErase(sector);
+}
+
+/**
+ * @brief Moves the write position to the next sector, compacting the oldest
+ * one so that a sector is always kept erased
+ */
+static bool
+prvSectorAdvance (void)
+{
+    uint32_t next = (write_sector + 1) % sector_count;
+    if (!prvSectorIsErased(next) && !prvSectorErase(next))
+    {
+        return false;
+    }
+
+    struct kv_sector_header header = { .magic = KV_SECTOR_MAGIC,
+                                       .seq   = ++last_seq };
+    uint8_t                 raw[KV_WRITE_BLOCK_MAX];
+    memset(raw, 0xFF, sizeof(raw));
+    memcpy(raw, &header, sizeof(header));
+    if (!prvWrite(prvSectorStart(next), raw, sector_hdr_size))
+    {
+        return false;
+    }
+    write_sector = next;
+    write_offset = prvSectorStart(next) + sector_hdr_size;
+
+    struct kv_sector_header oldest;
+    uint32_t                victim = (next + 1) % sector_count;
+    if (prvSectorHeaderRead(victim, &oldest))
+    {
+        return prvSectorCompact(victim);
+    }
+    return true;
+}
+
+/**
+ * @brief Looks a key up in the staged records, the last one wins
+ * @return Offset of the record in the batch, -1 if not staged
+ */
+static ssize_t
+prvBatchFind (const char *key, size_t key_len)
+{
+    ssize_t found = -1;
+
+    for (size_t offset = 0; offset < batch_len;)
+    {
+        const uint8_t *record = &batch[offset];
+        if ((record[1] == key_len)
+            && (0 == memcmp(&record[KV_RECORD_HDR_SIZE], key, key_len)))
+        {
+            found = (ssize_t)offset;
+        }
+        offset += prvRecordSize(record[1], sys_get_le16(&record[2]));
+    }
+    return found;
+}
+
+/**
+ * @brief Checks if a key has a value, staged or in flash
+ */
+static bool
+prvKeyExists (const char *key, size_t key_len)
+{
+    ssize_t staged = prvBatchFind(key, key_len);
+    if (staged >= 0)
+    {
+        return (KV_RECORD_PUT == batch[staged]);
+    }
+    return (NULL != prvIndexFind(key, key_len, prvHash(key, key_len)));
+}
+
+static bool
+prvStage (uint8_t type, const char *key, const void *value, size_t len)
+{
+    size_t key_len = strlen(key);
+    if ((0 == key_len) || (key_len > CONFIG_APP_KV_MAX_KEY_LEN)
+        || (len > CONFIG_APP_KV_MAX_VALUE_LEN))
+    {
+        LOG_ERR("Invalid key or value length");
+        return false;
+    }
+    if (NULL == fa)
+    {
+        LOG_ERR("Store is not initialized");
+        return false;
+    }
+
+    bool ret = true;
+    k_mutex_lock(&lock, K_FOREVER);
+    if (prvRecordSize(key_len, len) > sizeof(batch) - batch_len)
+    {
+        // The batch is full, write it before staging more. The mutex is
+        // recursive and kept so that no other record is staged meanwhile
+        ret = kv_store_commit();
+    }
+
+    bool exists = ret && prvKeyExists(key, key_len);
+    if (ret && (KV_RECORD_PUT == type) && !exists)
+    {
+        // The index must have room for the key once committed
+        if (index_count + batch_new_keys >= ARRAY_SIZE(index_entries))
+        {
+            LOG_ERR("Index full, %s is rejected", key);
+            ret = false;
+        }
+        else
+        {
+            batch_new_keys++;
+        }
+    }
+    else if (ret && (KV_RECORD_DELETE == type) && exists
+             && (NULL == prvIndexFind(key, key_len, prvHash(key, key_len))))
+    {
+        // Deleting a key added by the batch gives its room back
+        batch_new_keys--;
+    }
+
+    if (ret)
+    {
+        batch_len += prvRecordEncode(
+            &batch[batch_len], type, key, key_len, value, len);
+        stats.user_bytes += key_len + len;
+    }
+    k_mutex_unlock(&lock);
+    return ret;
+}
+
+bool
+kv_store_init (void)
+{
+    return kv_store_open(KV_PARTITION_ID);
+}
+
+bool
+kv_store_open (uint8_t partition_id)
+{
+    uint32_t start = k_cycle_get_32();
+
+    k_mutex_init(&lock);
+    memset(&stats, 0, sizeof(stats));
+    index_count    = 0;
+    batch_len      = 0;
+    batch_new_keys = 0;
+
+    if ((NULL != fa) && (partition_id != fa->fa_id))
+    {
+        flash_area_close(fa);
+        fa = NULL;
+    }
+    if ((NULL == fa) && (0 != flash_area_open(partition_id, &fa)))
+    {
+        LOG_ERR("Failed to open the storage partition");
+        fa = NULL;
+        return false;
+    }
+    write_block     = MAX(flash_area_align(fa), 1);
+    sector_hdr_size = ROUND_UP(sizeof(struct kv_sector_header), write_block);
+    sector_count    = fa->fa_size / CONFIG_APP_KV_SECTOR_SIZE;
+    if ((sector_count < 2) || (sector_count > KV_MAX_SECTORS)
+        || (write_block > KV_WRITE_BLOCK_MAX))
+    {
+        LOG_ERR("Unsupported partition geometry");
+        return false;
+    }
+
+    // Sort the used sectors from the oldest to the newest
+    uint32_t order[KV_MAX_SECTORS];
+    uint32_t seqs[KV_MAX_SECTORS];
+    size_t   used = 0;
+    for (uint32_t sector = 0; sector < sector_count; sector++)
+    {
+        struct kv_sector_header header;
+        if (!prvSectorHeaderRead(sector, &header))
+        {
+            continue;
+        }
+        size_t i = used++;
+        while ((i > 0) && (seqs[i - 1] > header.seq))
+        {
+            order[i] = order[i - 1];
+            seqs[i]  = seqs[i - 1];
+            i--;
+        }
+        order[i] = sector;
+        seqs[i]  = header.seq;
+    }
+
+    if (0 == used)
+    {
+        // Blank partition, start on the last sector so that writes start on
+        // the first one
+        LOG_INF("Formatting the storage partition");
+        last_seq     = 0;
+        write_sector = sector_count - 1;
+        if (!prvSectorAdvance())
+        {
+            return false;
+        }
+    }
+    else
+    {
+        for (size_t i = 0; i < used; i++)
+        {
+            write_offset = prvSectorScan(order[i]);
+        }
+        write_sector = order[used - 1];
+        last_seq     = seqs[used - 1];
+
+        // A compaction was interrupted, resume it
+        uint32_t next = (write_sector + 1) % sector_count;
+        if (!prvSectorIsErased(next))
+        {
+            struct kv_sector_header header;
+            if (prvSectorHeaderRead(next, &header)
+                    ? !prvSectorCompact(next)
+                    : !prvSectorErase(next))
+            {
+                return false;
+            }
+        }
+    }
+
+    stats.keys            = (uint16_t)index_count;
+    stats.index_build_us  = k_cyc_to_us_floor32(k_cycle_get_32() - start);
+    stats.index_build_ops = stats.flash_ops;
+    // Formatting and resumed compactions are not application writes
+    stats.flash_bytes = 0;
+    stats.flash_ops   = 0;
+    stats.erases      = 0;
+    stats.compactions = 0;
+    LOG_INF("%u keys in %zu sectors, index built in %u us (%u flash ops)",
+            stats.keys,
+            used,
+            stats.index_build_us,
+            stats.index_build_ops);
+    return true;
+}
+
+bool
+kv_store_set (const char *key, const void *value, size_t len)
+{
+    return prvStage(KV_RECORD_PUT, key, value, len);
+}
+
+bool
+kv_store_delete (const char *key)
+{
+    return prvStage(KV_RECORD_DELETE, key, NULL, 0);
+}
+
+bool
+kv_store_commit (void)
+{
+    bool     ret   = true;
+    uint32_t start = k_cycle_get_32();
+
+    k_mutex_lock(&lock, K_FOREVER);
+    uint32_t ops = stats.flash_ops;
+    if (0 == batch_len)
+    {
+        goto END;
+    }
+
+    size_t done = 0;
+    while (ret && (done < batch_len))
+    {
+        // Write as many records as fit in the sector with a single write
+        size_t limit
+            = prvSectorStart(write_sector) + CONFIG_APP_KV_SECTOR_SIZE;
+        size_t len = 0;
+        while (done + len < batch_len)
+        {
+            const uint8_t *record = &batch[done + len];
+            size_t size = prvRecordSize(record[1], sys_get_le16(&record[2]));
+            if (write_offset + len + size > limit)
+            {
+                break;
+            }
+            len += size;
+        }
+
+        if (0 == len)
+        {
+            ret = prvSectorAdvance();
+            continue;
+        }
+
+        ret = prvWrite(write_offset, &batch[done], len);
+        for (size_t offset = 0; ret && (offset < len);)
+        {
+            const uint8_t *record = &batch[done + offset];
+            memcpy(scratch, record, KV_RECORD_HDR_SIZE + record[1]);
+            prvIndexApply(write_offset + offset);
+            offset += prvRecordSize(record[1], sys_get_le16(&record[2]));
+        }
+        write_offset += len;
+        done += len;
+    }
+
+    batch_len      = 0;
+    batch_new_keys = 0;
+    stats.commits++;
+    stats.keys           = (uint16_t)index_count;
+    stats.commit_last_us  = k_cyc_to_us_floor32(k_cycle_get_32() - start);
+    stats.commit_max_us   = MAX(stats.commit_max_us, stats.commit_last_us);
+    stats.commit_last_ops = stats.flash_ops - ops;
+    stats.commit_max_ops  = MAX(stats.commit_max_ops, stats.commit_last_ops);
+
+END:
+    k_mutex_unlock(&lock);
+    return ret;
+}
+
+ssize_t
+kv_store_get (const char *key, void *value, size_t len)
+{
+    size_t  key_len = strlen(key);
+    ssize_t ret     = -ENOENT;
+
+    if (NULL == fa)
+    {
+        return -ENODEV;
+    }
+
+    k_mutex_lock(&lock, K_FOREVER);
+    ssize_t staged = prvBatchFind(key, key_len);
+    if (staged >= 0)
+    {
+        const uint8_t *record = &batch[staged];
+        if (KV_RECORD_PUT == record[0])
+        {
+            ret = sys_get_le16(&record[2]);
+            memcpy(value,
+                   &record[KV_RECORD_HDR_SIZE + key_len],
+                   MIN(len, (size_t)ret));
+        }
+        goto END;
+    }
+
+    struct kv_index_entry *entry
+        = prvIndexFind(key, key_len, prvHash(key, key_len));
+    if (NULL != entry)
+    {
+        ret = entry->value_len;
+        if (!prvRead(entry->offset + KV_RECORD_HDR_SIZE + key_len,
+                     value,
+                     MIN(len, (size_t)ret)))
+        {
+            ret = -EIO;
+        }
+    }
+
+END:
+    k_mutex_unlock(&lock);
+    return ret;
+}
+
+void
+kv_store_get_stats (struct kv_store_stats *out)
+{
+    k_mutex_lock(&lock, K_FOREVER);
+    *out = stats;
+    k_mutex_unlock(&lock);
+}
+
+#endif // CONFIG_APP_KV_STORE
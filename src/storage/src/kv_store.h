@@ -0,0 +1,100 @@
+/**
+ * @file      kv_store.h
+ * @author    Theodore Bardy
+ *
+ * @note      This file is part of Witekio's Zephyr Demo project
+ * @brief     Log-structured key-value store for frequently written state
+ */
+
+#ifndef KV_STORE_H
+#define KV_STORE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif // __cplusplus
+
+    /**
+     * @brief Store statistics since kv_store_init()
+     */
+    struct kv_store_stats
+    {
+        uint32_t user_bytes;      // Key and value bytes set by the application
+        uint32_t flash_bytes;     // Bytes written to flash, copies included
+        uint32_t commits;         // Commits which wrote to flash
+        uint32_t erases;          // Sector erases
+        uint32_t compactions;     // Sectors compacted before being erased
+        uint32_t flash_ops;       // Flash reads, writes and erases
+        uint32_t index_build_us;  // Duration of the boot scan
+        uint32_t index_build_ops; // Flash operations of the boot scan
+        uint32_t commit_last_us;  // Duration of the last commit
+        uint32_t commit_max_us;   // Duration of the slowest commit
+        uint32_t commit_last_ops; // Flash operations of the last commit
+        uint32_t commit_max_ops;  // Flash operations of the heaviest commit
+        uint16_t keys;            // Keys in the index
+    };
+
+    /**
+     * @brief Opens the store and builds the index from the records in flash,
+     * can be called again to reopen it
+     * @return true if the store is ready, false otherwise
+     */
+    bool kv_store_init(void);
+
+    /**
+     * @brief Opens the store on another partition than app-kv, e.g. a scratch
+     * one for tests, kv_store_init() opens app-kv again
+     * @param partition_id Partition, see FIXED_PARTITION_ID()
+     * @return true if the store is ready, false otherwise
+     */
+    bool kv_store_open(uint8_t partition_id);
+
+    /**
+     * @brief Stages a value, written to flash by the next commit
+     * @param key Key, at most CONFIG_APP_KV_MAX_KEY_LEN characters
+     * @param value Value
+     * @param len Length of the value, at most CONFIG_APP_KV_MAX_VALUE_LEN
+     * @return true if the value was staged, false otherwise, e.g. for a new
+     * key when CONFIG_APP_KV_MAX_KEYS keys exist
+     */
+    bool kv_store_set(const char *key, const void *value, size_t len);
+
+    /**
+     * @brief Stages the deletion of a key, written to flash by the next commit
+     * @param key Key
+     * @return true if the deletion was staged, false otherwise
+     */
+    bool kv_store_delete(const char *key);
+
+    /**
+     * @brief Writes the staged changes to flash at once
+     * @return true if all changes were written, false otherwise
+     */
+    bool kv_store_commit(void);
+
+    /**
+     * @brief Reads a value, staged changes included
+     * @param key Key
+     * @param value Buffer receiving the value
+     * @param len Size of the buffer
+     * @return Length of the value, -ENOENT if the key does not exist or
+     * another negative error code
+     */
+    ssize_t kv_store_get(const char *key, void *value, size_t len);
+
+    /**
+     * @brief Gets the store statistics
+     * @param stats Statistics
+     */
+    void kv_store_get_stats(struct kv_store_stats *stats);
+
+#ifdef __cplusplus
+}
+#endif // __cplusplus
+
+#endif // KV_STORE_H
@@ -25,7 +25,7 @@ LOG_MODULE_REGISTER(ui_led);
 
 static struct led_rgb             pixels[STRIP_NUM_PIXELS];
 static const struct device *const led_interface = DEVICE_DT_GET(STRIP_NODE);
-#endif // CONFIG_LED_STRIP
+static ui_led_tone_t              current_tone  = UI_LED_COLOR_OFF;
 
 #define RGB(_r, _g, _b)                 \
     {                                   \
@@ -44,15 +44,21 @@ static const struct led_rgb colors[] = {
     RGB(0x80, 0x00, 0x80), /* purple */
     RGB(0xFF, 0x00, 0xFF), /* magenta */
 };
+#endif // CONFIG_LED_STRIP
 
 bool
 ui_led_init(void) {
+#ifdef CONFIG_LED_STRIP
     if (!device_is_ready(led_interface))
     {
         LOG_ERR("LED interface is not ready");
         return false;
     }
     return true;
+#else // CONFIG_LED_STRIP
+    LOG_WRN("LED strip support is not enabled");
+    return false;
+#endif // CONFIG_LED_STRIP
 }
 
 bool ui_led_set(ui_led_tone_t tone)
@@ -75,9 +81,19 @@ bool ui_led_set(ui_led_tone_t tone)
         return false;
     }
 
+    current_tone = tone;
     return true;
 #else // CONFIG_LED_STRIP
     LOG_WRN("LED strip support is not enabled");
     return false;
 #endif // CONFIG_LED_STRIP
 }
+
+ui_led_tone_t ui_led_get(void)
+{
+#ifdef CONFIG_LED_STRIP
+    return current_tone;
+#else // CONFIG_LED_STRIP
+    return UI_LED_COLOR_OFF;
+#endif // CONFIG_LED_STRIP
+}
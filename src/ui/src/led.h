@@ -21,7 +21,6 @@ extern "C"
     {
         UI_LED_COLOR_OFF,
         UI_LED_COLOR_ON,
-#ifdef CONFIG_LED_STRIP
         UI_LED_COLOR_RED,
         UI_LED_COLOR_ORANGE,
         UI_LED_COLOR_YELLOW,
@@ -31,7 +30,6 @@ extern "C"
         UI_LED_COLOR_PURPLE,
         UI_LED_COLOR_MAGENTA,
         UI_LED_COLOR_COUNT
-#endif // CONFIG_LED_STRIP
     } ui_led_tone_t;
 
     /**
@@ -47,6 +45,12 @@ extern "C"
      */
     bool ui_led_set(ui_led_tone_t tone);
 
+    /**
+     * @brief Gets the LED
+     * @return The tone last set successfully, UI_LED_COLOR_OFF initially
+     */
+    ui_led_tone_t ui_led_get(void);
+
 #ifdef __cplusplus
 }
 #endif // __cplusplus
@@ -0,0 +1,118 @@
+/**
+ * @file      main.c
+ * @author    Theodore Bardy
+ *
+ * @note      This file is part of Witekio's Zephyr Demo project
+ * @brief     Post-update health check tests with a failing step
+ */
+
+#include <string.h>
+#include <zephyr/kernel.h>
+#include <zephyr/settings/settings.h>
+#include <zephyr/sys/reboot.h>
+#include <zephyr/ztest.h>
+
+#include "health_check.h"
+#include "wifi_agent.h"
+
+// Step expected to fail, the server does not answer unless the failure of
+// another step is simulated
+#if 0 != CONFIG_APP_HEALTH_CHECK_FAIL_STEP
+#define FAILED_STEP (CONFIG_APP_HEALTH_CHECK_FAIL_STEP)
+#else
+#define FAILED_STEP (HEALTH_CHECK_STEP_SERVER)
+#endif
+// Time budget with a margin for the reboot
+#define CHECK_TIMEOUT_MS (CONFIG_APP_HEALTH_CHECK_TIMEOUT_MS + 1000)
+
+static K_THREAD_STACK_DEFINE(check_stack, 4096);
+static struct k_thread check_thread;
+static K_SEM_DEFINE(rebooted, 0, 1);
+static int                   reboot_type = -1;
+static health_check_report_t persisted;
+
+bool
+wifi_agent_connect (void)
+{
+    return true;
+}
+
+bool
+wifi_agent_has_address (size_t delay_ms)
+{
+    ARG_UNUSED(delay_ms);
+    return true;
+}
+
+FUNC_NORETURN void
+sys_reboot (int type)
+{
+    // The check runs on its own thread, which ends here as on a reboot
+    reboot_type = type;
+    k_sem_give(&rebooted);
+    k_thread_abort(k_current_get());
+    CODE_UNREACHABLE;
+}
+
+static void
+prvCheckThread (void *arg1, void *arg2, void *arg3)
+{
+    ARG_UNUSED(arg1);
+    ARG_UNUSED(arg2);
+    ARG_UNUSED(arg3);
+    health_check_run();
+}
+
+static int
+prvLoadReport (const char     *key,
+               size_t          len,
+               settings_read_cb read_cb,
+               void           *cb_arg,
+               void           *param)
+{
+    ARG_UNUSED(param);
+
+    if ((NULL == key) || (0 != strcmp(key, "report"))
+        || (sizeof(persisted) != len))
+    {
+        return 0;
+    }
+    return (read_cb(cb_arg, &persisted, sizeof(persisted)) < 0) ? -EIO : 0;
+}
+
+ZTEST(health_check, test_failed_step_rolls_back)
+{
+    const health_check_report_t *report = health_check_get_report();
+
+    k_thread_create(&check_thread,
+                    check_stack,
+                    K_THREAD_STACK_SIZEOF(check_stack),
+                    prvCheckThread,
+                    NULL,
+                    NULL,
+                    NULL,
+                    K_PRIO_PREEMPT(1),
+                    0,
+                    K_NO_WAIT);
+    zassert_ok(k_sem_take(&rebooted, K_MSEC(CHECK_TIMEOUT_MS)));
+    zassert_equal(reboot_type, SYS_REBOOT_COLD);
+
+    // The image is not confirmed, MCUboot reverts it on the reboot
+    zassert_false(health_check_confirmed_this_boot());
+    zassert_equal(report->result, HEALTH_CHECK_RESULT_FAILED);
+    zassert_equal(report->failed_step, FAILED_STEP);
+    zassert_true(report->duration_ms < CONFIG_APP_HEALTH_CHECK_TIMEOUT_MS);
+
+    // Persisted for the inventory of the previous image
+    zassert_ok(settings_load_subtree_direct("health", prvLoadReport, NULL));
+    zassert_mem_equal(&persisted, report, sizeof(persisted));
+}
+
+static void *
+prvSetup (void)
+{
+    zassert_true(health_check_init());
+    return NULL;
+}
+
+ZTEST_SUITE(health_check, NULL, prvSetup, NULL, NULL, NULL);
@@ -0,0 +1,164 @@
+/**
+ * @file      main.c
+ * @author    Theodore Bardy
+ *
+ * @note      This file is part of Witekio's Zephyr Demo project
+ * @brief     Streaming image update module tests on the flash simulator
+ */
+
+#include <string.h>
+#include <zephyr/kernel.h>
+#include <zephyr/sys/byteorder.h>
+#include <zephyr/ztest.h>
+
+#include <mbedtls/sha256.h>
+
+#include <mender/update-module.h>
+
+#include "ota_image.h"
+
+// MCUboot image with a SHA256 TLV, see bootutil/image.h in the MCUboot
+// sources
+#define IMAGE_MAGIC          (0x96f3b83dU)
+#define IMAGE_HEADER_SIZE    (32)
+#define IMAGE_BODY_SIZE      (4000)
+#define IMAGE_TLV_INFO_MAGIC (0x6907U)
+#define IMAGE_TLV_SHA256     (0x10U)
+#define IMAGE_HASH_SIZE      (32)
+#define IMAGE_HASHED_SIZE    (IMAGE_HEADER_SIZE + IMAGE_BODY_SIZE)
+#define IMAGE_TLV_SIZE       (4 + 4 + IMAGE_HASH_SIZE)
+#define IMAGE_SIZE           (IMAGE_HASHED_SIZE + IMAGE_TLV_SIZE)
+// Chunk size of the download, as received from the HTTP client
+#define CHUNK_SIZE        (512)
+#define LAST_CHUNK_OFFSET (ROUND_DOWN(IMAGE_SIZE - 1, CHUNK_SIZE))
+
+static mender_update_module_t *module;
+static uint8_t                 image[IMAGE_SIZE];
+
+mender_err_t
+mender_update_module_register (mender_update_module_t *update_module)
+{
+    // The raw image module is registered first
+    if (NULL == module)
+    {
+        module = update_module;
+    }
+    return MENDER_OK;
+}
+
+/**
+ * @brief Runs a state callback of the Update Module
+ */
+static mender_err_t
+prvRun (mender_update_state_t state, mender_update_state_data_t data)
+{
+    return module->callbacks[state](state, data);
+}
+
+/**
+ * @brief Downloads the image in chunks
+ * @return Number of bytes accepted before the download failed, IMAGE_SIZE
+ * if the whole image was accepted
+ */
+static size_t
+prvDownload (void)
+{
+    mender_update_download_state_data_t dl_data = { 0 };
+    mender_update_state_data_t data = { .download_state_data = &dl_data };
+
+    dl_data.filename = "zephyr.signed.bin";
+    dl_data.size     = IMAGE_SIZE;
+    for (size_t offset = 0; offset < IMAGE_SIZE; offset += CHUNK_SIZE)
+    {
+        dl_data.offset      = offset;
+        dl_data.data        = &image[offset];
+        dl_data.data_length = MIN(CHUNK_SIZE, IMAGE_SIZE - offset);
+        if (MENDER_OK != prvRun(MENDER_UPDATE_STATE_DOWNLOAD, data))
+        {
+            return offset;
+        }
+    }
+
+    return IMAGE_SIZE;
+}
+
+/**
+ * @brief Runs the install state as the client does after the download
+ */
+static mender_err_t
+prvInstall (void)
+{
+    mender_update_state_data_t data = { 0 };
+
+    return prvRun(MENDER_UPDATE_STATE_INSTALL, data);
+}
+
+ZTEST(ota_image, test_valid_image_is_installed)
+{
+    zassert_equal(prvDownload(), IMAGE_SIZE);
+    zassert_equal(prvInstall(), MENDER_OK);
+}
+
+ZTEST(ota_image, test_corrupted_header_is_rejected_in_first_chunk)
+{
+    image[0] ^= 0xff;
+    zassert_equal(prvDownload(), 0);
+    zassert_equal(prvInstall(), MENDER_FAIL);
+}
+
+ZTEST(ota_image, test_corrupted_body_is_rejected_at_hash)
+{
+    image[IMAGE_HEADER_SIZE + IMAGE_BODY_SIZE / 2] ^= 0xff;
+    // The body has a single hash, it is only compared once the TLV arrives
+    zassert_equal(prvDownload(), LAST_CHUNK_OFFSET);
+    zassert_equal(prvInstall(), MENDER_FAIL);
+}
+
+ZTEST(ota_image, test_missing_hash_is_rejected)
+{
+    // Any TLV other than the SHA256 one is skipped
+    sys_put_le16(0x01U, &image[IMAGE_HASHED_SIZE + 4]);
+    zassert_equal(prvDownload(), LAST_CHUNK_OFFSET);
+    zassert_equal(prvInstall(), MENDER_FAIL);
+}
+
+ZTEST(ota_image, test_image_larger_than_payload_is_rejected)
+{
+    sys_put_le32(IMAGE_SIZE, &image[12]);
+    zassert_equal(prvDownload(), 0);
+    zassert_equal(prvInstall(), MENDER_FAIL);
+}
+
+static void *
+prvSetup (void)
+{
+    zassert_true(ota_image_register_update_module());
+    zassert_not_null(module);
+    return NULL;
+}
+
+static void
+prvBefore (void *fixture)
+{
+    ARG_UNUSED(fixture);
+    uint8_t *tlv = &image[IMAGE_HASHED_SIZE];
+
+    // Header, load address 0, no protected TLV, version 0.0.0
+    memset(image, 0, IMAGE_HEADER_SIZE);
+    sys_put_le32(IMAGE_MAGIC, &image[0]);
+    sys_put_le16(IMAGE_HEADER_SIZE, &image[8]);
+    sys_put_le32(IMAGE_BODY_SIZE, &image[12]);
+    for (size_t index = 0; index < IMAGE_BODY_SIZE; index++)
+    {
+        image[IMAGE_HEADER_SIZE + index] = (uint8_t)index;
+    }
+
+    // TLV area holding the SHA256 of the header and the body
+    sys_put_le16(IMAGE_TLV_INFO_MAGIC, &tlv[0]);
+    sys_put_le16(IMAGE_TLV_SIZE, &tlv[2]);
+    sys_put_le16(IMAGE_TLV_SHA256, &tlv[4]);
+    sys_put_le16(IMAGE_HASH_SIZE, &tlv[6]);
+    zassert_ok(mbedtls_sha256(image, IMAGE_HASHED_SIZE, &tlv[8], 0));
+}
+
+ZTEST_SUITE(ota_image, NULL, prvSetup, prvBefore, NULL, NULL);
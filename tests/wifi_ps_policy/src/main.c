@@ -0,0 +1,135 @@
+/**
+ * @file      main.c
+ * @author    Theodore Bardy
+ *
+ * @note      This file is part of Witekio's Zephyr Demo project
+ * @brief     Wi-Fi power save policy tests against the fake driver
+ */
+
+#include <zephyr/kernel.h>
+#include <zephyr/net/net_if.h>
+#include <zephyr/ztest.h>
+
+#include "wifi_ps_policy.h"
+
+// Level in effect without activity, the deep one needs the wake-up parameters
+#ifdef CONFIG_APP_WIFI_FAKE_PS_STATE_ONLY
+#define IDLE_LEVEL (WIFI_PS_LEVEL_BALANCED)
+#else
+#define IDLE_LEVEL (WIFI_PS_LEVEL_DEEP)
+#endif // CONFIG_APP_WIFI_FAKE_PS_STATE_ONLY
+// Idle delay with a margin for the work queue
+#define IDLE_WAIT_MS (CONFIG_APP_WIFI_PS_IDLE_DELAY_MS + 50)
+
+static struct wifi_ps_stats before;
+
+ZTEST(wifi_ps_policy, test_select)
+{
+    zassert_equal(wifi_ps_policy_select(0), WIFI_PS_LEVEL_DEEP);
+    zassert_equal(wifi_ps_policy_select(BIT(WIFI_PS_ACTIVITY_EXCHANGE)),
+                  WIFI_PS_LEVEL_BALANCED);
+    zassert_equal(wifi_ps_policy_select(BIT(WIFI_PS_ACTIVITY_DOWNLOAD)),
+                  WIFI_PS_LEVEL_PERFORMANCE);
+    zassert_equal(wifi_ps_policy_select(BIT(WIFI_PS_ACTIVITY_EXCHANGE)
+                                        | BIT(WIFI_PS_ACTIVITY_DOWNLOAD)),
+                  WIFI_PS_LEVEL_PERFORMANCE);
+}
+
+ZTEST(wifi_ps_policy, test_start_applies_idle_level)
+{
+    struct wifi_ps_stats stats;
+
+    wifi_ps_policy_get_stats(&stats);
+    zassert_equal(wifi_ps_policy_get_level(), IDLE_LEVEL);
+    zassert_equal(stats.switches - before.switches, 1);
+    zassert_equal(stats.partial - before.partial,
+                  (WIFI_PS_LEVEL_DEEP == IDLE_LEVEL) ? 0 : 1);
+    zassert_equal(stats.failures, before.failures);
+}
+
+ZTEST(wifi_ps_policy, test_raise_at_once_lower_after_delay)
+{
+    wifi_ps_policy_begin(WIFI_PS_ACTIVITY_DOWNLOAD);
+    zassert_equal(wifi_ps_policy_get_level(), WIFI_PS_LEVEL_PERFORMANCE);
+
+    wifi_ps_policy_end(WIFI_PS_ACTIVITY_DOWNLOAD);
+    zassert_equal(wifi_ps_policy_get_level(), WIFI_PS_LEVEL_PERFORMANCE);
+    k_msleep(IDLE_WAIT_MS);
+    zassert_equal(wifi_ps_policy_get_level(), IDLE_LEVEL);
+}
+
+ZTEST(wifi_ps_policy, test_exchange_between_downloads)
+{
+    wifi_ps_policy_begin(WIFI_PS_ACTIVITY_EXCHANGE);
+    zassert_equal(wifi_ps_policy_get_level(), WIFI_PS_LEVEL_BALANCED);
+    wifi_ps_policy_begin(WIFI_PS_ACTIVITY_DOWNLOAD);
+    zassert_equal(wifi_ps_policy_get_level(), WIFI_PS_LEVEL_PERFORMANCE);
+
+    // Back to the exchange level once the download is over
+    wifi_ps_policy_end(WIFI_PS_ACTIVITY_DOWNLOAD);
+    k_msleep(IDLE_WAIT_MS);
+    zassert_equal(wifi_ps_policy_get_level(), WIFI_PS_LEVEL_BALANCED);
+
+    wifi_ps_policy_end(WIFI_PS_ACTIVITY_EXCHANGE);
+    k_msleep(IDLE_WAIT_MS);
+    zassert_equal(wifi_ps_policy_get_level(), IDLE_LEVEL);
+}
+
+ZTEST(wifi_ps_policy, test_degraded_level_is_not_reapplied)
+{
+    struct wifi_ps_stats stats;
+    struct wifi_ps_stats later;
+
+    // Each level rejects its wake-up parameters in the state only mode
+    wifi_ps_policy_begin(WIFI_PS_ACTIVITY_EXCHANGE);
+    wifi_ps_policy_end(WIFI_PS_ACTIVITY_EXCHANGE);
+    k_msleep(IDLE_WAIT_MS);
+    wifi_ps_policy_get_stats(&stats);
+    zassert_equal(stats.switches - before.switches, 3);
+    zassert_equal(stats.partial - before.partial,
+                  (WIFI_PS_LEVEL_DEEP == IDLE_LEVEL) ? 0 : 3);
+
+    // The selected level did not change, nothing is requested again
+    k_msleep(2 * IDLE_WAIT_MS);
+    wifi_ps_policy_get_stats(&later);
+    zassert_equal(later.switches, stats.switches);
+    zassert_equal(later.partial, stats.partial);
+}
+
+ZTEST(wifi_ps_policy, test_time_accounted_to_level_in_effect)
+{
+    struct wifi_ps_stats stats;
+
+    k_msleep(200);
+    wifi_ps_policy_stop();
+    wifi_ps_policy_get_stats(&stats);
+    zassert_equal(wifi_ps_policy_get_level(), WIFI_PS_LEVEL_COUNT);
+    zassert_true(stats.time_ms[IDLE_LEVEL] - before.time_ms[IDLE_LEVEL]
+                 >= 200);
+    if (WIFI_PS_LEVEL_DEEP != IDLE_LEVEL)
+    {
+        zassert_equal(stats.time_ms[WIFI_PS_LEVEL_DEEP], 0);
+    }
+}
+
+static void
+prvBefore (void *fixture)
+{
+    ARG_UNUSED(fixture);
+    struct net_if *iface = net_if_get_default();
+
+    zassert_not_null(iface);
+    wifi_ps_policy_get_stats(&before);
+    wifi_ps_policy_start(iface);
+}
+
+static void
+prvAfter (void *fixture)
+{
+    ARG_UNUSED(fixture);
+    wifi_ps_policy_end(WIFI_PS_ACTIVITY_DOWNLOAD);
+    wifi_ps_policy_end(WIFI_PS_ACTIVITY_EXCHANGE);
+    wifi_ps_policy_stop();
+}
+
+ZTEST_SUITE(wifi_ps_policy, NULL, NULL, prvBefore, prvAfter, NULL);
@@ -0,0 +1,153 @@
+/**
+ * @file      main.c
+ * @author    Theodore Bardy
+ *
+ * @note      This file is part of Witekio's Zephyr Demo project
+ * @brief     Wi-Fi selection and roaming tests against the fake driver
+ */
+
+#include <string.h>
+#include <zephyr/kernel.h>
+#include <zephyr/net/net_if.h>
+#include <zephyr/net/wifi_mgmt.h>
+#include <zephyr/ztest.h>
+
+#include "wifi_agent.h"
+#include "wifi_select.h"
+
+// Scan of the fake driver with a margin for the work queue
+#define SCAN_TIMEOUT_MS (1000)
+// Time for the associated access point to cross the roaming threshold, and
+// for the check and the scan that follow
+#define DEGRADE_WAIT_MS (4000)
+
+static struct net_if *iface;
+static K_SEM_DEFINE(scanned, 0, 1);
+// Roams requested to the Wi-Fi agent
+static atomic_t roam_calls;
+
+bool
+wifi_agent_roam (void)
+{
+    atomic_inc(&roam_calls);
+    return true;
+}
+
+static void
+prvScanDone (size_t count)
+{
+    ARG_UNUSED(count);
+    k_sem_give(&scanned);
+}
+
+/**
+ * @brief Associates with a candidate of the fake driver, as the agent does
+ */
+static void
+prvConnect (const struct wifi_candidate *candidate)
+{
+    struct wifi_connect_req_params params = { 0 };
+
+    params.ssid        = (const uint8_t *)candidate->cred.ssid;
+    params.ssid_length = strlen(candidate->cred.ssid);
+    params.psk         = (const uint8_t *)candidate->cred.psk;
+    params.psk_length  = strlen(candidate->cred.psk);
+    params.channel     = candidate->channel;
+    params.security    = candidate->security;
+    memcpy(params.bssid, candidate->bssid, sizeof(params.bssid));
+    zassert_ok(
+        net_mgmt(NET_REQUEST_WIFI_CONNECT, iface, &params, sizeof(params)));
+    wifi_select_set_current(iface, candidate);
+}
+
+ZTEST(wifi_select, test_scan_ranks_known_networks)
+{
+    struct wifi_candidate candidate;
+
+    // The priority of Office does not make up for its 15 dB weaker signal,
+    // and Guest is unknown
+    zassert_true(wifi_select_get(0, &candidate));
+    zassert_str_equal(candidate.cred.ssid, "WitekioPSK");
+    zassert_equal(candidate.rssi, -60);
+    zassert_true(wifi_select_get(1, &candidate));
+    zassert_str_equal(candidate.cred.ssid, "Office");
+    zassert_equal(candidate.rssi, -75);
+    zassert_false(wifi_select_get(2, &candidate));
+}
+
+ZTEST(wifi_select, test_roam_waits_for_release)
+{
+    struct wifi_candidate candidate;
+    atomic_val_t          calls = atomic_get(&roam_calls);
+
+    zassert_true(wifi_select_get(0, &candidate));
+    prvConnect(&candidate);
+    wifi_select_roam_begin();
+
+    // The roam is selected during the download, not carried out
+    k_msleep(DEGRADE_WAIT_MS);
+    zassert_equal(atomic_get(&roam_calls), calls);
+    zassert_true(wifi_select_get(0, &candidate));
+    zassert_str_equal(candidate.cred.ssid, "Office");
+
+    wifi_select_roam_end();
+    zassert_equal(atomic_get(&roam_calls), calls);
+    wifi_select_release();
+    k_msleep(100);
+    zassert_equal(atomic_get(&roam_calls), calls + 1);
+
+    // Once
+    wifi_select_release();
+    k_msleep(100);
+    zassert_equal(atomic_get(&roam_calls), calls + 1);
+}
+
+ZTEST(wifi_select, test_no_roam_on_good_signal)
+{
+    struct wifi_candidate candidate;
+    atomic_val_t          calls = atomic_get(&roam_calls);
+
+    zassert_true(wifi_select_get(0, &candidate));
+    prvConnect(&candidate);
+    wifi_select_roam_begin();
+    k_msleep(CONFIG_APP_WIFI_ROAM_CHECK_MS);
+    wifi_select_roam_end();
+    wifi_select_release();
+    k_msleep(100);
+    zassert_equal(atomic_get(&roam_calls), calls);
+}
+
+static void *
+prvSetup (void)
+{
+    iface = net_if_get_default();
+    zassert_not_null(iface);
+    zassert_true(wifi_select_init());
+    return NULL;
+}
+
+static void
+prvBefore (void *fixture)
+{
+    ARG_UNUSED(fixture);
+
+    k_sem_reset(&scanned);
+    wifi_select_scan(iface, prvScanDone);
+    zassert_ok(k_sem_take(&scanned, K_MSEC(SCAN_TIMEOUT_MS)));
+}
+
+static void
+prvAfter (void *fixture)
+{
+    ARG_UNUSED(fixture);
+    struct wifi_connect_req_params params = { 0 };
+
+    wifi_select_roam_end();
+    wifi_select_set_current(NULL, NULL);
+    // Leave the access point, its signal is back for the next test
+    params.ssid        = (const uint8_t *)"none";
+    params.ssid_length = strlen("none");
+    net_mgmt(NET_REQUEST_WIFI_CONNECT, iface, &params, sizeof(params));
+}
+
+ZTEST_SUITE(wifi_select, NULL, prvSetup, prvBefore, prvAfter, NULL);